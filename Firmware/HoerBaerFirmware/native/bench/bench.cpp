@@ -0,0 +1,501 @@
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "nativestats.h"
+#include "sdcard.h"
+#include "id3parser.h"
+#include "metadatacache.h"
+#include "mp3seektable.h"
+#include "directorylisting.h"
+#include "uidparser.h"
+#include "blemessages.h"
+#include "power_state_characteristic.pb.h"
+#include "player_state_characteristic.pb.h"
+#include "network_state_characteristic.pb.h"
+#include "library_characteristic.pb.h"
+
+// Host benchmarks of the modules that do not need hardware. Run with:
+//   pio run -e native -t exec
+//
+// Every benchmark reports wall time, throughput, heap allocations and file system calls,
+// so regressions show up as changed numbers before anything is flashed. A failed correctness
+// check makes the run exit non-zero.
+
+#define BENCH_SLOT_COUNT 9
+#define BENCH_COVER_SIZE (300 * 1024)
+#define BENCH_AUDIO_SIZE (2 * 1024 * 1024)
+#define BENCH_MESSAGE_ROUNDS 100000
+#define BENCH_UID_ROUNDS 100000
+#define BENCH_SEEK_FILE_MINUTES 10
+#define BENCH_SEEK_ROUNDS 10000
+#define BENCH_LIBRARY_PAGE_SIZE (128 - 3)   // default MTU minus ATT header
+
+static const size_t libraryTrackCounts[] = { 100, 1000, 10000 };
+
+static int failedChecks = 0;
+
+// correctness checks of the benchmarked results, any failure fails the run
+static void checkFailed(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("FAILED: ");
+    vprintf(format, args);
+    va_end(args);
+    failedChecks++;
+}
+
+class Benchmark {
+    private:
+        const char* name;
+        std::chrono::steady_clock::time_point start;
+    public:
+        Benchmark(const char* name) : name(name)
+        {
+            resetNativeStats();
+            this->start = std::chrono::steady_clock::now();
+        }
+
+        void report(size_t operations, const char* unit)
+        {
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+            auto stats = nativeStats;
+            printf("%-28s %8zu %-8s %9.2f ms %12.0f %s/s  allocs %8llu (%10llu B)  opens %6llu seeks %6llu reads %6llu (%10llu B)\n",
+                this->name, operations, unit, elapsed * 1000.0, operations / elapsed, unit,
+                (unsigned long long)stats.allocations, (unsigned long long)stats.allocatedBytes,
+                (unsigned long long)stats.fileOpens, (unsigned long long)stats.fileSeeks,
+                (unsigned long long)stats.fileReads, (unsigned long long)stats.bytesRead);
+        }
+};
+
+static void appendSynchsafe(std::string& out, uint32_t value)
+{
+    out += (char)((value >> 21) & 0x7F);
+    out += (char)((value >> 14) & 0x7F);
+    out += (char)((value >> 7) & 0x7F);
+    out += (char)(value & 0x7F);
+}
+
+static void appendFrameHeader(std::string& out, const char* id, uint32_t size)
+{
+    out.append(id, 4);
+    out += (char)(size >> 24);
+    out += (char)(size >> 16);
+    out += (char)(size >> 8);
+    out += (char)size;
+    out.append(2, '\0');
+}
+
+static void appendTextFrame(std::string& out, const char* id, const std::string& text)
+{
+    appendFrameHeader(out, id, text.size() + 1);
+    out += '\x03'; // UTF-8
+    out += text;
+}
+
+// ID3v2.3 tag as typical for ripped audio books: album frame, large cover art in front of the text frames
+static std::vector<fs::FakeSegment> buildTrackFile(size_t slot, size_t track)
+{
+    std::string album = "Hoerspiel " + std::to_string(slot);
+    std::string title = "Kapitel " + std::to_string(track + 1);
+    std::string artist = "Erzaehler " + std::to_string(slot);
+
+    std::string frames;
+    appendTextFrame(frames, "TALB", album);
+    appendFrameHeader(frames, "APIC", BENCH_COVER_SIZE);
+    uint32_t coverOffset = 10 + frames.size();
+
+    std::string tail;
+    appendTextFrame(tail, "TIT2", title);
+    appendTextFrame(tail, "TPE1", artist);
+
+    std::string header("ID3\x03\x00\x00", 6);
+    appendSynchsafe(header, frames.size() + BENCH_COVER_SIZE + tail.size());
+
+    std::vector<fs::FakeSegment> segments;
+    segments.push_back({ 0, header + frames });
+    segments.push_back({ coverOffset + BENCH_COVER_SIZE, tail });
+    return segments;
+}
+
+static std::string slotPath(size_t slot)
+{
+    return "/bench/slot" + std::to_string(slot);
+}
+
+static std::string trackPath(size_t slot, size_t track)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/track%05zu.mp3", track);
+    return slotPath(slot) + name;
+}
+
+static void createLibrary(FSTYPE& fs, size_t trackCount)
+{
+    fs.clear();
+    for(size_t i = 0; i < trackCount; i++)
+    {
+        size_t slot = i % BENCH_SLOT_COUNT;
+        size_t track = i / BENCH_SLOT_COUNT;
+        fs.addFile(trackPath(slot, track), buildTrackFile(slot, track), BENCH_AUDIO_SIZE, 1700000000 + i);
+    }
+}
+
+static std::unique_ptr<MetadataCache> benchTagParsing(FSTYPE& fs, size_t trackCount)
+{
+    MetadataCacheBuilder builder;
+    std::unique_ptr<uint8_t[]> id3Buffer(new uint8_t[ID3_PARSER_BUFFER_SIZE]);
+    size_t tagged = 0;
+
+    Benchmark bench("parse tags + build cache");
+    for(size_t slot = 0; slot < BENCH_SLOT_COUNT; slot++)
+    {
+        builder.beginSlot(slotPath(slot).c_str(), 0);
+
+        File dir = fs.open(slotPath(slot).c_str());
+        for(File file = dir.openNextFile(); file; file = dir.openNextFile())
+        {
+            std::string path = file.path();
+            auto size = file.size();
+            auto lastWrite = file.getLastWrite();
+
+            // one pass over the file, like the scanner workers
+            ID3BlockReader reader(file, id3Buffer.get(), ID3_PARSER_BUFFER_SIZE);
+            auto tags = ID3Parser::readId3Tags(reader, size, ID3_PARSER_BUFFER_SIZE);
+            if(!tags.title.empty())
+                tagged++;
+            MP3SeekTable header;
+            uint32_t durationMs = header.readHeader(reader, size) ? header.getDurationMs() : 0;
+            file.close();
+            builder.addTrack(path.c_str(), tags.title.c_str(), tags.artist.c_str(), size, lastWrite, 
+                tags.trackNumber, tags.discNumber, durationMs);
+        }
+        dir.close();
+    }
+    auto cache = builder.build();
+    bench.report(trackCount, "tracks");
+
+    if(tagged != trackCount)
+        checkFailed("only %zu of %zu tracks had tags\n", tagged, trackCount);
+
+    return cache;
+}
+
+static void benchCache(FSTYPE& fs, MetadataCache& cache, size_t trackCount)
+{
+    {
+        Benchmark bench("cache save");
+        if(!cache.save(fs, "/_metaCache.bin"))
+            checkFailed("cache save failed\n");
+        bench.report(trackCount, "tracks");
+    }
+
+    MetadataCache loaded;
+    {
+        Benchmark bench("cache load");
+        if(!loaded.load(fs, "/_metaCache.bin"))
+            checkFailed("cache load failed\n");
+        bench.report(trackCount, "tracks");
+    }
+
+    {
+        Benchmark bench("cache lookup (findTrack)");
+        size_t found = 0;
+        for(size_t slot = 0; slot < loaded.getSlotCount(); slot++)
+        {
+            for(size_t i = 0; i < loaded.getTrackCount(slot); i++)
+            {
+                // no hint, worst case of a reordered listing
+                if(loaded.findTrack(slot, loaded.getTrackPath(slot, i), SIZE_MAX) >= 0)
+                    found++;
+            }
+        }
+        bench.report(found, "lookups");
+    }
+
+    {
+        Benchmark bench("cache lookup (findPath)");
+        size_t found = 0;
+        size_t slot, index;
+        for(size_t iSlot = 0; iSlot < loaded.getSlotCount(); iSlot++)
+        {
+            for(size_t i = 0; i < loaded.getTrackCount(iSlot); i++)
+            {
+                auto path = loaded.getTrackPath(iSlot, i);
+                if(loaded.findPath(path, strlen(path), slot, index))
+                    found++;
+            }
+        }
+        bench.report(found, "lookups");
+    }
+
+    printf("cache size %zu bytes (%.1f bytes/track)\n", loaded.getSizeBytes(), (double)loaded.getSizeBytes() / trackCount);
+}
+
+// All slots as BLE library pages of one notification each (default MTU)
+static void benchLibraryPages(MetadataCache& cache, size_t trackCount)
+{
+    uint8_t buffer[BENCH_LIBRARY_PAGE_SIZE];
+    size_t pages = 0;
+    size_t totalBytes = 0;
+
+    Benchmark bench("BLE library pages");
+    for(size_t slot = 0; slot < cache.getSlotCount(); slot++)
+    {
+        LibraryTrackSource source = [&](size_t index, LibraryTrackInfo& track) {
+            const char* path = cache.getTrackPath(slot, index);
+            track.pathHash = MetadataCache::hashPath(path, strlen(path));
+            track.title = cache.getTrackTitle(slot, index);
+            track.artist = cache.getTrackArtist(slot, index);
+            track.durationSeconds = cache.getTrackDurationMs(slot, index) / 1000;
+            return true;
+        };
+
+        size_t count = cache.getTrackCount(slot);
+        size_t next = 0;
+        do
+        {
+            LibraryPageCharacteristic page = LibraryPageCharacteristic_init_zero;
+            page.slotIndex = slot;
+            page.slotCount = cache.getSlotCount();
+            page.trackCount = count;
+            page.firstTrack = next;
+            size_t length = 0;
+            size_t written = 0;
+            if(!BLEMessages::encodeLibraryPage(page, source, count, buffer, sizeof(buffer), length, written) || 
+                (written == 0 && next < count))
+            {
+                checkFailed("library page encoding failed at slot %zu track %zu\n", slot, next);
+                break;
+            }
+            next += written;
+            totalBytes += length;
+            pages++;
+        } while(next < count);
+    }
+    bench.report(trackCount, "tracks");
+
+    printf("%zu pages, %zu bytes (%.1f tracks/page)\n", pages, totalBytes, (double)trackCount / pages);
+}
+
+static void benchMessages()
+{
+    uint8_t buffer[512];
+    size_t length = 0;
+    size_t totalBytes = 0;
+
+    {
+        Benchmark bench("BLE encode power state");
+        for(size_t i = 0; i < BENCH_MESSAGE_ROUNDS; i++)
+        {
+            PowerStateCharacteristic message = PowerStateCharacteristic_init_zero;
+            message.batteryPresent = true;
+            message.batteryVoltage = 3.7f + (i % 50) * 0.01f;
+            message.batteryPercentage = i % 100;
+            message.charging = (i & 1) != 0;
+            BLEMessages::encode(PowerStateCharacteristic_fields, &message, buffer, sizeof(buffer), length);
+            totalBytes += length;
+        }
+        bench.report(BENCH_MESSAGE_ROUNDS, "msgs");
+    }
+
+    {
+        Benchmark bench("BLE encode player state");
+        for(size_t i = 0; i < BENCH_MESSAGE_ROUNDS; i++)
+        {
+            PlayerStateCharacteristic message = PlayerStateCharacteristic_init_zero;
+            message.state = PlayerState_PLAYER_PLAYING;
+            message.slotActive = i % BENCH_SLOT_COUNT;
+            message.fileIndex = i % 40;
+            message.fileCount = 40;
+            message.currentTime = i % 3600;
+            message.duration = 3600;
+            message.volume = i % 16;
+            message.maxVolume = 16;
+            BLEMessages::encode(PlayerStateCharacteristic_fields, &message, buffer, sizeof(buffer), length);
+            totalBytes += length;
+        }
+        bench.report(BENCH_MESSAGE_ROUNDS, "msgs");
+    }
+
+    {
+        Benchmark bench("BLE encode network state");
+        for(size_t i = 0; i < BENCH_MESSAGE_ROUNDS; i++)
+        {
+            NetworkStateCharacteristic message = NetworkStateCharacteristic_init_zero;
+            message.enabled = true;
+            message.connected = true;
+            message.ipV4Address = 0x0A00000A + i;
+            message.rssi = -40 - (i % 50);
+            BLEMessages::encode(NetworkStateCharacteristic_fields, &message, buffer, sizeof(buffer), length);
+            totalBytes += length;
+        }
+        bench.report(BENCH_MESSAGE_ROUNDS, "msgs");
+    }
+
+    {
+        Benchmark bench("BLE decode player state");
+        PlayerStateCharacteristic source = PlayerStateCharacteristic_init_zero;
+        source.state = PlayerState_PLAYER_PLAYING;
+        source.fileCount = 40;
+        source.duration = 3600;
+        BLEMessages::encode(PlayerStateCharacteristic_fields, &source, buffer, sizeof(buffer), length);
+        for(size_t i = 0; i < BENCH_MESSAGE_ROUNDS; i++)
+        {
+            PlayerStateCharacteristic message = PlayerStateCharacteristic_init_zero;
+            BLEMessages::decode(PlayerStateCharacteristic_fields, &message, buffer, length);
+        }
+        bench.report(BENCH_MESSAGE_ROUNDS, "msgs");
+    }
+
+    printf("encoded %zu bytes\n", totalBytes);
+}
+
+// MPEG1 layer III, 128 kbit/s, 44.1 kHz, stereo: 417 byte frames of 1152 samples
+static std::string buildMp3File(bool xingHeader)
+{
+    const size_t frameSize = 417;
+    size_t frameCount = BENCH_SEEK_FILE_MINUTES * 60 * 44100 / 1152;
+
+    std::string data("ID3\x03\x00\x00\x00\x00\x00\x00", 10);
+    data.reserve(10 + (frameCount + 1) * frameSize);
+
+    std::string frame(frameSize, '\0');
+    frame[0] = '\xFF';
+    frame[1] = '\xFB';
+    frame[2] = '\x90';
+    frame[3] = '\x00';
+
+    if(xingHeader)
+    {
+        std::string xing = frame;
+        uint32_t bytes = (frameCount + 1) * frameSize;
+        memcpy(&xing[36], "Xing\x00\x00\x00\x07", 8);
+        for(int i = 0; i < 4; i++)
+        {
+            xing[44 + i] = (char)(frameCount >> (24 - 8 * i));
+            xing[48 + i] = (char)(bytes >> (24 - 8 * i));
+        }
+        for(int i = 0; i < 100; i++)
+            xing[52 + i] = (char)(i * 256 / 100);
+        data += xing;
+    }
+
+    for(size_t i = 0; i < frameCount; i++)
+        data += frame;
+
+    return data;
+}
+
+static void benchSeekTables()
+{
+    FSTYPE fs;
+    fs.addFile("/cbr.mp3", { { 0, buildMp3File(false) } }, 10 + BENCH_SEEK_FILE_MINUTES * 60 * 44100 / 1152 * 417, 0);
+    auto xingFile = buildMp3File(true);
+    fs.addFile("/xing.mp3", { { 0, xingFile } }, xingFile.size(), 0);
+
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[32 * 1024]);
+    const char* paths[] = { "/xing.mp3", "/cbr.mp3" };
+
+    for(auto path : paths)
+    {
+        MP3SeekTable table;
+        {
+            Benchmark bench("seek table read header");
+            table.readHeader(fs, path, buffer.get(), ID3_PARSER_BUFFER_SIZE);
+            bench.report(1, "files");
+        }
+        printf("%s: type %d, duration %u ms\n", path, table.getType(), table.getDurationMs());
+    }
+
+    MP3SeekTable index;
+    {
+        Benchmark bench("seek table frame index");
+        index.buildFrameIndex(fs, "/cbr.mp3", buffer.get(), 32 * 1024);
+        bench.report(BENCH_SEEK_FILE_MINUTES * 60, "seconds");
+    }
+    printf("frame index: duration %u ms\n", index.getDurationMs());
+
+    {
+        Benchmark bench("seek table lookup");
+        uint64_t sum = 0;
+        for(size_t i = 0; i < BENCH_SEEK_ROUNDS; i++)
+            sum += index.getOffset((i * 7919) % index.getDurationMs());
+        bench.report(BENCH_SEEK_ROUNDS, "lookups");
+        printf("offset checksum %llu\n", (unsigned long long)sum);
+    }
+}
+
+// One slot directory as read from the card, then every track queried by its index
+static void benchDirectoryListing(size_t trackCount)
+{
+    DirectoryListing listing;
+    char name[32];
+    {
+        Benchmark bench("directory listing build");
+        for(size_t i = trackCount; i > 0; i--)
+        {
+            snprintf(name, sizeof(name), "%05zu - Track.mp3", i);
+            listing.addFile(name, BENCH_AUDIO_SIZE, 1700000000 + i);
+        }
+        listing.sort();
+        bench.report(trackCount, "entries");
+    }
+
+    {
+        size_t found = 0;
+        Benchmark bench("directory listing n-th file");
+        for(size_t i = 0; i < listing.getFileCount(); i++)
+            found += listing.getFileName(i)[0] != 0;
+        bench.report(found, "lookups");
+    }
+}
+
+static void benchUidParsing()
+{
+    std::array<uint8_t, UID_MAX_SIZE> uid;
+    uint8_t uidSize = 0;
+    size_t parsed = 0;
+    char formatted[UID_MAX_SIZE * 3];
+
+    Benchmark bench("UID parse + format");
+    for(size_t i = 0; i < BENCH_UID_ROUNDS; i++)
+    {
+        if(UIDParser::parse((i & 1) ? "04:A3:1F:22:5B:80:01" : "04a31f22", uid, uidSize))
+            parsed += UIDParser::format(uid.data(), uidSize, formatted, sizeof(formatted)) > 0;
+    }
+    bench.report(parsed, "uids");
+}
+
+int main()
+{
+    FSTYPE fs;
+
+    for(auto trackCount : libraryTrackCounts)
+    {
+        printf("\n=== library with %zu tracks in %d slots ===\n", trackCount, BENCH_SLOT_COUNT);
+        createLibrary(fs, trackCount);
+        auto cache = benchTagParsing(fs, trackCount);
+        benchCache(fs, *cache, trackCount);
+        benchLibraryPages(*cache, trackCount);
+        benchDirectoryListing(trackCount);
+    }
+
+    printf("\n=== MP3 seek tables (%d minute file) ===\n", BENCH_SEEK_FILE_MINUTES);
+    benchSeekTables();
+
+    printf("\n=== BLE messages / RFID ===\n");
+    benchMessages();
+    benchUidParsing();
+
+    if(failedChecks > 0)
+    {
+        printf("\n%d checks failed\n", failedChecks);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF heap capabilities API: PSRAM allocations end up on the
+// host heap and are counted in nativeStats.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* heap_caps_malloc(size_t size, uint32_t caps);
+void heap_caps_free(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
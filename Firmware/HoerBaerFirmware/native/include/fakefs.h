@@ -0,0 +1,78 @@
+#pragma once
+
+// In-memory file system standing in for fs::SDMMCFS on the host build. Files can be
+// sparse: only the stored segments carry data, everything else reads as zeros. This 
+// keeps synthetic libraries with large cover art frames cheap.
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+typedef struct {
+    uint32_t offset;
+    std::string data;
+} FakeSegment;
+
+typedef struct {
+    std::vector<FakeSegment> segments;
+    size_t size;
+    time_t lastWrite;
+} FakeNode;
+
+class FakeFS;
+
+class File {
+    private:
+        FakeFS* fs;
+        std::string filePath;
+        std::shared_ptr<FakeNode> node;
+        size_t pos;
+        bool directory;
+        std::vector<std::string> children;
+        size_t nextChild;
+    public:
+        File();
+        File(FakeFS* fs, const std::string& path, std::shared_ptr<FakeNode> node);
+        File(FakeFS* fs, const std::string& path, std::vector<std::string> children);
+        operator bool() const;
+        size_t size() const;
+        size_t read(uint8_t* buffer, size_t length);
+        int read();
+        size_t readBytes(char* buffer, size_t length);
+        size_t write(const uint8_t* buffer, size_t length);
+        size_t print(const char* text);
+        bool seek(uint32_t position);
+        size_t position() const;
+        time_t getLastWrite() const;
+        bool isDirectory() const;
+        const char* name() const;
+        const char* path() const;
+        File openNextFile();
+        void close();
+};
+
+class FakeFS {
+    private:
+        std::map<std::string, std::shared_ptr<FakeNode>> files;
+    public:
+        void addFile(const std::string& path, std::vector<FakeSegment> segments, size_t size, time_t lastWrite);
+        File open(const char* path, const char* mode = FILE_READ);
+        bool exists(const char* path);
+        bool remove(const char* path);
+        size_t fileCount() const;
+        void clear();
+};
+
+}
+
+using fs::File;
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+// Counters of the host build, reset and read by the benchmarks
+typedef struct {
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t fileOpens;
+    uint64_t fileReads;
+    uint64_t fileSeeks;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+} NativeStats;
+
+extern NativeStats nativeStats;
+
+void resetNativeStats();
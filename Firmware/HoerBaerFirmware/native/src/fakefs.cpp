@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cstring>
+#include "fakefs.h"
+#include "nativestats.h"
+
+namespace fs {
+
+File::File() : fs(nullptr), node(nullptr), pos(0), directory(false), nextChild(0)
+{
+}
+
+File::File(FakeFS* fs, const std::string& path, std::shared_ptr<FakeNode> node)
+    : fs(fs), filePath(path), node(node), pos(0), directory(false), nextChild(0)
+{
+}
+
+File::File(FakeFS* fs, const std::string& path, std::vector<std::string> children)
+    : fs(fs), filePath(path), node(nullptr), pos(0), directory(true), children(std::move(children)), nextChild(0)
+{
+}
+
+File::operator bool() const
+{
+    return this->node != nullptr || this->directory;
+}
+
+size_t File::size() const
+{
+    return this->node != nullptr ? this->node->size : 0;
+}
+
+size_t File::read(uint8_t* buffer, size_t length)
+{
+    if(this->node == nullptr || this->pos >= this->node->size)
+        return 0;
+
+    nativeStats.fileReads++;
+
+    size_t count = std::min(length, this->node->size - this->pos);
+    memset(buffer, 0, count);
+
+    for(auto& segment : this->node->segments)
+    {
+        size_t segStart = segment.offset;
+        size_t segEnd = segment.offset + segment.data.size();
+        size_t from = std::max(segStart, this->pos);
+        size_t to = std::min(segEnd, this->pos + count);
+        if(from < to)
+            memcpy(buffer + (from - this->pos), segment.data.data() + (from - segStart), to - from);
+    }
+
+    this->pos += count;
+    nativeStats.bytesRead += count;
+    return count;
+}
+
+int File::read()
+{
+    uint8_t value;
+    return this->read(&value, 1) == 1 ? value : -1;
+}
+
+size_t File::readBytes(char* buffer, size_t length)
+{
+    return this->read(reinterpret_cast<uint8_t*>(buffer), length);
+}
+
+size_t File::write(const uint8_t* buffer, size_t length)
+{
+    if(this->node == nullptr)
+        return 0;
+
+    // written files are kept as one dense segment
+    if(this->node->segments.empty())
+        this->node->segments.push_back({ 0, std::string() });
+
+    auto& data = this->node->segments.front().data;
+    if(data.size() < this->pos + length)
+        data.resize(this->pos + length);
+    memcpy(&data[this->pos], buffer, length);
+
+    this->pos += length;
+    this->node->size = std::max(this->node->size, this->pos);
+    this->node->lastWrite = time(nullptr);
+    nativeStats.bytesWritten += length;
+    return length;
+}
+
+size_t File::print(const char* text)
+{
+    return this->write(reinterpret_cast<const uint8_t*>(text), strlen(text));
+}
+
+bool File::seek(uint32_t position)
+{
+    nativeStats.fileSeeks++;
+    if(this->node == nullptr || position > this->node->size)
+        return false;
+
+    this->pos = position;
+    return true;
+}
+
+size_t File::position() const
+{
+    return this->pos;
+}
+
+time_t File::getLastWrite() const
+{
+    return this->node != nullptr ? this->node->lastWrite : 0;
+}
+
+bool File::isDirectory() const
+{
+    return this->directory;
+}
+
+const char* File::name() const
+{
+    auto slash = this->filePath.find_last_of('/');
+    return this->filePath.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+const char* File::path() const
+{
+    return this->filePath.c_str();
+}
+
+File File::openNextFile()
+{
+    if(!this->directory || this->nextChild >= this->children.size())
+        return File();
+
+    std::string childPath = this->filePath;
+    if(childPath.back() != '/')
+        childPath += "/";
+    childPath += this->children[this->nextChild++];
+
+    return this->fs->open(childPath.c_str());
+}
+
+void File::close()
+{
+    this->node = nullptr;
+    this->directory = false;
+    this->children.clear();
+}
+
+void FakeFS::addFile(const std::string& path, std::vector<FakeSegment> segments, size_t size, time_t lastWrite)
+{
+    auto node = std::make_shared<FakeNode>();
+    node->segments = std::move(segments);
+    node->size = size;
+    node->lastWrite = lastWrite;
+    this->files[path] = node;
+}
+
+File FakeFS::open(const char* path, const char* mode)
+{
+    nativeStats.fileOpens++;
+    std::string filePath(path);
+
+    if(mode[0] == 'w')
+    {
+        this->addFile(filePath, {}, 0, time(nullptr));
+        return File(this, filePath, this->files[filePath]);
+    }
+
+    auto it = this->files.find(filePath);
+    if(it != this->files.end())
+    {
+        File file(this, filePath, it->second);
+        if(mode[0] == 'a')
+            file.seek(it->second->size);
+        return file;
+    }
+
+    // directories exist implicitly as prefix of the stored files
+    std::string prefix = filePath;
+    if(prefix.back() != '/')
+        prefix += "/";
+
+    std::vector<std::string> children;
+    for(auto child = this->files.lower_bound(prefix); child != this->files.end(); ++child)
+    {
+        if(child->first.compare(0, prefix.size(), prefix) != 0)
+            break;
+
+        auto name = child->first.substr(prefix.size());
+        name = name.substr(0, name.find('/'));
+        if(children.empty() || children.back() != name)
+            children.push_back(name);
+    }
+
+    if(children.empty() && filePath != "/")
+        return File();
+
+    return File(this, filePath, std::move(children));
+}
+
+bool FakeFS::exists(const char* path)
+{
+    return (bool)this->open(path);
+}
+
+bool FakeFS::remove(const char* path)
+{
+    return this->files.erase(path) > 0;
+}
+
+size_t FakeFS::fileCount() const
+{
+    return this->files.size();
+}
+
+void FakeFS::clear()
+{
+    this->files.clear();
+}
+
+}
@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <new>
+#include "esp_heap_caps.h"
+#include "nativestats.h"
+
+NativeStats nativeStats;
+
+void resetNativeStats()
+{
+    nativeStats = NativeStats();
+}
+
+void* heap_caps_malloc(size_t size, uint32_t /* caps */)
+{
+    nativeStats.allocations++;
+    nativeStats.allocatedBytes += size;
+    return malloc(size);
+}
+
+void heap_caps_free(void* ptr)
+{
+    free(ptr);
+}
+
+// count every heap allocation of the host build, not only the explicit PSRAM ones
+
+void* operator new(size_t size)
+{
+    nativeStats.allocations++;
+    nativeStats.allocatedBytes += size;
+    void* ptr = malloc(size);
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
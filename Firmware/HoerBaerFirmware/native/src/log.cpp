@@ -0,0 +1,35 @@
+#include <cstdarg>
+#include <cstdio>
+#include "log.h"
+#include "nativestats.h"
+
+// Host implementation of the firmware log, everything goes to stdout
+
+void Log::init()
+{
+}
+
+void Log::println(const char * module, const char * fmt, ...) 
+{
+    va_list va;
+    va_start (va, fmt);
+    char buf[255];
+    vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end (va);
+    printf("%s\t%s\n", module, buf);
+}
+
+void Log::logCurrentHeap(const char * text) 
+{
+    printf("MEMORY\t%s\tHeap - %llu allocations, %llu bytes\n", 
+        text, (unsigned long long)nativeStats.allocations, (unsigned long long)nativeStats.allocatedBytes);
+}
+
+void Log::printMemoryInfo() 
+{
+    Log::logCurrentHeap("Memory information");
+}
+
+void Log::printTaskInfo()
+{
+}
@@ -1,8 +1,13 @@
+#include <deque>
 #include "log.h"
 #include "config.h"
 #include "userconfig.h"
 #include "audioplayer.h"
 #include "id3parser.h"
+#include "metadatascanner.h"
+#include "directorylisting.h"
+#include "latencytrace.h"
+#include "stateevents.h"
 
 #include <Audio.h>
 Audio audio;
@@ -10,12 +15,24 @@ Audio audio;
 // this is used to passback Audio-Lib callback functions.
 unique_ptr<AudioPlayer> currentInstance = nullptr;
 
-AudioPlayer::AudioPlayer(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, shared_ptr<UserConfig> userConfig, shared_ptr<SDCard> sdCard)
+// Serializes the calls into the audio lib between the audio task and the HBI/BLE/RFID workers.
+// Recursive, because the lib callbacks (EOF) run within audio.loop().
+class AudioLock {
+    private:
+        SemaphoreHandle_t mutex;
+    public:
+        AudioLock(SemaphoreHandle_t mutex) : mutex(mutex) { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+        ~AudioLock() { xSemaphoreGiveRecursive(this->mutex); }
+};
+
+AudioPlayer::AudioPlayer(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus, shared_ptr<UserConfig> userConfig, shared_ptr<SDCard> sdCard)
+    : playerState(PlayerSnapshot{ false, false, -1, 0, 0, 0, 0, 0 })
 {
     this->i2c = i2c;
-    this->i2cSema = i2cSema;
+    this->i2cBus = i2cBus;
     this->audioConfig = userConfig->getAudioConfig();
     this->slotDirectories = userConfig->getSlotDirectories();
+    this->rfidMappings = userConfig->getRfidMappings();
     this->sdCard = sdCard;
 
     this->codec = make_unique<TAS5806>(i2c, I2C_ADDR_AUDIO_CODEC);
@@ -24,25 +41,50 @@ AudioPlayer::AudioPlayer(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, sha
 
     this->playingInfo = nullptr;
     this->currentVolume = this->audioConfig->initalVolume;
+    this->publishPlayerState();
     currentInstance = unique_ptr<AudioPlayer>(this);
 
-    // Define a map to store file names per slot directory with artist and title in PSRAM
-    this->slotFiles = std::unique_ptr<std::vector<std::vector<std::tuple<std::string, std::string, std::string>>>>(
-        new (heap_caps_malloc(sizeof(std::vector<std::vector<std::tuple<std::string, std::string, std::string>>>), MALLOC_CAP_SPIRAM)) 
-        std::vector<std::vector<std::tuple<std::string, std::string, std::string>>>());
-
-    // TODO: 
-    // - slotFiles anstatt slotDirectories verwenden?
-    // - slotFiles auch für Next brauchen?
+    // file names per slot directory with artist and title, one block in PSRAM
+    this->metadata = nullptr;
+    this->slotTracks.resize(this->slotDirectories->size(), SlotTracks{ nullptr, 0, nullptr });
+    this->indexingSlot = -1;
+
+    this->nextTrack.ready = false;
+    this->firstAudioPending = false;
+    this->firstAudioFrom = 0;
+
+    this->audioMutex = xSemaphoreCreateRecursiveMutex();
+    this->audioTaskHandle = NULL;
+    this->stats.underruns = 0;
+    this->stats.minBufferFilled = UINT32_MAX;
+    this->stats.bufferSize = 0;
+    this->bufferLow = false;
+    this->lastPlayingInfoUpdate = 0;
+    this->nextSeekTableEntry = 0;
+    this->seekIndexerRunning = false;
 }
 
 AudioPlayer::~AudioPlayer()
 {
+    if(this->audioTaskHandle != NULL)
+    {
+        xSemaphoreTakeRecursive(this->audioMutex, portMAX_DELAY);
+        vTaskDelete(this->audioTaskHandle);
+        this->audioTaskHandle = NULL;
+        xSemaphoreGiveRecursive(this->audioMutex);
+    }
+
     digitalWrite(GPIO_AUDIO_CODEC_NPDN, LOW);
     currentInstance.reset();
     currentInstance = nullptr;
 }
 
+void AudioWorkerTask(void* param)
+{
+    AudioPlayer* audioPlayer = static_cast<AudioPlayer*>(param);
+    audioPlayer->runAudioTask();
+}
+
 void AudioPlayer::initialize()
 {
     // DS p.45, 7.5.3.1 Startup Procedures
@@ -50,7 +92,9 @@ void AudioPlayer::initialize()
     Log::println("AUDIO", "Codec on");
     usleep(40 * 1000);
 
-    this->codec->resetChip();
+    this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_AUDIO, [this]() {
+        this->codec->resetChip();
+    });
     Log::println("AUDIO", "Codec reset");
     usleep(40 * 1000);
 
@@ -58,101 +102,404 @@ void AudioPlayer::initialize()
     audio.setPinout(GPIO_AUDIO_BCLK, GPIO_AUDIO_LRCLK, GPIO_AUDIO_DOUT);
     Log::println("AUDIO", "I2S clocks enabled");
 
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
+    // input buffer in PSRAM: bridges SD card stalls (other tasks, card housekeeping) while decoding
+    if(!audio.setBufsize(-1, AUDIO_INPUT_BUFFER_SIZE))
+        Log::println("AUDIO", "Unable to set input buffer size to %d bytes", AUDIO_INPUT_BUFFER_SIZE);
+    this->stats.bufferSize = AUDIO_INPUT_BUFFER_SIZE;
 
-    this->codec->setParamsAndHighZ(this->audioConfig->mono);
-    Log::println("AUDIO", "Codec params and highZ mode set");
-    usleep(10 * 1000);
+    this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_AUDIO, [this]() {
+        this->codec->setParamsAndHighZ(this->audioConfig->mono);
+        Log::println("AUDIO", "Codec params and highZ mode set");
+        usleep(10 * 1000);
 
-    this->codec->setModePlay();
-    Log::println("AUDIO", "Codec play mode set");
+        this->codec->setModePlay();
+        Log::println("AUDIO", "Codec play mode set");
 
-    this->codec->setVolume(this->currentVolume);
-    this->codec->printMonRegisters();
+        this->codec->setVolume(this->currentVolume);
+        this->codec->printMonRegisters();
+    });
 
     audio.setVolume(21); // 0 .. 21 - audio lib volume is not used. codec hw volume is used
 
-    xSemaphoreGive(this->i2cSema);
+    xTaskCreatePinnedToCore(AudioWorkerTask, "audio_worker",
+        TASK_STACK_SIZE_AUDIO_WORKER_WORDS,
+        this,
+        TASK_PRIO_AUDIO_WORKER,
+        &this->audioTaskHandle,
+        TASK_CORE_AUDIO_WORKER);
 }
 
-void AudioPlayer::populateAudioMetadata() 
+void MetadataIndexerTask(void* param)
 {
+    AudioPlayer* audioPlayer = static_cast<AudioPlayer*>(param);
+    audioPlayer->runMetadataIndexer();
+    vTaskDelete(NULL);
+}
+
+// Indexing runs in the background, slots are playable from the start (see SlotTracks)
+void AudioPlayer::startMetadataIndexing()
+{
+    this->indexingSlot = 0;
+    xTaskCreate(MetadataIndexerTask, "metadata_indexer",
+        TASK_STACK_SIZE_METADATA_INDEXER_WORDS,
+        this,
+        TASK_PRIO_METADATA_INDEXER,
+        NULL);
+}
+
+void AudioPlayer::runMetadataIndexer() 
+{
+    TickType_t start = xTaskGetTickCount();
+    auto cached = make_shared<MetadataCache>();
+    bool cacheLoaded = false;
+
     if(this->sdCard->fileExists(SDCARD_FILE_META_CACHE))
     {
         Log::println("AUDIO", "Loading audio file metadata cache from file.");
-        auto size = this->sdCard->getFileSize(SDCARD_FILE_META_CACHE);
-        DynamicJsonDocument jsonBuffer(size);
-        this->sdCard->readParseJsonFile(SDCARD_FILE_META_CACHE, jsonBuffer);
-        this->deserializeLoadedSlotsAndMetadata(jsonBuffer);
-    }
-    else {
-        Log::println("AUDIO", "Populating audio file metadata cache...");
-        TickType_t start = xTaskGetTickCount();
-        int nFound = 0;
-        int nNoMeta = 0;
+        cacheLoaded = cached->load(this->sdCard->getFs(), SDCARD_FILE_META_CACHE);
+        if(!cacheLoaded)
+            Log::println("AUDIO", "Metadata cache is invalid, rescanning all files.");
+    }
+
+    // playable with titles right away, changed slots are replaced while scanning
+    if(cacheLoaded)
+        this->publishMetadata(cached);
+
+    // Compare the slot directories with the cache: only added or changed files (size or 
+    // last write differs) are parsed again, everything else is taken from the cache.
+    // Files to parse are handed to the scanner workers while the directories are walked.
+    Log::println("AUDIO", "Scanning slot directories for changes...");
+    int nUnchanged = 0;
+    int nParsed = 0;
+    int nRemoved = 0;
+    int nNoMeta = 0;
+    bool changed = !cached->matchesSlots(*this->slotDirectories);
+    std::deque<MetadataScanEntry> entries; // does not move entries on push_back, workers write into them
+    std::vector<size_t> slotEntryStarts;
+    std::vector<uint32_t> slotLastWrites;
+    std::vector<int> cachedSlots;
+
+    auto addSlotTracks = [&](MetadataCacheBuilder& builder, size_t iDir, size_t endEntry) {
+        int cachedSlot = cachedSlots[iDir];
+        builder.beginSlot(this->slotDirectories->at(iDir).c_str(), slotLastWrites[iDir]);
+
+        for(size_t iEntry = slotEntryStarts[iDir]; iEntry < endEntry; iEntry++)
+        {
+            const auto& entry = entries[iEntry];
+            if(entry.cachedIndex >= 0)
+            {
+                builder.addTrack(entry.path.c_str(), 
+                    cached->getTrackTitle(cachedSlot, entry.cachedIndex), 
+                    cached->getTrackArtist(cachedSlot, entry.cachedIndex), 
+                    entry.size, entry.lastWrite,
+                    cached->getTrackNumber(cachedSlot, entry.cachedIndex),
+                    cached->getDiscNumber(cachedSlot, entry.cachedIndex),
+                    cached->getTrackDurationMs(cachedSlot, entry.cachedIndex));
+                continue;
+            }
+
+            builder.addTrack(entry.path.c_str(), entry.tags.title.c_str(), entry.tags.artist.c_str(), 
+                entry.size, entry.lastWrite, entry.tags.trackNumber, entry.tags.discNumber, entry.durationMs);
+        }
+    };
+
+    {
+        MetadataScanner scanner(this->sdCard->getFs());
         for(size_t iDir = 0; iDir < this->slotDirectories->size(); iDir++)
         {
-            std::vector<std::tuple<std::string, std::string, std::string>> files;
+            this->indexingSlot = iDir;
             std::string slotPath(this->slotDirectories->at(iDir).c_str());
-
-            this->sdCard->listFiles(slotPath, [&](const std::string& filePath) {
-                auto [title, artist] = ID3Parser::readId3Tags(sdCard->getFs(), filePath);
-                if (title.empty() && artist.empty())
-                    nNoMeta++;
-                else
-                    nFound++;
-                files.emplace_back(filePath, title, artist);
+            uint32_t slotLastWrite = this->sdCard->fileExists(slotPath) ? this->sdCard->getLastWrite(slotPath) : 0;
+            int cachedSlot = cached->findSlot(slotPath.c_str());
+            size_t cachedCount = cachedSlot >= 0 ? cached->getTrackCount(cachedSlot) : 0;
+            size_t nMatched = 0;
+            bool slotChanged = cachedSlot < 0 || cached->getSlotLastWrite(cachedSlot) != slotLastWrite;
+
+            slotEntryStarts.push_back(entries.size());
+            slotLastWrites.push_back(slotLastWrite);
+            cachedSlots.push_back(cachedSlot);
+
+            // the cache holds the tracks in play order, the listing is in name order: look them up
+            // by path. Same files give the same order, sorting is part of building the cache.
+            this->sdCard->listFiles(slotPath, [&](const std::string& filePath, size_t size, time_t lastWrite) {
+                size_t foundSlot, foundIndex;
+                bool found = cached->findPath(filePath.c_str(), filePath.size(), foundSlot, foundIndex) && 
+                    static_cast<int>(foundSlot) == cachedSlot;
+                if(found)
+                    nMatched++;
+
+                bool unchanged = found && 
+                    cached->getTrackSize(cachedSlot, foundIndex) == size && 
+                    cached->getTrackLastWrite(cachedSlot, foundIndex) == static_cast<uint32_t>(lastWrite);
+
+                entries.push_back({ filePath, static_cast<uint32_t>(size), static_cast<uint32_t>(lastWrite), 
+                    unchanged ? static_cast<int>(foundIndex) : -1, {}, 0 });
+
+                if(unchanged)
+                {
+                    nUnchanged++;
+                    return;
+                }
+
+                scanner.parse(&entries.back());
+                nParsed++;
+                slotChanged = true;
             });
-    
-            // Store the vector in the map
-            slotFiles->push_back(std::move(files));
+
+            if(nMatched < cachedCount)
+            {
+                nRemoved += cachedCount - nMatched;
+                slotChanged = true;
+            }
+
+            if(!slotChanged && cacheLoaded)
+                continue;
+
+            // publish the slot on its own, the complete cache is built at the end
+            changed = true;
+            scanner.waitUntilParsed();
+            MetadataCacheBuilder slotBuilder;
+            addSlotTracks(slotBuilder, iDir, entries.size());
+            this->publishSlot(iDir, shared_ptr<const MetadataCache>(slotBuilder.build()), 0);
         }
-        TickType_t duration = xTaskGetTickCount() - start;
-        Log::println("AUDIO", "Found %d files with metadata, %d without metadata (used %d ms)", nFound, nNoMeta, pdTICKS_TO_MS(duration));
 
-        Log::println("AUDIO", "Saving metadata cache to file...");
-        DynamicJsonDocument jsonBuffer(JSON_BUFFER_SIZE_TRACK_METADATA);
-        this->serializeLoadedSlotsAndMetadata(jsonBuffer);
-        this->sdCard->writeJsonFile(SDCARD_FILE_META_CACHE, jsonBuffer);
-        Log::println("AUDIO", "Metadata cache saved to file.");
+        scanner.waitUntilParsed();
+    }
+
+    for(const auto& entry : entries)
+    {
+        if(entry.cachedIndex < 0 && entry.tags.title.empty() && entry.tags.artist.empty())
+            nNoMeta++;
+    }
+
+    TickType_t duration = xTaskGetTickCount() - start;
+    Log::println("AUDIO", "Scanned slots: %d unchanged, %d parsed (%d without metadata), %d removed (used %d ms)", 
+        nUnchanged, nParsed, nNoMeta, nRemoved, pdTICKS_TO_MS(duration));
+
+    if(cacheLoaded && !changed)
+    {
+        this->indexingSlot = -1;
+        Log::println("AUDIO", "Metadata cache is up to date (%d files, %d bytes).", 
+            cached->getTotalTrackCount(), cached->getSizeBytes());
+        return;
     }
+
+    MetadataCacheBuilder builder;
+    for(size_t iDir = 0; iDir < this->slotDirectories->size(); iDir++)
+        addSlotTracks(builder, iDir, iDir + 1 < slotEntryStarts.size() ? slotEntryStarts[iDir + 1] : entries.size());
+
+    shared_ptr<MetadataCache> metadata = builder.build();
+    entries.clear();
+    cached.reset();
+    this->publishMetadata(metadata);
+    this->indexingSlot = -1;
+
+    Log::println("AUDIO", "Saving metadata cache to file...");
+    bool saved = metadata->save(this->sdCard->getFs(), SDCARD_FILE_META_CACHE);
+    this->sdCard->invalidateDirectory(SDCARD_FILE_META_CACHE);
+    if(!saved)
+    {
+        Log::println("AUDIO", "Failed to save metadata cache.");
+        return;
+    }
+
+    // JSON cache of older firmware versions is not used anymore
+    if(this->sdCard->fileExists(SDCARD_FILE_META_CACHE_LEGACY))
+        this->sdCard->removeFile(SDCARD_FILE_META_CACHE_LEGACY);
+
+    Log::println("AUDIO", "Metadata cache saved to file (%d bytes).", metadata->getSizeBytes());
 }
 
-void AudioPlayer::serializeLoadedSlotsAndMetadata(JsonDocument& doc) 
+// Makes the complete index the source of all slots (and of RFID and path lookups)
+void AudioPlayer::publishMetadata(shared_ptr<MetadataCache> metadata)
 {
-    for(size_t iDir = 0; iDir < this->slotDirectories->size(); iDir++) 
+    AudioLock lock(this->audioMutex);
+    this->metadata = metadata;
+
+    for(size_t iSlot = 0; iSlot < this->slotTracks.size(); iSlot++)
     {
-        JsonObject slot = doc.createNestedObject();
-        slot["path"] = this->slotDirectories->at(iDir).c_str();
-        auto files = slot.createNestedArray("files");
+        int cacheSlot = metadata->findSlot(this->slotDirectories->at(iSlot).c_str());
+        if(cacheSlot >= 0)
+            this->publishSlot(iSlot, metadata, cacheSlot);
+    }
+
+    this->resolveRfidMappings();
+}
 
-        auto& slotFiles = this->slotFiles->at(iDir);
-        for (const auto& [filePath, title, artist] : slotFiles) 
+// Replaces what playback knows about a slot. The playing track keeps playing, its index is
+// looked up again, the order may have changed (directory order before the slot was indexed).
+void AudioPlayer::publishSlot(size_t iSlot, shared_ptr<const MetadataCache> cache, size_t cacheSlot)
+{
+    AudioLock lock(this->audioMutex);
+    auto& tracks = this->slotTracks[iSlot];
+    tracks.cache = cache;
+    tracks.cacheSlot = cacheSlot;
+    tracks.listing = nullptr;
+    this->nextTrack.ready = false;
+
+    // indices into the slot are stale now, these are looked up by path until resolved again
+    if(this->rfidMappings != nullptr)
+    {
+        for(auto& mapping : *this->rfidMappings)
         {
-            JsonObject file = files.createNestedObject();
-            file["path"] = filePath.c_str();
-            file["title"] = title.c_str();
-            file["artist"] = artist.c_str();
+            if(mapping.slot == static_cast<int>(iSlot))
+            {
+                mapping.slot = RFID_MAPPING_UNRESOLVED;
+                mapping.index = RFID_MAPPING_UNRESOLVED;
+            }
         }
     }
+
+    if(this->playingInfo == nullptr || this->playingInfo->slot != static_cast<int>(iSlot))
+        return;
+
+    size_t foundSlot, foundIndex;
+    auto& path = this->playingInfo->path;
+    if(cache->findPath(path.c_str(), path.size(), foundSlot, foundIndex) && foundSlot == cacheSlot)
+        this->playingInfo->index = foundIndex;
+    this->playingInfo->total = cache->getTrackCount(cacheSlot);
+    this->publishPlayerState();
+}
+
+// Indexed slots are served from the metadata, the others from the listing of the slot
+// directory (read on first use): files in name order, subdirectories are not played then.
+size_t AudioPlayer::getSlotTrackCount(int iSlot)
+{
+    auto& tracks = this->slotTracks[iSlot];
+    if(tracks.cache != nullptr)
+        return tracks.cache->getTrackCount(tracks.cacheSlot);
+
+    if(tracks.listing == nullptr)
+        tracks.listing = this->sdCard->getDirectoryListing(this->slotDirectories->at(iSlot).c_str());
+
+    return tracks.listing != nullptr ? tracks.listing->getFileCount() : 0;
+}
+
+std::string AudioPlayer::getSlotTrackPath(int iSlot, size_t iTrack)
+{
+    if(iTrack >= this->getSlotTrackCount(iSlot))
+        return "";
+
+    auto& tracks = this->slotTracks[iSlot];
+    if(tracks.cache != nullptr)
+        return tracks.cache->getTrackPath(tracks.cacheSlot, iTrack);
+
+    std::string path(this->slotDirectories->at(iSlot).c_str());
+    if(path.back() != '/')
+        path += "/";
+    return path + tracks.listing->getFileName(iTrack);
 }
 
-void AudioPlayer::deserializeLoadedSlotsAndMetadata(JsonDocument& doc) 
+// Slot numbers of the metadata can differ from the slot numbers of the player (cache of an
+// older slot configuration), every slot is looked up in its own tracks.
+bool AudioPlayer::findSlotTrack(std::string_view path, size_t& slot, size_t& index)
 {
-    for(size_t iDir = 0; iDir < this->slotDirectories->size(); iDir++) 
+    for(size_t iSlot = 0; iSlot < this->slotTracks.size(); iSlot++)
     {
-        std::vector<std::tuple<std::string, std::string, std::string>> files;
+        auto& tracks = this->slotTracks[iSlot];
+        if(tracks.cache != nullptr)
+        {
+            size_t foundSlot, foundIndex;
+            if(tracks.cache->findPath(path.data(), path.size(), foundSlot, foundIndex) && foundSlot == tracks.cacheSlot)
+            {
+                slot = iSlot;
+                index = foundIndex;
+                return true;
+            }
+            continue;
+        }
 
-        auto jsonFiles = doc[iDir]["files"].as<JsonArray>();
-        for (const auto& file : jsonFiles) 
+        for(size_t iTrack = 0; iTrack < this->getSlotTrackCount(iSlot); iTrack++)
         {
-            std::string path = file["path"].as<std::string>();
-            std::string title = file["title"].as<std::string>();
-            std::string artist = file["artist"].as<std::string>();
-            files.emplace_back(path, title, artist);
+            if(this->getSlotTrackPath(iSlot, iTrack) == path)
+            {
+                slot = iSlot;
+                index = iTrack;
+                return true;
+            }
         }
+    }
+
+    return false;
+}
+
+int AudioPlayer::getIndexingSlot()
+{
+    return this->indexingSlot;
+}
+
+size_t AudioPlayer::getSlotCount()
+{
+    return this->slotTracks.size();
+}
+
+// Copy of what the slot is served from (the listing is read first if needed). Holding it keeps
+// the cache or listing alive, it can be read without the lock while the indexer goes on.
+bool AudioPlayer::getSlotTracks(int iSlot, SlotTracks& tracks, std::string& directory)
+{
+    if(iSlot < 0 || static_cast<size_t>(iSlot) >= this->slotTracks.size())
+        return false;
 
-        slotFiles->push_back(std::move(files));
+    AudioLock lock(this->audioMutex);
+    this->getSlotTrackCount(iSlot);
+    tracks = this->slotTracks[iSlot];
+    directory = this->slotDirectories->at(iSlot).c_str();
+    return true;
+}
+
+// Looks up the track of every RFID mapping once, presenting a tag then needs no path lookup at all.
+void AudioPlayer::resolveRfidMappings()
+{
+    if(this->rfidMappings == nullptr || this->metadata == nullptr)
+        return;
+
+    int nUnresolved = 0;
+    for(auto& mapping : *this->rfidMappings)
+    {
+        size_t slot, index;
+        if(this->findSlotTrack(mapping.filePath, slot, index))
+        {
+            mapping.slot = slot;
+            mapping.index = index;
+        }
+        else
+        {
+            mapping.slot = RFID_MAPPING_UNRESOLVED;
+            mapping.index = RFID_MAPPING_UNRESOLVED;
+            Log::println("AUDIO", "RFID mapping %s not found in slot metadata", mapping.filePath.c_str());
+            nUnresolved++;
+        }
+    }
+
+    Log::println("AUDIO", "Resolved %d of %d RFID mappings", 
+        this->rfidMappings->size() - nUnresolved, this->rfidMappings->size());
+}
+
+void AudioPlayer::serializeLoadedSlotsAndMetadata(JsonDocument& doc) 
+{
+    // the index is never changed once published, only replaced
+    shared_ptr<const MetadataCache> metadata;
+    {
+        AudioLock lock(this->audioMutex);
+        metadata = this->metadata;
+    }
+
+    if(metadata == nullptr)
+        return;
+
+    for(size_t iDir = 0; iDir < metadata->getSlotCount(); iDir++) 
+    {
+        JsonObject slot = doc.createNestedObject();
+        slot["path"] = metadata->getSlotPath(iDir);
+        auto files = slot.createNestedArray("files");
+
+        for (size_t iTrack = 0; iTrack < metadata->getTrackCount(iDir); iTrack++) 
+        {
+            JsonObject file = files.createNestedObject();
+            file["path"] = metadata->getTrackPath(iDir, iTrack);
+            file["title"] = metadata->getTrackTitle(iDir, iTrack);
+            file["artist"] = metadata->getTrackArtist(iDir, iTrack);
+        }
     }
 }
 
@@ -166,64 +513,191 @@ void audio_eof_mp3(const char *path)
 {
     Log::println("AUDIO", "End of MP3 file");
     if(currentInstance != nullptr)
-        currentInstance->next();
+        currentInstance->trackEnded();
 }
 
-void AudioPlayer::loop()
+// Decoding runs in its own task, pinned and above the other workers, so that button, BLE and
+// RFID handling or the main loop never delay filling the I2S buffers.
+void AudioPlayer::runAudioTask()
 {
-    audio.loop();
-    vTaskDelay(1); // https://github.com/schreibfaul1/ESP32-audioI2S/issues/887
+    Log::println("AUDIO", "Audio task running on core %d", xPortGetCoreID());
+
+    while(true)
+    {
+        bool running;
+        {
+            AudioLock lock(this->audioMutex);
+            audio.loop();
+            running = audio.isRunning();
+            if(running)
+                this->updateBufferStats();
+            if(running && this->firstAudioPending)
+                this->checkFirstAudio();
+            this->updatePlayingInfo();
+        }
 
+        // https://github.com/schreibfaul1/ESP32-audioI2S/issues/887
+        vTaskDelay(running ? 1 : pdMS_TO_TICKS(10));
+    }
+}
+
+void AudioPlayer::updateBufferStats()
+{
+    uint32_t filled = audio.inBufferFilled();
+    if(filled < this->stats.minBufferFilled)
+        this->stats.minBufferFilled = filled;
+
+    // count when the buffer drops below the watermark, not every loop while it stays there
+    bool low = filled < AUDIO_INPUT_BUFFER_LOW_WATERMARK && audio.getFilePos() < audio.getFileSize();
+    if(low && !this->bufferLow)
+        this->stats.underruns++;
+    this->bufferLow = low;
+}
+
+void AudioPlayer::updatePlayingInfo()
+{
     auto tickCount = xTaskGetTickCount();
     if(tickCount - lastPlayingInfoUpdate > pdMS_TO_TICKS(AUDIO_PLAYING_INGO_UPDATE_INTERVAL_MILLIS))
     {
         lastPlayingInfoUpdate = tickCount;
         if(this->playingInfo != nullptr)
         {
-            this->playingInfo->serial++;
-            this->playingInfo->currentTime = audio.getAudioCurrentTime();
-            this->playingInfo->duration = audio.getAudioFileDuration();
+            // current time is in seconds, most updates change nothing
+            uint32_t currentTime = audio.getAudioCurrentTime();
+            uint32_t duration = audio.getAudioFileDuration();
+            if(currentTime != this->playingInfo->currentTime || duration != this->playingInfo->duration)
+            {
+                this->playingInfo->currentTime = currentTime;
+                this->playingInfo->duration = duration;
+                this->publishPlayerState();
+            }
+
+            if(!this->nextTrack.ready && !this->playingInfo->paused &&
+                this->playingInfo->currentTime >= AUDIO_NEXT_TRACK_LOOKUP_AFTER_SECONDS)
+                this->lookUpNextTrack();
         }
     }
 }
 
-shared_ptr<PlayingInfo> AudioPlayer::getPlayingInfo()
+AudioStats AudioPlayer::getAudioStats()
+{
+    AudioLock lock(this->audioMutex);
+    return this->stats;
+}
+
+// Called with the audio lock held, which serializes the writers of the snapshot
+void AudioPlayer::publishPlayerState()
+{
+    PlayerSnapshot state = { false, false, -1, 0, 0, 0, 0, this->currentVolume };
+    if(this->playingInfo != nullptr)
+    {
+        state.playing = true;
+        state.paused = this->playingInfo->paused;
+        state.slot = this->playingInfo->slot;
+        state.index = this->playingInfo->index;
+        state.total = this->playingInfo->total;
+        state.duration = this->playingInfo->duration;
+        state.currentTime = this->playingInfo->currentTime;
+    }
+
+    this->playerState.write(state);
+    StateEvents::publish(STATE_EVENT_PLAYER);
+}
+
+// For readers on other tasks (LEDs, BLE): a consistent copy without taking the audio lock,
+// which is held for whole track switches. The returned version changes with every update.
+uint32_t AudioPlayer::getPlayerState(PlayerSnapshot& state)
 {
-    return this->playingInfo;
+    return this->playerState.read(state);
 }
 
 void AudioPlayer::volumeUp()
 {
+    AudioLock lock(this->audioMutex);
     this->currentVolume += this->audioConfig->volumeEncoderStep;
     if(this->currentVolume > this->audioConfig->maxVolume)
         this->currentVolume = this->audioConfig->maxVolume;
 
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-    this->codec->setVolume(this->currentVolume);
-    xSemaphoreGive(this->i2cSema);
+    this->setCodecVolume(this->currentVolume);
+    this->publishPlayerState();
 
     Log::println("AUDIO", "Increase volume to: %d", this->currentVolume);
 }
 
+// Volume steps of the encoder are not waited for, the next step may already be queued
+void AudioPlayer::setCodecVolume(int volume)
+{
+    bool queued = this->i2cBus->submit(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_AUDIO, [this, volume]() {
+        this->codec->setVolume(volume);
+    });
+
+    if(!queued)
+        Log::println("AUDIO", "I2C queue full, volume %d not set", volume);
+}
+
 void AudioPlayer::volumeDown()
 {
+    AudioLock lock(this->audioMutex);
     this->currentVolume -= this->audioConfig->volumeEncoderStep;
     if(this->currentVolume < this->audioConfig->minVolume)
         this->currentVolume = this->audioConfig->minVolume;
 
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-    this->codec->setVolume(this->currentVolume);
-    xSemaphoreGive(this->i2cSema);
+    this->setCodecVolume(this->currentVolume);
+    this->publishPlayerState();
 
     Log::println("AUDIO", "Decrease volume to: %d", this->currentVolume);
 }
 
-void AudioPlayer::playSong(std::string path, uint32_t position)
+// Switching within a playing stream is muted to avoid clicks. When the previous track ended
+// (continuing), the I2S output already ran dry and the codec stays unmuted.
+void AudioPlayer::playSong(std::string path, uint32_t position, bool continuing)
 {
-    this->codec->setMute(true);
+    if(!continuing)
+    {
+        LatencyTrace::mark(LATENCY_STAGE_DISPATCHED);
+        this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_INPUT, [this]() { this->codec->setMute(true); });
+    }
+
     audio.connecttoFS(this->sdCard->getFs(), path.c_str());
-    audio.setFilePos(position);
-    this->codec->setMute(false);
+    if(position > 0)
+        audio.setFilePos(position);
+
+    if(!continuing)
+    {
+        LatencyTrace::mark(LATENCY_STAGE_OPENED);
+        this->watchFirstAudio();
+    }
+
+    if(!continuing)
+        this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_INPUT, [this]() { this->codec->setMute(false); });
+}
+
+// Decoded position of the stream: read from the file minus what still waits in the buffer
+uint32_t AudioPlayer::getDecodedPosition()
+{
+    return audio.getFilePos() - audio.inBufferFilled();
+}
+
+void AudioPlayer::watchFirstAudio()
+{
+    if(!LatencyTrace::isActive())
+        return;
+
+    this->firstAudioPending = true;
+    this->firstAudioFrom = this->getDecodedPosition();
+}
+
+// The decoder writes the samples of a frame to I2S in the same loop pass it consumes the frame,
+// so the first pass that consumed audio data (not only the ID3 header) marks the first sample.
+void AudioPlayer::checkFirstAudio()
+{
+    uint32_t audioStart = audio.getAudioDataStartPos();
+    uint32_t decoded = this->getDecodedPosition();
+    if(audioStart == 0 || decoded <= max(audioStart, this->firstAudioFrom))
+        return;
+
+    this->firstAudioPending = false;
+    LatencyTrace::mark(LATENCY_STAGE_FIRST_AUDIO);
 }
 
 void AudioPlayer::playFromSlot(int iSlot, int increment)
@@ -244,7 +718,6 @@ void AudioPlayer::playFromSlot(int iSlot, int increment)
     {
         total = this->playingInfo->total;
         index = this->playingInfo->index + increment;
-        this->playingInfo->serial++;
 
         if(index >= total)
         {
@@ -254,7 +727,7 @@ void AudioPlayer::playFromSlot(int iSlot, int increment)
     }
     else 
     {
-        total = this->slotFiles->at(iSlot).size();
+        total = this->getSlotTrackCount(iSlot);
         if(increment == -1) // start from behind, when we are skipping back
             index = total - 1;
     }
@@ -264,13 +737,19 @@ void AudioPlayer::playFromSlot(int iSlot, int increment)
 
 void AudioPlayer::playSlotIndex(int iSlot, int iTrack)
 {
-    auto total = this->slotFiles->at(iSlot).size();
+    AudioLock lock(this->audioMutex);
+    this->startTrack(iSlot, iTrack, false);
+}
+
+void AudioPlayer::startTrack(int iSlot, int iTrack, bool continuing)
+{
+    int total = this->getSlotTrackCount(iSlot);
     if (iTrack < 0 || iTrack >= total) {
         Log::println("AUDIO", "Invalid track index: %d for slot %d", iTrack, iSlot);
         return;
     }
 
-    string nextFile = get<0>(this->slotFiles->at(iSlot).at(iTrack));
+    string nextFile = this->getSlotTrackPath(iSlot, iTrack);
     if(nextFile.empty())
     {
         Log::println("AUDIO", "No files anymore in slot %d after index %d", iSlot, iTrack);
@@ -278,38 +757,88 @@ void AudioPlayer::playSlotIndex(int iSlot, int iTrack)
     }
 
     Log::println("AUDIO", "Play slot %d, index %d, total %d, path %s", iSlot, iTrack, total, nextFile.c_str());
-    this->playSong(nextFile, 0);
+    this->nextTrack.ready = false;
+    this->playSong(nextFile, 0, continuing);
 
     this->playingInfo = make_shared<PlayingInfo>();
     this->playingInfo->path = nextFile;
     this->playingInfo->slot = iSlot;
     this->playingInfo->index = iTrack;
     this->playingInfo->total = total;
-    this->playingInfo->pausedAtPosition = 0;
+    this->playingInfo->paused = false;
     this->playingInfo->currentTime = 0;
     this->playingInfo->duration = audio.getAudioFileDuration();
-    this->playingInfo->serial++;
+    this->publishPlayerState();
 
     Log::println("AUDIO", "Started: duration %u", 
         this->playingInfo->duration);
 }
 
-bool AudioPlayer::playFileByPath(std::string_view path)
+// Same order as next(): following track of the slot, then the first track of the next slot.
+bool AudioPlayer::resolveNextTrack(int& iSlot, int& iTrack)
 {
-    if (!this->slotFiles) {
-        std::string pathStr(path);
-        Log::println("AUDIO", "Cannot play %s: slot files not initialized", pathStr.c_str());
+    if(this->playingInfo == nullptr)
         return false;
+
+    iSlot = this->playingInfo->slot;
+    iTrack = this->playingInfo->index + 1;
+
+    if(iTrack >= this->playingInfo->total)
+    {
+        iSlot++;
+        iTrack = 0;
     }
 
-    for (size_t slot = 0; slot < this->slotFiles->size(); ++slot) {
-        auto& files = this->slotFiles->at(slot);
-        for (size_t index = 0; index < files.size(); ++index) {
-            if (std::get<0>(files.at(index)) == path) {
-                this->playSlotIndex(static_cast<int>(slot), static_cast<int>(index));
-                return true;
-            }
-        }
+    if(iSlot >= static_cast<int>(this->slotDirectories->size()))
+        iSlot = 0;
+
+    return static_cast<size_t>(iTrack) < this->getSlotTrackCount(iSlot);
+}
+
+// Looks up the next track while the current one is still playing, so the switch at the end
+// of the track does not search the slot. Opening, header parsing and the first buffer fill
+// still happen at the end of the track.
+void AudioPlayer::lookUpNextTrack()
+{
+    int iSlot, iTrack;
+    if(!this->resolveNextTrack(iSlot, iTrack))
+        return;
+
+    this->nextTrack.slot = iSlot;
+    this->nextTrack.index = iTrack;
+    this->nextTrack.total = this->getSlotTrackCount(iSlot);
+    this->nextTrack.path = this->getSlotTrackPath(iSlot, iTrack);
+    this->nextTrack.ready = true;
+
+    Log::println("AUDIO", "Next track: slot %d, index %d, path %s", iSlot, iTrack, this->nextTrack.path.c_str());
+}
+
+// Called by the audio lib at the end of a file: continue with the looked up track without
+// muting, or take the regular next() path when nothing was looked up.
+void AudioPlayer::trackEnded()
+{
+    AudioLock lock(this->audioMutex);
+    if(this->playingInfo == nullptr)
+        return;
+
+    int iSlot, iTrack;
+    if(!this->nextTrack.ready || !this->resolveNextTrack(iSlot, iTrack) || 
+        iSlot != this->nextTrack.slot || iTrack != this->nextTrack.index)
+    {
+        this->next();
+        return;
+    }
+
+    this->startTrack(this->nextTrack.slot, this->nextTrack.index, true);
+}
+
+bool AudioPlayer::playFileByPath(std::string_view path)
+{
+    AudioLock lock(this->audioMutex);
+    size_t slot, index;
+    if (this->findSlotTrack(path, slot, index)) {
+        this->playSlotIndex(static_cast<int>(slot), static_cast<int>(index));
+        return true;
     }
 
     std::string pathStr(path);
@@ -317,58 +846,94 @@ bool AudioPlayer::playFileByPath(std::string_view path)
     return false;
 }
 
+// slot and index of a mapping are rewritten by publishSlot under the audio lock,
+// so they are only read while holding it.
+bool AudioPlayer::playRfidMapping(const RfidTagMapping& mapping)
+{
+    AudioLock lock(this->audioMutex);
+    if (mapping.slot != RFID_MAPPING_UNRESOLVED) {
+        this->playSlotIndex(mapping.slot, mapping.index);
+        return true;
+    }
+
+    return this->playFileByPath(std::string_view(mapping.filePath.data(), mapping.filePath.size()));
+}
+
 void AudioPlayer::playNextFromSlot(int iSlot)
 {
+    AudioLock lock(this->audioMutex);
     this->playFromSlot(iSlot, 1);
 }
 
+// Pause only halts the decoder (file, decoder state and buffered data stay as they are) and
+// mutes the codec, so resuming continues at the exact frame without reopening the file.
 void AudioPlayer::play()
 {
-    if(this->playingInfo == nullptr || this->playingInfo->pausedAtPosition == 0)
+    AudioLock lock(this->audioMutex);
+    if(this->playingInfo == nullptr || !this->playingInfo->paused)
     {
         Log::println("AUDIO", "Play: Nothing paused, nothing to resume.");
         return;
     }
 
-    Log::println("AUDIO", "Play: resume %s, position %u.", 
-        this->playingInfo->path.c_str(), this->playingInfo->pausedAtPosition);
+    LatencyTrace::mark(LATENCY_STAGE_DISPATCHED);
+    Log::println("AUDIO", "Play: resume %s.", this->playingInfo->path.c_str());
+
+    if(!audio.isRunning())
+        audio.pauseResume();
 
-    this->playSong(this->playingInfo->path, this->playingInfo->pausedAtPosition);
-    this->playingInfo->pausedAtPosition = 0;
-    this->playingInfo->serial++;
+    this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_INPUT, [this]() {
+        this->codec->setMute(false);
+    });
+    this->watchFirstAudio();
+
+    this->playingInfo->paused = false;
+    this->publishPlayerState();
 }
 
 void AudioPlayer::stop()
 {
+    AudioLock lock(this->audioMutex);
     this->playingInfo = nullptr;
+    this->nextTrack.ready = false;
     audio.stopSong();
+    this->publishPlayerState();
     Log::println("AUDIO", "Stopped");
 }
 
 void AudioPlayer::pause()
 {
+    AudioLock lock(this->audioMutex);
     if(this->playingInfo == nullptr)
     {
         Log::println("AUDIO", "Pause: Nothing playing, nothing to pause.");
         return;
     }
 
-    if(this->playingInfo->pausedAtPosition > 0)
+    if(this->playingInfo->paused)
     {
         Log::println("AUDIO", "Pause: Already paused.");
         return;
     }
 
-    this->playingInfo->pausedAtPosition = audio.getFilePos();
-    audio.stopSong();
-    this->playingInfo->serial++;
+    // muted before the decoder halts, so the stream does not end with a click
+    this->i2cBus->run(I2C_DEVICE_AUDIO_CODEC, I2C_PRIO_INPUT, [this]() {
+        this->codec->setMute(true);
+    });
+
+    if(audio.isRunning())
+        audio.pauseResume();
+
+    this->playingInfo->paused = true;
+    this->publishPlayerState();
 
     Log::println("AUDIO", "Pause: %s, position %u.", 
-        this->playingInfo->path.c_str(), this->playingInfo->pausedAtPosition);
+        this->playingInfo->path.c_str(), audio.getFilePos());
 }
 
 void AudioPlayer::next()
 {
+    AudioLock lock(this->audioMutex);
     if(this->playingInfo == nullptr)
         return;
 
@@ -392,6 +957,7 @@ void AudioPlayer::next()
 
 void AudioPlayer::prev()
 {
+    AudioLock lock(this->audioMutex);
     if(this->playingInfo == nullptr)
         return;
 
@@ -420,3 +986,156 @@ int AudioPlayer::getCurrentVolume() {
 int AudioPlayer::getMaxVolume() {
     return this->audioConfig->maxVolume;
 }
+
+typedef struct {
+    AudioPlayer* audioPlayer;
+    std::string path;
+} SeekIndexerJob;
+
+void SeekIndexerTask(void* param)
+{
+    auto job = static_cast<SeekIndexerJob*>(param);
+    job->audioPlayer->runSeekIndexer(job->path);
+    delete job;
+    vTaskDelete(NULL);
+}
+
+// Builds the frame index of a file without TOC at low priority. Meanwhile seeks in that
+// file use the bitrate estimate.
+void AudioPlayer::runSeekIndexer(std::string path)
+{
+    TickType_t start = xTaskGetTickCount();
+    auto buffer = static_cast<uint8_t*>(heap_caps_malloc(AUDIO_SEEK_INDEX_BUFFER_SIZE, MALLOC_CAP_SPIRAM));
+    auto table = make_shared<MP3SeekTable>();
+    bool built = false;
+
+    try
+    {
+        built = buffer != nullptr && table->buildFrameIndex(this->sdCard->getFs(), path.c_str(), buffer, AUDIO_SEEK_INDEX_BUFFER_SIZE);
+    }
+    catch(const std::bad_alloc& e)
+    {
+        Log::println("AUDIO", "Seek index: out of memory");
+    }
+
+    heap_caps_free(buffer);
+
+    AudioLock lock(this->audioMutex);
+    this->seekIndexerRunning = false;
+
+    if(!built)
+    {
+        for(auto& entry : this->seekTables)
+        {
+            if(entry.table != nullptr && entry.path == path)
+                entry.indexFailed = true;
+        }
+        Log::println("AUDIO", "Seek index: unable to index %s", path.c_str());
+        return;
+    }
+
+    this->storeSeekTable(path, table);
+    Log::println("AUDIO", "Seek index: %s indexed, duration %u ms (used %d ms)", 
+        path.c_str(), table->getDurationMs(), pdTICKS_TO_MS(xTaskGetTickCount() - start));
+}
+
+// Cached per file, the Xing/VBRI TOC is read synchronously on the first seek. Files without
+// TOC get a frame index built in the background.
+shared_ptr<MP3SeekTable> AudioPlayer::getSeekTable(const std::string& path)
+{
+    for(auto& entry : this->seekTables)
+    {
+        if(entry.table != nullptr && entry.path == path)
+        {
+            this->startSeekIndexer(entry);
+            return entry.table;
+        }
+    }
+
+    auto buffer = static_cast<uint8_t*>(heap_caps_malloc(AUDIO_SEEK_HEADER_BUFFER_SIZE, MALLOC_CAP_SPIRAM));
+    if(buffer == nullptr)
+    {
+        Log::println("AUDIO", "Seek: out of memory");
+        return nullptr;
+    }
+
+    auto table = make_shared<MP3SeekTable>();
+    bool read = table->readHeader(this->sdCard->getFs(), path.c_str(), buffer, AUDIO_SEEK_HEADER_BUFFER_SIZE);
+    heap_caps_free(buffer);
+    if(!read)
+        return nullptr;
+
+    this->startSeekIndexer(this->storeSeekTable(path, table));
+    return table;
+}
+
+// One indexer at a time: a file that had to wait is indexed on its next seek
+void AudioPlayer::startSeekIndexer(SeekTableCacheEntry& entry)
+{
+    if(entry.table->isExact() || entry.indexFailed || this->seekIndexerRunning)
+        return;
+
+    auto job = new SeekIndexerJob{ this, entry.path };
+    if(xTaskCreate(SeekIndexerTask, "seek_indexer", TASK_STACK_SIZE_SEEK_INDEXER_WORDS, job, TASK_PRIO_SEEK_INDEXER, NULL) == pdPASS)
+        this->seekIndexerRunning = true;
+    else
+        delete job;
+}
+
+SeekTableCacheEntry& AudioPlayer::storeSeekTable(const std::string& path, shared_ptr<MP3SeekTable> table)
+{
+    for(auto& entry : this->seekTables)
+    {
+        if(entry.table != nullptr && entry.path == path)
+        {
+            entry.table = table;
+            entry.indexFailed = false;
+            return entry;
+        }
+    }
+
+    auto& entry = this->seekTables[this->nextSeekTableEntry];
+    this->nextSeekTableEntry = (this->nextSeekTableEntry + 1) % AUDIO_SEEK_TABLE_CACHE_SIZE;
+    entry.path = path;
+    entry.table = table;
+    entry.indexFailed = false;
+    return entry;
+}
+
+bool AudioPlayer::seekTo(uint32_t seconds)
+{
+    AudioLock lock(this->audioMutex);
+    if(this->playingInfo == nullptr)
+    {
+        Log::println("AUDIO", "Seek: Nothing playing.");
+        return false;
+    }
+
+    auto table = this->getSeekTable(this->playingInfo->path);
+    if(table == nullptr)
+    {
+        Log::println("AUDIO", "Seek: No seek table for %s", this->playingInfo->path.c_str());
+        return false;
+    }
+
+    // checked in 64 bit, seconds * 1000 wraps for large requests
+    if((uint64_t)seconds * 1000 >= table->getDurationMs())
+    {
+        Log::println("AUDIO", "Seek: %u s is beyond the end (%u ms)", seconds, table->getDurationMs());
+        return false;
+    }
+    uint32_t positionMs = seconds * 1000;
+
+    uint32_t offset = table->getOffset(positionMs);
+    if(!audio.setFilePos(offset))
+    {
+        Log::println("AUDIO", "Seek: Unable to set file position %u", offset);
+        return false;
+    }
+
+    this->playingInfo->currentTime = seconds;
+    this->publishPlayerState();
+
+    Log::println("AUDIO", "Seek: %u s -> offset %u (table type %d)", seconds, offset, table->getType());
+    return true;
+}
@@ -4,6 +4,11 @@
 #include <string_view>
 #include <Wire.h>
 #include "userconfig.h"
+#include "metadatacache.h"
+#include "mp3seektable.h"
+#include "directorylisting.h"
+#include "i2cbus.h"
+#include "seqlock.h"
 #include "devices/TAS5806.h"
 
 using namespace std;
@@ -15,45 +20,127 @@ typedef struct {
     int slot;
     int index;
     int total;
-    uint32_t pausedAtPosition;
+    bool paused;
     uint32_t duration;
     uint32_t currentTime;
-    int serial;
 } PlayingInfo;
 
+// Copy of the playing info (and volume) for readers on other tasks, see getPlayerState()
+typedef struct {
+    bool playing;       // false: stopped, the track fields are not set
+    bool paused;
+    int slot;
+    int index;
+    int total;
+    uint32_t duration;
+    uint32_t currentTime;
+    int volume;
+} PlayerSnapshot;
+
+// Track that follows the playing one, looked up while playing. Only its path is known in
+// advance, the file is opened when the playing one ended.
+typedef struct {
+    int slot;
+    int index;
+    int total;
+    std::string path;
+    bool ready;
+} UpcomingTrack;
+
+typedef struct {
+    uint32_t underruns;
+    uint32_t minBufferFilled;
+    uint32_t bufferSize;
+} AudioStats;
+
+typedef struct {
+    std::string path;
+    shared_ptr<MP3SeekTable> table;
+    bool indexFailed;       // no frame index could be built, the estimate stays
+} SeekTableCacheEntry;
+
+// Tracks of a slot as far as the background indexer got: the metadata of the slot (play
+// order, titles) once indexed, until then the listing of the slot directory.
+typedef struct {
+    shared_ptr<const MetadataCache> cache;
+    size_t cacheSlot;
+    shared_ptr<const DirectoryListing> listing;
+} SlotTracks;
+
 class AudioPlayer {
     private:
         shared_ptr<TwoWire> i2c;
-        SemaphoreHandle_t i2cSema;
+        shared_ptr<I2CBus> i2cBus;
     shared_ptr<AudioConfig> audioConfig;
     shared_ptr<SlotDirectoryList> slotDirectories;
+    shared_ptr<RfidMappingList> rfidMappings;
         unique_ptr<TAS5806> codec;
-        shared_ptr<PlayingInfo> playingInfo;
+        shared_ptr<PlayingInfo> playingInfo;    // only used with the audio lock held
+        SeqLock<PlayerSnapshot> playerState;    // published from playingInfo, read without lock
         shared_ptr<SDCard> sdCard;
-        std::unique_ptr<std::vector<std::vector<std::tuple<std::string, std::string, std::string>>>> slotFiles;
+        shared_ptr<MetadataCache> metadata;
+        std::vector<SlotTracks> slotTracks;
+        volatile int indexingSlot;
+        bool firstAudioPending;     // a latency trace waits for the first decoded frame
+        uint32_t firstAudioFrom;
         TickType_t lastPlayingInfoUpdate;
         int currentVolume;
-        void playSong(std::string path, uint32_t position);
+        UpcomingTrack nextTrack;
+        SemaphoreHandle_t audioMutex;
+        TaskHandle_t audioTaskHandle;
+        AudioStats stats;
+        bool bufferLow;
+        SeekTableCacheEntry seekTables[AUDIO_SEEK_TABLE_CACHE_SIZE];
+        size_t nextSeekTableEntry;
+        bool seekIndexerRunning;
+        shared_ptr<MP3SeekTable> getSeekTable(const std::string& path);
+        SeekTableCacheEntry& storeSeekTable(const std::string& path, shared_ptr<MP3SeekTable> table);
+        void startSeekIndexer(SeekTableCacheEntry& entry);
+        void updatePlayingInfo();
+        void publishPlayerState();
+        void updateBufferStats();
+        void playSong(std::string path, uint32_t position, bool continuing);
         void playFromSlot(int iSlot, int increment);
+        void startTrack(int iSlot, int iTrack, bool continuing);
+        bool resolveNextTrack(int& iSlot, int& iTrack);
+        void lookUpNextTrack();
+        void resolveRfidMappings();
+        void setCodecVolume(int volume);
+        uint32_t getDecodedPosition();
+        void watchFirstAudio();
+        void checkFirstAudio();
+        void publishMetadata(shared_ptr<MetadataCache> metadata);
+        void publishSlot(size_t iSlot, shared_ptr<const MetadataCache> cache, size_t cacheSlot);
+        size_t getSlotTrackCount(int iSlot);
+        std::string getSlotTrackPath(int iSlot, size_t iTrack);
+        bool findSlotTrack(std::string_view path, size_t& slot, size_t& index);
     public:
-        AudioPlayer(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, shared_ptr<UserConfig> userConfig, shared_ptr<SDCard> sdCard);
+        AudioPlayer(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus, shared_ptr<UserConfig> userConfig, shared_ptr<SDCard> sdCard);
         ~AudioPlayer();
         void initialize();
-        void populateAudioMetadata();
+        void startMetadataIndexing();
+        void runMetadataIndexer();
+        int getIndexingSlot();
+        size_t getSlotCount();
+        bool getSlotTracks(int iSlot, SlotTracks& tracks, std::string& directory);
         void serializeLoadedSlotsAndMetadata(JsonDocument& doc);
-        void deserializeLoadedSlotsAndMetadata(JsonDocument& doc);
-        void loop();
-        shared_ptr<PlayingInfo> getPlayingInfo();
+        void runAudioTask();
+        void runSeekIndexer(std::string path);
+        AudioStats getAudioStats();
+        uint32_t getPlayerState(PlayerSnapshot& state);
         void volumeUp();
         void volumeDown();
         void playSlotIndex(int iSlot, int iTrack);
         bool playFileByPath(std::string_view path);
+        bool playRfidMapping(const RfidTagMapping& mapping);
         void playNextFromSlot(int iSlot);
         void play();
         void stop();
         void pause();
         void next();
+        void trackEnded();
         void prev();
+        bool seekTo(uint32_t seconds);
         int getCurrentVolume();
         int getMaxVolume();
 };
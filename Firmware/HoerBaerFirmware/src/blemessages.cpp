@@ -0,0 +1,109 @@
+#include <cstring>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "blemessages.h"
+
+bool BLEMessages::encode(const pb_msgdesc_t* fields, const void* message, uint8_t* buffer, size_t bufferSize, size_t& bytesWritten)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, bufferSize);
+    if (!pb_encode(&stream, fields, message))
+        return false;
+
+    bytesWritten = stream.bytes_written;
+    return true;
+}
+
+bool BLEMessages::decode(const pb_msgdesc_t* fields, void* message, const uint8_t* data, size_t length)
+{
+    pb_istream_t stream = pb_istream_from_buffer(data, length);
+    return pb_decode(&stream, fields, message);
+}
+
+typedef struct {
+    const LibraryTrackSource* source;
+    size_t first;
+    size_t end;
+    size_t count;   // tracks encoded
+} LibraryPageContext;
+
+static size_t getVarintSize(uint64_t value)
+{
+    size_t size = 1;
+    for(; value >= 0x80; value >>= 7)
+        size++;
+    return size;
+}
+
+static bool encodeString(pb_ostream_t* stream, const pb_field_t* field, void* const* arg)
+{
+    const char* str = static_cast<const char*>(*arg);
+    if(str == nullptr || str[0] == '\0')
+        return true;
+
+    return pb_encode_tag_for_field(stream, field) && 
+        pb_encode_string(stream, reinterpret_cast<const pb_byte_t*>(str), strlen(str));
+}
+
+// Appends tracks while they fit into the stream (one notification). A track that does not
+// even fit into an empty page goes without title and artist, the listing must not stall on it.
+static bool encodeLibraryTracks(pb_ostream_t* stream, const pb_field_t* field, void* const* arg)
+{
+    auto context = static_cast<LibraryPageContext*>(*arg);
+    context->count = 0;
+
+    for(size_t index = context->first; index < context->end; index++)
+    {
+        LibraryTrackInfo info;
+        if(!(*context->source)(index, info))
+            return false;
+
+        LibraryTrack track = LibraryTrack_init_zero;
+        track.index = index;
+        track.pathHash = info.pathHash;
+        track.duration = info.durationSeconds;
+        track.title.funcs.encode = encodeString;
+        track.title.arg = const_cast<char*>(info.title);
+        track.artist.funcs.encode = encodeString;
+        track.artist.arg = const_cast<char*>(info.artist);
+
+        size_t size = 0;
+        if(!pb_get_encoded_size(&size, LibraryTrack_fields, &track))
+            return false;
+
+        if(stream->bytes_written + 1 + getVarintSize(size) + size > stream->max_size)
+        {
+            if(context->count > 0)
+                break;
+
+            track.title.arg = nullptr;
+            track.artist.arg = nullptr;
+            if(!pb_get_encoded_size(&size, LibraryTrack_fields, &track) ||
+                stream->bytes_written + 1 + getVarintSize(size) + size > stream->max_size)
+                break;
+        }
+
+        if(!pb_encode_tag_for_field(stream, field) || !pb_encode_submessage(stream, LibraryTrack_fields, &track))
+            return false;
+        context->count++;
+    }
+
+    return true;
+}
+
+// Encodes the page header and the tracks from page.firstTrack on (up to endTrack) that fit
+// into bufferSize, the tracks are taken from source while encoding, nothing is collected.
+bool BLEMessages::encodeLibraryPage(LibraryPageCharacteristic& page, const LibraryTrackSource& source, size_t endTrack, 
+    uint8_t* buffer, size_t bufferSize, size_t& bytesWritten, size_t& tracksWritten)
+{
+    LibraryPageContext context = { &source, static_cast<size_t>(page.firstTrack), endTrack, 0 };
+    page.tracks.funcs.encode = encodeLibraryTracks;
+    page.tracks.arg = &context;
+
+    bool encoded = encode(LibraryPageCharacteristic_fields, &page, buffer, bufferSize, bytesWritten);
+    page.tracks.arg = nullptr;
+    if(!encoded)
+        return false;
+
+    tracksWritten = context.count;
+    return true;
+}
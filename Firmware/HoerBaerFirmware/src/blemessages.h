@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <pb.h>
+#include "library_characteristic.pb.h"
+
+typedef struct {
+    uint32_t pathHash;
+    const char* title;      // must stay valid until the next call of the source
+    const char* artist;
+    uint32_t durationSeconds;
+} LibraryTrackInfo;
+
+typedef std::function<bool(size_t index, LibraryTrackInfo& track)> LibraryTrackSource;
+
+// nanopb encoding/decoding of the BLE characteristic messages, free of any BLE stack dependency
+class BLEMessages {
+    public:
+        static bool encode(const pb_msgdesc_t* fields, const void* message, uint8_t* buffer, size_t bufferSize, size_t& bytesWritten);
+        static bool decode(const pb_msgdesc_t* fields, void* message, const uint8_t* data, size_t length);
+        static bool encodeLibraryPage(LibraryPageCharacteristic& page, const LibraryTrackSource& source, size_t endTrack, 
+            uint8_t* buffer, size_t bufferSize, size_t& bytesWritten, size_t& tracksWritten);
+};
@@ -1,36 +1,83 @@
 #include <Arduino.h>
-#include <pb_encode.h>
-#include <pb_decode.h>
 #include "log.h"
 #include "config.h"
 #include "bleremote.h"
+#include "blemessages.h"
+#include "latencytrace.h"
+#include "stateevents.h"
 
 #include "power_state_characteristic.pb.h"
 #include "player_state_characteristic.pb.h"
 #include "network_state_characteristic.pb.h"
 #include "player_command_characteristic.pb.h"
+#include "library_characteristic.pb.h"
+#include "bulk_session_characteristic.pb.h"
 
 #define BLE_MAX_CONNECTIONS 5 // Configure: how many simultaneous connections you allow
-#define PB_BUFFER_SIZE 512 // Buffer size for protobuf encoding (in PSRAM)
+#define PB_BUFFER_SIZE (BLE_MTU_MAX - 3) // Buffer size for protobuf encoding (in PSRAM), one full notification
+#define BULK_SESSION_STATE_SIZE 64
 
 uint8_t* pbBuffer = nullptr; // Will be dynamically allocated with ps_malloc
 
+class BLEStateLock {
+    private:
+        SemaphoreHandle_t mutex;
+    public:
+        BLEStateLock(SemaphoreHandle_t mutex) : mutex(mutex) { xSemaphoreTake(mutex, portMAX_DELAY); }
+        ~BLEStateLock() { xSemaphoreGive(this->mutex); }
+};
+
 void BLERemoteServerCallbacks::onConnect(NimBLEServer* pServer, NimBLEConnInfo& info) {
-    bleRemote->connectedClients.insert(info.getConnHandle());
-    Log::println("BLE", "Client connected, handle=%d, total=%d\n", info.getConnHandle(), bleRemote->connectedClients.size());
+    size_t clients;
+    {
+        BLEStateLock lock(bleRemote->stateLock);
+        bleRemote->connectedClients.insert(info.getConnHandle());
+        clients = bleRemote->connectedClients.size();
+    }
+    StateEvents::publish(STATE_EVENT_BLE_CLIENT);
+    Log::println("BLE", "Client connected, handle=%d, total=%d\n", info.getConnHandle(), clients);
 }
 
 void BLERemoteServerCallbacks::onDisconnect(NimBLEServer* pServer, NimBLEConnInfo& info, int reason) {
-    bleRemote->connectedClients.erase(info.getConnHandle());
-    Log::println("BLE", "Client disconnected, handle=%d, remaining=%d\n", info.getConnHandle(), bleRemote->connectedClients.size());
+    size_t clients;
+    {
+        BLEStateLock lock(bleRemote->stateLock);
+        bleRemote->connectedClients.erase(info.getConnHandle());
+        if (bleRemote->bulkSession.connHandle == info.getConnHandle())
+            bleRemote->bulkSession.connHandle = BLE_HS_CONN_HANDLE_NONE;
+        clients = bleRemote->connectedClients.size();
+    }
+    Log::println("BLE", "Client disconnected, handle=%d, remaining=%d\n", info.getConnHandle(), clients);
     
     // Restart advertising if no clients
-    if (bleRemote->connectedClients.empty()) {
+    if (clients == 0) {
         Log::println("BLE", "No clients left, restart advertising...");
         pServer->getAdvertising()->start();
     }
 }
 
+void BLERemoteServerCallbacks::onMTUChange(uint16_t MTU, NimBLEConnInfo& info) {
+    Log::println("BLE", "MTU %d, handle=%d", MTU, info.getConnHandle());
+    bleRemote->onLinkUpdated(info);
+}
+
+void BLERemoteServerCallbacks::onPhyUpdate(NimBLEConnInfo& info, uint8_t txPhy, uint8_t rxPhy) {
+    Log::println("BLE", "PHY tx=%d rx=%d, handle=%d", txPhy, rxPhy, info.getConnHandle());
+    {
+        BLEStateLock lock(bleRemote->stateLock);
+        if (bleRemote->bulkSession.connHandle == info.getConnHandle()) {
+            bleRemote->bulkSession.txPhy = txPhy;
+            bleRemote->bulkSession.rxPhy = rxPhy;
+        }
+    }
+    bleRemote->onLinkUpdated(info);
+}
+
+void BLERemoteServerCallbacks::onConnParamsUpdate(NimBLEConnInfo& info) {
+    Log::println("BLE", "Connection interval %d us, handle=%d", info.getConnInterval() * 1250, info.getConnHandle());
+    bleRemote->onLinkUpdated(info);
+}
+
 void BLERemoteControlCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
     if (bleRemote) {
         bleRemote->onControlReceived(pCharacteristic);
@@ -43,11 +90,41 @@ void BLERemotePlayerCommandCallbacks::onWrite(NimBLECharacteristic* pCharacteris
     }
 }
 
+void BLERemoteLibraryCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    if (bleRemote) {
+        bleRemote->onLibraryRequestReceived(pCharacteristic, connInfo);
+    }
+}
+
+void BLERemoteBulkSessionCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    if (bleRemote) {
+        bleRemote->onBulkSessionReceived(pCharacteristic, connInfo);
+    }
+}
+
+void BLERemoteBulkSessionCallbacks::onRead(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    uint8_t buffer[BULK_SESSION_STATE_SIZE]; // pbBuffer belongs to the worker
+    size_t length = 0;
+    if (bleRemote && bleRemote->encodeBulkSessionState(buffer, sizeof(buffer), length))
+        pCharacteristic->setValue(buffer, length);
+}
+
+void BLERemoteLoopbackCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    if (bleRemote) {
+        bleRemote->onLoopbackReceived(pCharacteristic, connInfo);
+    }
+}
+
 BLERemote::BLERemote(shared_ptr<UserConfig> userConfig, shared_ptr<Power> power, shared_ptr<AudioPlayer> audioPlayer, shared_ptr<WLAN> wlan) {
     this->userConfig = userConfig;
     this->power = power;
     this->audioPlayer = audioPlayer;
     this->wlan = wlan;
+    this->playerStateVersionSent = UINT32_MAX; // first update is always sent
+    this->libraryRequests = xQueueCreate(BLE_LIBRARY_REQUEST_QUEUE_SIZE, sizeof(LibraryRequest));
+    this->bulkSession = { BLE_HS_CONN_HANDLE_NONE, BLE_GAP_LE_PHY_1M, BLE_GAP_LE_PHY_1M, 0 };
+    this->loopbackStats = {};
+    this->stateLock = xSemaphoreCreateMutex();
 }
 
 void BLEWorkerTask(void* param) 
@@ -65,7 +142,7 @@ void BLERemote::initialize() {
     NimBLEDevice::init(userConfig->getName().c_str());
     NimBLEDevice::setPower(ESP_PWR_LVL_P9); // maximum transmit power
     // NimBLEDevice::setMaxConnections(BLE_MAX_CONNECTIONS);
-    NimBLEDevice::setMTU(128); // Optional: reduce memory usage
+    NimBLEDevice::setMTU(BLE_MTU_MAX); // packets are only as large as the data, see BLE_MTU_MAX
     NimBLEDevice::setSecurityAuth(false, false, true);
 
     Log::logCurrentHeap("After NimBLEDevice::init");
@@ -107,6 +184,27 @@ void BLERemote::initialize() {
     
     playerCmdCharacteristic->setCallbacks(new BLERemotePlayerCommandCallbacks(this));
 
+    libraryCharacteristic = bleService->createCharacteristic(
+        BLE_CHARACTERISTIC_LIBRARY_UUID,
+        NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::NOTIFY
+    );
+
+    libraryCharacteristic->setCallbacks(new BLERemoteLibraryCallbacks(this));
+
+    bulkSessionCharacteristic = bleService->createCharacteristic(
+        BLE_CHARACTERISTIC_BULK_SESSION_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::NOTIFY
+    );
+
+    bulkSessionCharacteristic->setCallbacks(new BLERemoteBulkSessionCallbacks(this));
+
+    loopbackCharacteristic = bleService->createCharacteristic(
+        BLE_CHARACTERISTIC_LOOPBACK_UUID,
+        NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::NOTIFY
+    );
+
+    loopbackCharacteristic->setCallbacks(new BLERemoteLoopbackCallbacks(this));
+
 
     bleService->start();
 
@@ -132,20 +230,58 @@ void BLERemote::initialize() {
     );
 }
 
+// Sleeps until a state changed. Changes arriving within the coalesce window (volume steps,
+// a track switch with its state updates) go out as one notification per characteristic.
 void BLERemote::runWorkerTask() 
 {
     while (true) 
     {
-        if (!connectedClients.empty()) {
+        EventBits_t events = StateEvents::wait(STATE_EVENTS_ALL, pdMS_TO_TICKS(BLE_STATE_REFRESH_MILLIS));
+        if (events == STATE_EVENT_BLE_REQUEST) {
+            processLibraryRequests(); // a client waits for it, not worth coalescing
+            continue;
+        }
+        if (events != 0) {
+            vTaskDelay(pdMS_TO_TICKS(BLE_NOTIFY_COALESCE_MILLIS));
+            events |= StateEvents::take(STATE_EVENTS_ALL);
+        }
+        else
+            events = STATE_EVENT_POWER | STATE_EVENT_NETWORK; // battery level and RSSI change without events
+
+        if (!hasConnectedClients())
+            continue;
+
+        if (events & STATE_EVENT_BLE_CLIENT) {
+            this->powerSent.clear();
+            this->networkSent.clear();
+            this->playerStateVersionSent = UINT32_MAX;
+            events |= STATE_EVENT_PLAYER | STATE_EVENT_POWER | STATE_EVENT_NETWORK;
+        }
+
+        if (events & STATE_EVENT_POWER)
             updatePowerCharacteristic();
+        if (events & STATE_EVENT_PLAYER)
             updatePlayerCharacteristic();
+        if (events & STATE_EVENT_NETWORK)
             updateNetworkCharacteristic();
-        }
-        
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        if (events & STATE_EVENT_BLE_SESSION)
+            updateBulkSessionCharacteristic();
+        if (events & STATE_EVENT_BLE_REQUEST)
+            processLibraryRequests();
     }
 }
 
+// Notifies only if the encoded message differs from the one sent last
+bool BLERemote::notifyIfChanged(BLECharacteristic* characteristic, std::vector<uint8_t>& sent, size_t length) {
+    if (sent.size() == length && memcmp(sent.data(), pbBuffer, length) == 0)
+        return false;
+
+    sent.assign(pbBuffer, pbBuffer + length);
+    characteristic->setValue(pbBuffer, length);
+    characteristic->notify(); // Notify all connections
+    return true;
+}
+
 void BLERemote::shutdown() {
     NimBLEDevice::deinit(true);
     bleServer = nullptr;
@@ -153,7 +289,15 @@ void BLERemote::shutdown() {
     powerCharacteristic = nullptr;
     playerCharacteristic = nullptr;
     networkCharacteristic = nullptr;
-    connectedClients.clear();
+    libraryCharacteristic = nullptr;
+    bulkSessionCharacteristic = nullptr;
+    loopbackCharacteristic = nullptr;
+    {
+        BLEStateLock lock(stateLock);
+        bulkSession.connHandle = BLE_HS_CONN_HANDLE_NONE;
+        connectedClients.clear();
+    }
+    xQueueReset(libraryRequests);
     
     if (pbBuffer) {
         free(pbBuffer);
@@ -172,55 +316,46 @@ void BLERemote::updatePowerCharacteristic() {
     powerMessage.batteryPercentage = powerState.percentage;
     powerMessage.charging = powerState.charging;
 
-    pb_ostream_t powerStream = pb_ostream_from_buffer(pbBuffer, PB_BUFFER_SIZE);
-    if (!pb_encode(&powerStream, PowerStateCharacteristic_fields, &powerMessage)) {
+    size_t length = 0;
+    if (!BLEMessages::encode(PowerStateCharacteristic_fields, &powerMessage, pbBuffer, PB_BUFFER_SIZE, length)) {
         Log::println("BLE", "Failed to encode power state!");
         return;
     }
 
-    powerCharacteristic->setValue(pbBuffer, powerStream.bytes_written);
-    powerCharacteristic->notify(); // Notify all connections
-    delay(3);
+    this->notifyIfChanged(powerCharacteristic, this->powerSent, length);
 }
 
 void BLERemote::updatePlayerCharacteristic() {
-    auto playingInfo = this->audioPlayer->getPlayingInfo();
-    auto volume = this->audioPlayer->getCurrentVolume();
-
-    if (playingInfo == nullptr && this->playingInfoSerialSent == 0)
-        return;
-
-    if(playingInfo != nullptr && playingInfo->serial == this->playingInfoSerialSent && volume == this->volumeSent)
+    PlayerSnapshot playerState;
+    uint32_t version = this->audioPlayer->getPlayerState(playerState);
+    if (version == this->playerStateVersionSent)
         return; // No update needed
 
-    this->playingInfoSerialSent = playingInfo != nullptr ? playingInfo->serial : 0;
-    this->volumeSent = volume;
+    this->playerStateVersionSent = version;
 
     PlayerStateCharacteristic playerMessage = PlayerStateCharacteristic_init_zero;
-    playerMessage.volume = volume;
+    playerMessage.volume = playerState.volume;
     playerMessage.maxVolume = this->audioPlayer->getMaxVolume();
     
-    if (playingInfo != nullptr) {
-        playerMessage.state = playingInfo->pausedAtPosition > 0 ? PlayerState_PLAYER_PAUSED : PlayerState_PLAYER_PLAYING;
-        playerMessage.slotActive = playingInfo->slot;
-        playerMessage.fileIndex = playingInfo->index;
-        playerMessage.fileCount = playingInfo->total;
-        playerMessage.currentTime = playingInfo->currentTime;
-        playerMessage.duration = playingInfo->duration;
+    if (playerState.playing) {
+        playerMessage.state = playerState.paused ? PlayerState_PLAYER_PAUSED : PlayerState_PLAYER_PLAYING;
+        playerMessage.slotActive = playerState.slot;
+        playerMessage.fileIndex = playerState.index;
+        playerMessage.fileCount = playerState.total;
+        playerMessage.currentTime = playerState.currentTime;
+        playerMessage.duration = playerState.duration;
     } 
     else 
         playerMessage.state = PlayerState_PLAYER_STOPPED;
 
-    pb_ostream_t playerStream = pb_ostream_from_buffer(pbBuffer, PB_BUFFER_SIZE);
-    if (!pb_encode(&playerStream, PlayerStateCharacteristic_fields, &playerMessage)) {
+    size_t length = 0;
+    if (!BLEMessages::encode(PlayerStateCharacteristic_fields, &playerMessage, pbBuffer, PB_BUFFER_SIZE, length)) {
         Log::println("BLE", "Failed to encode player state!");
         return;
     }
 
-    playerCharacteristic->setValue(pbBuffer, playerStream.bytes_written);
+    playerCharacteristic->setValue(pbBuffer, length);
     playerCharacteristic->notify();
-
-    delay(3);
 }
 
 void BLERemote::updateNetworkCharacteristic() {
@@ -235,21 +370,20 @@ void BLERemote::updateNetworkCharacteristic() {
     } else
         networkMessage.enabled = false;
 
-    pb_ostream_t networkStream = pb_ostream_from_buffer(pbBuffer, PB_BUFFER_SIZE);
-    if (!pb_encode(&networkStream, NetworkStateCharacteristic_fields, &networkMessage)) {
+    size_t length = 0;
+    if (!BLEMessages::encode(NetworkStateCharacteristic_fields, &networkMessage, pbBuffer, PB_BUFFER_SIZE, length)) {
         Log::println("BLE", "Failed to encode network state!");
         return;
     }
 
-    networkCharacteristic->setValue(pbBuffer, networkStream.bytes_written);
-    networkCharacteristic->notify();
-    delay(3);
+    this->notifyIfChanged(networkCharacteristic, this->networkSent, length);
 }
 
 void BLERemote::onControlReceived(NimBLECharacteristic* pCharacteristic) {
 }
 
 void BLERemote::onPlayerCommandReceived(NimBLECharacteristic* pCharacteristic) {
+    LatencyTrace::begin(LATENCY_SOURCE_BLE, esp_timer_get_time());
     std::string value = pCharacteristic->getValue();
     if (value.length() > 0) {
         Log::println("BLE", "Player command received (%d bytes)", value.length());
@@ -259,12 +393,12 @@ void BLERemote::onPlayerCommandReceived(NimBLECharacteristic* pCharacteristic) {
 
 void BLERemote::processPlayerCommand(const uint8_t* data, size_t length) {
     PlayerCommandCharacteristic cmd = PlayerCommandCharacteristic_init_zero;
-    pb_istream_t stream = pb_istream_from_buffer(data, length);
 
-    if (!pb_decode(&stream, PlayerCommandCharacteristic_fields, &cmd)) {
+    if (!BLEMessages::decode(PlayerCommandCharacteristic_fields, &cmd, data, length)) {
         Log::println("BLE", "Error decoding player command");
         return;
     }
+    LatencyTrace::mark(LATENCY_STAGE_INPUT);
 
     Log::println("BLE", "Player command: %d, slot: %d, fileIndex: %d", 
                  cmd.command, cmd.slotIndex, cmd.fileIndex);
@@ -283,8 +417,10 @@ void BLERemote::processPlayerCommand(const uint8_t* data, size_t length) {
             audioPlayer->prev();
             break;
         case PlayerCommand_SEEK:
-            // Not implemented yet - would need to add seek functionality to AudioPlayer
-            Log::println("BLE", "SEEK command not implemented yet, seekTime: %d", cmd.seekTime);
+            if (cmd.seekTime >= 0)
+                audioPlayer->seekTo(cmd.seekTime);
+            else
+                Log::println("BLE", "Invalid seek time: %d", cmd.seekTime);
             break;
         case PlayerCommand_PLAY_SLOT_INDEX:
             if (cmd.slotIndex >= 0 && cmd.fileIndex >= 0)
@@ -298,3 +434,297 @@ void BLERemote::processPlayerCommand(const uint8_t* data, size_t length) {
     }
 }
 
+// Runs on the NimBLE host task: decoded right away, the pages are sent by the worker
+void BLERemote::onLibraryRequestReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    std::string value = pCharacteristic->getValue();
+    LibraryRequestCharacteristic msg = LibraryRequestCharacteristic_init_zero;
+
+    if (!BLEMessages::decode(LibraryRequestCharacteristic_fields, &msg, (const uint8_t*)value.data(), value.length())) {
+        Log::println("BLE", "Error decoding library request");
+        return;
+    }
+
+    LibraryRequest request = { msg.slotIndex, msg.firstTrack, msg.maxTracks, msg.requestId, 
+        connInfo.getConnHandle(), connInfo.getMTU() };
+    if (xQueueSend(libraryRequests, &request, 0) != pdTRUE) {
+        Log::println("BLE", "Library request queue full, request %d dropped", msg.requestId);
+        return;
+    }
+
+    StateEvents::publish(STATE_EVENT_BLE_REQUEST);
+}
+
+void BLERemote::processLibraryRequests() {
+    LibraryRequest request;
+    while (xQueueReceive(libraryRequests, &request, 0) == pdTRUE) {
+        if (uxQueueMessagesWaiting(libraryRequests) > 0)
+            continue; // superseded (app scrolled on)
+
+        sendLibraryPages(request);
+    }
+}
+
+// Streams the requested tracks of a slot as pages filling one notification each, read
+// directly from the slot index (or the directory listing of a slot not indexed yet).
+void BLERemote::sendLibraryPages(const LibraryRequest& request) {
+    TickType_t start = xTaskGetTickCount();
+
+    LibraryPageCharacteristic page = LibraryPageCharacteristic_init_zero;
+    page.requestId = request.requestId;
+    page.slotIndex = request.slotIndex;
+    page.slotCount = audioPlayer->getSlotCount();
+
+    SlotTracks tracks = { nullptr, 0, nullptr };
+    std::string directory;
+    size_t trackCount = 0;
+    if (audioPlayer->getSlotTracks(request.slotIndex, tracks, directory)) {
+        if (tracks.cache != nullptr)
+            trackCount = tracks.cache->getTrackCount(tracks.cacheSlot);
+        else if (tracks.listing != nullptr)
+            trackCount = tracks.listing->getFileCount();
+    }
+    page.trackCount = trackCount;
+    page.indexing = tracks.cache == nullptr;
+
+    size_t first = std::min<size_t>(std::max<int32_t>(request.firstTrack, 0), trackCount);
+    size_t end = request.maxTracks > 0 ? std::min<size_t>(first + request.maxTracks, trackCount) : trackCount;
+
+    if (!directory.empty() && directory.back() != '/')
+        directory += "/";
+    std::string path;
+
+    LibraryTrackSource source = [&](size_t index, LibraryTrackInfo& track) {
+        if (tracks.cache != nullptr) {
+            const char* trackPath = tracks.cache->getTrackPath(tracks.cacheSlot, index);
+            const char* fileName = strrchr(trackPath, '/');
+            track.pathHash = MetadataCache::hashPath(trackPath, strlen(trackPath));
+            track.title = tracks.cache->getTrackTitle(tracks.cacheSlot, index);
+            if (track.title[0] == '\0')
+                track.title = fileName != nullptr ? fileName + 1 : trackPath;
+            track.artist = tracks.cache->getTrackArtist(tracks.cacheSlot, index);
+            track.durationSeconds = tracks.cache->getTrackDurationMs(tracks.cacheSlot, index) / 1000;
+            return true;
+        }
+
+        const char* fileName = tracks.listing->getFileName(index);
+        path = directory + fileName;
+        track.pathHash = MetadataCache::hashPath(path.c_str(), path.size());
+        track.title = fileName;
+        track.artist = "";
+        track.durationSeconds = 0;
+        return true;
+    };
+
+    // ATT notification header is 3 bytes
+    size_t pageSize = std::min<size_t>(request.mtu > 3 ? request.mtu - 3 : 20, PB_BUFFER_SIZE);
+    size_t next = first;
+    int pages = 0;
+    do {
+        page.firstTrack = next;
+        size_t length = 0;
+        size_t written = 0;
+        if (!BLEMessages::encodeLibraryPage(page, source, end, pbBuffer, pageSize, length, written)) {
+            Log::println("BLE", "Failed to encode library page!");
+            return;
+        }
+
+        // next track does not fit into a page, end the request instead of sending it
+        if (written == 0 && next < end) {
+            Log::println("BLE", "Library track %d of slot %d exceeds a page", (int)next, request.slotIndex);
+            page.incomplete = true;
+            if (!BLEMessages::encodeLibraryPage(page, source, next, pbBuffer, pageSize, length, written)) {
+                Log::println("BLE", "Failed to encode library page!");
+                return;
+            }
+        }
+
+        if (!notifyLibraryPage(request.connHandle, length)) {
+            Log::println("BLE", "Library request %d aborted at track %d", request.requestId, (int)next);
+            return;
+        }
+        pages++;
+        next += written;
+
+        // keep the player state current while a long listing is sent
+        updatePlayerCharacteristic();
+
+        if (written == 0 || uxQueueMessagesWaiting(libraryRequests) > 0)
+            break;
+    } while (next < end);
+
+    Log::println("BLE", "Library slot %d: %d tracks in %d pages (%d ms)", request.slotIndex, (int)(next - first), pages, 
+        pdTICKS_TO_MS(xTaskGetTickCount() - start));
+}
+
+// Notifications are queued by the stack, while its buffers are full a page is sent again shortly after
+bool BLERemote::notifyLibraryPage(uint16_t connHandle, size_t length) {
+    for (int attempt = 0; attempt < BLE_LIBRARY_NOTIFY_RETRIES; attempt++) {
+        if (libraryCharacteristic->notify(pbBuffer, length, connHandle))
+            return true;
+        vTaskDelay(pdMS_TO_TICKS(BLE_LIBRARY_NOTIFY_RETRY_MILLIS));
+    }
+    return false;
+}
+
+// Runs on the NimBLE host task, like the link events reporting what the phone agreed to
+void BLERemote::onBulkSessionReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    std::string value = pCharacteristic->getValue();
+    BulkSessionRequestCharacteristic request = BulkSessionRequestCharacteristic_init_zero;
+
+    if (!BLEMessages::decode(BulkSessionRequestCharacteristic_fields, &request, (const uint8_t*)value.data(), value.length())) {
+        Log::println("BLE", "Error decoding bulk session request");
+        return;
+    }
+
+    if (request.resetCounters) {
+        BLEStateLock lock(stateLock);
+        loopbackStats = {};
+    }
+
+    if (request.enabled)
+        startBulkSession(connInfo);
+    else
+        endBulkSession(connInfo.getConnHandle());
+
+    StateEvents::publish(STATE_EVENT_BLE_SESSION);
+}
+
+// Requests 2M PHY, the longest packets and a short interval. These are requests to the controller
+// and the phone, a phone without 2M PHY stays at 1M: the session state shows what was agreed.
+void BLERemote::startBulkSession(NimBLEConnInfo& connInfo) {
+    uint16_t connHandle = connInfo.getConnHandle();
+    uint16_t previous;
+    {
+        BLEStateLock lock(stateLock);
+        previous = bulkSession.connHandle;
+    }
+    if (previous == connHandle)
+        return;
+    endBulkSession(previous); // one fast link at a time
+
+    uint8_t txPhy, rxPhy;
+    if (ble_gap_read_le_phy(connHandle, &txPhy, &rxPhy) != 0) {
+        txPhy = BLE_GAP_LE_PHY_1M;
+        rxPhy = BLE_GAP_LE_PHY_1M;
+    }
+    {
+        BLEStateLock lock(stateLock);
+        bulkSession = { connHandle, txPhy, rxPhy, connInfo.getConnInterval() };
+    }
+
+    bleServer->setDataLen(connHandle, BLE_BULK_DATA_LENGTH);
+    bleServer->updatePhy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+    bleServer->updateConnParams(connHandle, BLE_BULK_CONN_INTERVAL_MIN, BLE_BULK_CONN_INTERVAL_MAX, 0, BLE_CONN_SUPERVISION_TIMEOUT);
+
+    // clients exchange the MTU once, mostly right after connecting. One that did not is asked here.
+    if (connInfo.getMTU() <= BLE_ATT_MTU_DFLT)
+        ble_gattc_exchange_mtu(connHandle, nullptr, nullptr);
+
+    Log::println("BLE", "Bulk session started, handle=%d, MTU %d", connHandle, connInfo.getMTU());
+}
+
+// Back to the low power link, if connHandle has the session. The MTU stays, it can not be negotiated again.
+void BLERemote::endBulkSession(uint16_t connHandle) {
+    BLELoopbackStats loopbackStats;
+    {
+        BLEStateLock lock(stateLock);
+        if (connHandle == BLE_HS_CONN_HANDLE_NONE || bulkSession.connHandle != connHandle)
+            return;
+        bulkSession.connHandle = BLE_HS_CONN_HANDLE_NONE;
+        loopbackStats = this->loopbackStats;
+    }
+
+    bleServer->setDataLen(connHandle, BLE_DEFAULT_DATA_LENGTH);
+    bleServer->updatePhy(connHandle, BLE_GAP_LE_PHY_1M_MASK, BLE_GAP_LE_PHY_1M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+    bleServer->updateConnParams(connHandle, BLE_DEFAULT_CONN_INTERVAL_MIN, BLE_DEFAULT_CONN_INTERVAL_MAX, 0, BLE_CONN_SUPERVISION_TIMEOUT);
+
+    uint32_t elapsedMs = loopbackStats.lastPacketMs - loopbackStats.firstPacketMs;
+    if (loopbackStats.rxPackets > 0 && elapsedMs > 0)
+        Log::println("BLE", "Loopback: %u bytes in, %u bytes out in %u ms (%u bytes/s), %u dropped", 
+            loopbackStats.rxBytes, loopbackStats.txBytes, elapsedMs, 
+            (uint32_t)((uint64_t)(loopbackStats.rxBytes + loopbackStats.txBytes) * 1000 / elapsedMs), loopbackStats.dropped);
+    Log::println("BLE", "Bulk session ended, handle=%d", connHandle);
+}
+
+void BLERemote::onLinkUpdated(NimBLEConnInfo& connInfo) {
+    {
+        BLEStateLock lock(stateLock);
+        if (bulkSession.connHandle != connInfo.getConnHandle())
+            return;
+
+        bulkSession.connInterval = connInfo.getConnInterval();
+    }
+    StateEvents::publish(STATE_EVENT_BLE_SESSION);
+}
+
+bool BLERemote::hasConnectedClients() {
+    BLEStateLock lock(stateLock);
+    return !connectedClients.empty();
+}
+
+bool BLERemote::encodeBulkSessionState(uint8_t* buffer, size_t bufferSize, size_t& length) {
+    BulkSessionStateCharacteristic state = BulkSessionStateCharacteristic_init_zero;
+    BLEBulkSession bulkSession;
+    BLELoopbackStats loopbackStats;
+    {
+        BLEStateLock lock(stateLock);
+        bulkSession = this->bulkSession;
+        loopbackStats = this->loopbackStats;
+    }
+    uint16_t connHandle = bulkSession.connHandle;
+
+    state.enabled = connHandle != BLE_HS_CONN_HANDLE_NONE;
+    if (state.enabled) {
+        state.mtu = bleServer->getPeerMTU(connHandle);
+        state.phy2M = bulkSession.txPhy == BLE_GAP_LE_PHY_2M && bulkSession.rxPhy == BLE_GAP_LE_PHY_2M;
+        state.dataLength = BLE_BULK_DATA_LENGTH;
+        state.connIntervalUs = bulkSession.connInterval * 1250;
+    }
+
+    state.loopbackRxBytes = loopbackStats.rxBytes;
+    state.loopbackTxBytes = loopbackStats.txBytes;
+    state.loopbackRxPackets = loopbackStats.rxPackets;
+    state.loopbackDropped = loopbackStats.dropped;
+    state.loopbackMillis = loopbackStats.lastPacketMs - loopbackStats.firstPacketMs;
+
+    return BLEMessages::encode(BulkSessionStateCharacteristic_fields, &state, buffer, bufferSize, length);
+}
+
+// Sent to the session connection only, a client that ended its session reads the state
+void BLERemote::updateBulkSessionCharacteristic() {
+    uint16_t connHandle;
+    {
+        BLEStateLock lock(stateLock);
+        connHandle = bulkSession.connHandle;
+    }
+    if (connHandle == BLE_HS_CONN_HANDLE_NONE)
+        return;
+
+    size_t length = 0;
+    if (!encodeBulkSessionState(pbBuffer, PB_BUFFER_SIZE, length)) {
+        Log::println("BLE", "Failed to encode bulk session state!");
+        return;
+    }
+
+    bulkSessionCharacteristic->notify(pbBuffer, length, connHandle);
+}
+
+// Echoes every packet to its sender: the app measures the throughput of both directions,
+// the counters tell what arrived here and what the stack could not take.
+void BLERemote::onLoopbackReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
+    std::string value = pCharacteristic->getValue();
+    uint32_t now = millis();
+    bool echoed = pCharacteristic->notify((const uint8_t*)value.data(), value.length(), connInfo.getConnHandle());
+
+    BLEStateLock lock(stateLock);
+    if (loopbackStats.rxPackets == 0)
+        loopbackStats.firstPacketMs = now;
+    loopbackStats.lastPacketMs = now;
+    loopbackStats.rxPackets++;
+    loopbackStats.rxBytes += value.length();
+
+    if (echoed)
+        loopbackStats.txBytes += value.length();
+    else
+        loopbackStats.dropped++;
+}
\ No newline at end of file
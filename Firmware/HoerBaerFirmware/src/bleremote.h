@@ -4,6 +4,7 @@
 #include <memory>
 #include <Wire.h>
 #include <set>
+#include <vector>
 #include "userconfig.h"
 #include "power.h"
 #include "audioplayer.h"
@@ -11,11 +12,42 @@
 
 using namespace std;
 
+// Library request as written by a client, answered on the connection it came from
+typedef struct {
+    int32_t slotIndex;
+    int32_t firstTrack;
+    int32_t maxTracks;
+    int32_t requestId;
+    uint16_t connHandle;
+    uint16_t mtu;
+} LibraryRequest;
+
+// Connection a client asked to run fast (one at a time), as reported by the link events
+typedef struct {
+    uint16_t connHandle;    // BLE_HS_CONN_HANDLE_NONE without a session
+    uint8_t txPhy;
+    uint8_t rxPhy;
+    uint16_t connInterval;  // 1.25 ms units
+} BLEBulkSession;
+
+// Loopback throughput test, counted on the NimBLE host task
+typedef struct {
+    uint32_t rxBytes;
+    uint32_t txBytes;
+    uint32_t rxPackets;
+    uint32_t dropped;
+    uint32_t firstPacketMs;
+    uint32_t lastPacketMs;
+} BLELoopbackStats;
+
 class BLERemote {
 
     friend class BLERemoteServerCallbacks;
     friend class BLERemoteControlCallbacks;
     friend class BLERemotePlayerCommandCallbacks;
+    friend class BLERemoteLibraryCallbacks;
+    friend class BLERemoteBulkSessionCallbacks;
+    friend class BLERemoteLoopbackCallbacks;
 
     private:
         shared_ptr<UserConfig> userConfig;
@@ -27,14 +59,17 @@ class BLERemote {
 
         BLECharacteristic* powerCharacteristic;
         void updatePowerCharacteristic();
+        std::vector<uint8_t> powerSent;
 
         BLECharacteristic* playerCharacteristic;
         void updatePlayerCharacteristic();
-        int volumeSent;
-        int playingInfoSerialSent;
+        uint32_t playerStateVersionSent;
 
         BLECharacteristic* networkCharacteristic;
         void updateNetworkCharacteristic();
+        std::vector<uint8_t> networkSent;
+
+        bool notifyIfChanged(BLECharacteristic* characteristic, std::vector<uint8_t>& sent, size_t length);
 
         BLECharacteristic* controlCharacteristic;
         void onControlReceived(NimBLECharacteristic* pCharacteristic); // has to be public for callbacks
@@ -42,8 +77,33 @@ class BLERemote {
         BLECharacteristic* playerCmdCharacteristic;
         void onPlayerCommandReceived(NimBLECharacteristic* pCharacteristic);
         void processPlayerCommand(const uint8_t* data, size_t length);
+
+        BLECharacteristic* libraryCharacteristic;
+        QueueHandle_t libraryRequests;  // latest request wins, a running one is aborted
+        void onLibraryRequestReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo);
+        void processLibraryRequests();
+        void sendLibraryPages(const LibraryRequest& request);
+        bool notifyLibraryPage(uint16_t connHandle, size_t length);
+
+        BLECharacteristic* bulkSessionCharacteristic;
+        BLEBulkSession bulkSession;
+        void onBulkSessionReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo);
+        void startBulkSession(NimBLEConnInfo& connInfo);
+        void endBulkSession(uint16_t connHandle);
+        void onLinkUpdated(NimBLEConnInfo& connInfo);
+        bool encodeBulkSessionState(uint8_t* buffer, size_t bufferSize, size_t& length);
+        void updateBulkSessionCharacteristic();
+
+        BLECharacteristic* loopbackCharacteristic;
+        BLELoopbackStats loopbackStats;
+        void onLoopbackReceived(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo);
         
         std::set<uint16_t> connectedClients; // has to be public for callbacks
+
+        // connectedClients, bulkSession and loopbackStats change on the NimBLE host task and
+        // are read by the worker, only touched while holding it
+        SemaphoreHandle_t stateLock;
+        bool hasConnectedClients();
         
     public:
         BLERemote(shared_ptr<UserConfig> userConfig, shared_ptr<Power> power, shared_ptr<AudioPlayer> audioPlayer, shared_ptr<WLAN> wlan);
@@ -60,6 +120,9 @@ class BLERemoteServerCallbacks : public NimBLEServerCallbacks {
         BLERemoteServerCallbacks(BLERemote* ble) : bleRemote(ble) {}
         void onConnect(NimBLEServer* pServer, NimBLEConnInfo& info) override;
         void onDisconnect(NimBLEServer* pServer, NimBLEConnInfo& info, int reason) override;
+        void onMTUChange(uint16_t MTU, NimBLEConnInfo& info) override;
+        void onPhyUpdate(NimBLEConnInfo& info, uint8_t txPhy, uint8_t rxPhy) override;
+        void onConnParamsUpdate(NimBLEConnInfo& info) override;
 };
     
 class BLERemoteControlCallbacks : public NimBLECharacteristicCallbacks {
@@ -76,4 +139,29 @@ class BLERemotePlayerCommandCallbacks : public NimBLECharacteristicCallbacks {
     public:
         BLERemotePlayerCommandCallbacks(BLERemote* ble) : bleRemote(ble) {}        
         void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+};
+
+class BLERemoteLibraryCallbacks : public NimBLECharacteristicCallbacks {
+    private:
+        BLERemote* bleRemote;
+    public:
+        BLERemoteLibraryCallbacks(BLERemote* ble) : bleRemote(ble) {}        
+        void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+};
+
+class BLERemoteBulkSessionCallbacks : public NimBLECharacteristicCallbacks {
+    private:
+        BLERemote* bleRemote;
+    public:
+        BLERemoteBulkSessionCallbacks(BLERemote* ble) : bleRemote(ble) {}        
+        void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+        void onRead(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+};
+
+class BLERemoteLoopbackCallbacks : public NimBLECharacteristicCallbacks {
+    private:
+        BLERemote* bleRemote;
+    public:
+        BLERemoteLoopbackCallbacks(BLERemote* ble) : bleRemote(ble) {}        
+        void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
 };
\ No newline at end of file
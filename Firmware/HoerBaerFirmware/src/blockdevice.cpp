@@ -0,0 +1,105 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "diskio.h"
+#include "diskio_impl.h"
+#include "log.h"
+#include "blockdevice.h"
+
+BlockDevice::BlockDevice(uint8_t drive, size_t sectorCount, size_t sectorSize)
+{
+    this->drive = drive;
+    this->sectorCount = sectorCount;
+    this->sectorSize = sectorSize;
+    this->stats = {};
+    this->lastReported = {};
+    this->lastReportMicros = esp_timer_get_time();
+}
+
+size_t BlockDevice::getSectorCount()
+{
+    return this->sectorCount;
+}
+
+size_t BlockDevice::getSectorSize()
+{
+    return this->sectorSize;
+}
+
+bool BlockDevice::readSectors(uint8_t* buffer, uint32_t sector, size_t count)
+{
+    int64_t start = esp_timer_get_time();
+    DRESULT result = ff_disk_read(this->drive, buffer, sector, count);
+    this->stats.readMicros += esp_timer_get_time() - start;
+    this->stats.readCommands++;
+
+    if(result != RES_OK)
+    {
+        this->stats.errors++;
+        Log::println("BLKDEV", "Failed to read %d sectors at %u (error %d)", count, sector, result);
+        return false;
+    }
+
+    this->stats.bytesRead += count * this->sectorSize;
+    return true;
+}
+
+bool BlockDevice::writeSectors(const uint8_t* buffer, uint32_t sector, size_t count)
+{
+    int64_t start = esp_timer_get_time();
+    DRESULT result = ff_disk_write(this->drive, buffer, sector, count);
+    this->stats.writeMicros += esp_timer_get_time() - start;
+    this->stats.writeCommands++;
+
+    if(result != RES_OK)
+    {
+        this->stats.errors++;
+        Log::println("BLKDEV", "Failed to write %d sectors at %u (error %d)", count, sector, result);
+        return false;
+    }
+
+    this->stats.bytesWritten += count * this->sectorSize;
+    return true;
+}
+
+bool BlockDevice::sync()
+{
+    return ff_disk_ioctl(this->drive, CTRL_SYNC, nullptr) == RES_OK;
+}
+
+BlockDeviceStats BlockDevice::getStats()
+{
+    return this->stats;
+}
+
+// Logs the throughput since the last call, if there was any transfer. Host throughput is 
+// bytes per wall time, card throughput bytes per time spent in the driver.
+void BlockDevice::logThroughput()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - this->lastReportMicros;
+    uint64_t bytesRead = this->stats.bytesRead - this->lastReported.bytesRead;
+    uint64_t bytesWritten = this->stats.bytesWritten - this->lastReported.bytesWritten;
+
+    if(elapsed <= 0 || (bytesRead == 0 && bytesWritten == 0))
+    {
+        this->lastReportMicros = now;
+        this->lastReported = this->stats;
+        return;
+    }
+
+    uint64_t readMicros = this->stats.readMicros - this->lastReported.readMicros;
+    uint64_t writeMicros = this->stats.writeMicros - this->lastReported.writeMicros;
+    uint32_t readCommands = this->stats.readCommands - this->lastReported.readCommands;
+    uint32_t writeCommands = this->stats.writeCommands - this->lastReported.writeCommands;
+
+    // bytes per microsecond equals MB/s
+    Log::println("BLKDEV", "Read %.2f MB/s (card %.2f MB/s, %u cmds, avg %u KB), write %.2f MB/s (card %.2f MB/s, %u cmds, avg %u KB), %u errors",
+        (double)bytesRead / elapsed, readMicros > 0 ? (double)bytesRead / readMicros : 0.0,
+        readCommands, readCommands > 0 ? (uint32_t)(bytesRead / readCommands / 1024) : 0,
+        (double)bytesWritten / elapsed, writeMicros > 0 ? (double)bytesWritten / writeMicros : 0.0,
+        writeCommands, writeCommands > 0 ? (uint32_t)(bytesWritten / writeCommands / 1024) : 0,
+        this->stats.errors);
+
+    this->lastReportMicros = now;
+    this->lastReported = this->stats;
+}
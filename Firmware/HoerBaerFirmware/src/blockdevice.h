@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+typedef struct {
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint32_t readCommands;
+    uint32_t writeCommands;
+    uint64_t readMicros;    // time spent in the card driver
+    uint64_t writeMicros;
+    uint32_t errors;
+} BlockDeviceStats;
+
+// Raw sector access to the mounted SD card through the FatFs disk I/O driver of its drive.
+// A transfer of several sectors is one multi block command (CMD18 / CMD25) instead of one
+// command per sector as with readRAW/writeRAW.
+class BlockDevice {
+    private:
+        uint8_t drive;
+        size_t sectorCount;
+        size_t sectorSize;
+        BlockDeviceStats stats;
+        BlockDeviceStats lastReported;
+        int64_t lastReportMicros;
+    public:
+        BlockDevice(uint8_t drive, size_t sectorCount, size_t sectorSize);
+        size_t getSectorCount();
+        size_t getSectorSize();
+        bool readSectors(uint8_t* buffer, uint32_t sector, size_t count);
+        bool writeSectors(const uint8_t* buffer, uint32_t sector, size_t count);
+        bool sync();
+        BlockDeviceStats getStats();
+        void logThroughput();
+};
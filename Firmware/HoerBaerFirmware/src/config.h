@@ -12,10 +12,33 @@
 #define TASK_STACK_SIZE_BLE_WORKER_WORDS (10 * 1024 / 4) // 10 kbytes
 #define TASK_PRIO_RFID_WORKER 2
 #define TASK_STACK_SIZE_RFID_WORKER_WORDS (30 * 1024 / 4) // 30 kbytes
+#define TASK_PRIO_AUDIO_WORKER 5 // above all other workers, decoding must never starve
+#define TASK_STACK_SIZE_AUDIO_WORKER_WORDS (12 * 1024 / 4) // 12 kbytes
+#define TASK_CORE_AUDIO_WORKER 1 // WiFi and BLE stacks run on core 0
+#define TASK_PRIO_SEEK_INDEXER 1
+#define TASK_STACK_SIZE_SEEK_INDEXER_WORDS (6 * 1024 / 4) // 6 kbytes
+#define TASK_PRIO_USB_MSC_WORKER 4
+#define TASK_STACK_SIZE_USB_MSC_WORKER_WORDS (6 * 1024 / 4) // 6 kbytes
+#define TASK_PRIO_I2C_BUS 4 // short transactions, callers (buttons, codec mute) wait for them
+#define TASK_STACK_SIZE_I2C_BUS_WORDS (4 * 1024 / 4) // 4 kbytes
+#define TASK_PRIO_METADATA_INDEXER 1
+#define TASK_STACK_SIZE_METADATA_INDEXER_WORDS (8 * 1024 / 4) // 8 kbytes
+#define TASK_PRIO_METADATA_SCAN_WORKER 1 // background, below the buttons and RFID
+#define TASK_STACK_SIZE_METADATA_SCAN_WORKER_WORDS (8 * 1024 / 4) // 8 kbytes
+
+// Metadata scan: tag parsing workers (spread over both cores) and files queued for them
+#define METADATA_SCAN_WORKERS 2
+#define METADATA_SCAN_QUEUE_SIZE 16
+
+// I2C bus: transactions queued per priority
+#define I2C_BUS_QUEUE_SIZE 8
 
 // Well known SDCARD files
 #define SDCARD_FILE_CONFIG "/config.json"
-#define SDCARD_FILE_META_CACHE "/_metaCache.json"
+#define SDCARD_FILE_META_CACHE "/_metaCache.bin"
+#define SDCARD_FILE_META_CACHE_LEGACY "/_metaCache.json"
+#define SDCARD_FILE_BENCHMARK_RESULTS "/_sdBenchmark.txt"
+#define SDCARD_FILE_BENCHMARK_TEST "/_sdBenchmark.tmp"
 
 // BLE IDs
 #define BLE_SERVICE_UUID "4ed1ce10-a038-404e-9e93-64bc8d8a4753"
@@ -24,13 +47,76 @@
 #define BLE_CHARACTERISTIC_NETWORK_UUID "14fbff44-b62b-4f75-91aa-aac6df208754"
 #define BLE_CHARACTERISTIC_CONTROL_UUID "e3a1c5f0-7b2d-4c8a-9f3e-2d6b8a9e5c4f"
 #define BLE_CHARACTERISTIC_PLAYER_CMD_UUID "f7a12580-4bc8-46c5-9f69-d7935c3a2b01"
-
-// BLE characteristics update interval
-#define BLE_CHARACTERISTICS_UPDATE_INTERVAL_MILLIS 1000
+#define BLE_CHARACTERISTIC_LIBRARY_UUID "5c2e8a41-d6f3-4b97-a0c8-3e71b94f6d25"
+#define BLE_CHARACTERISTIC_BULK_SESSION_UUID "a8d4f7b2-1e6c-4f0a-b3d5-92c7e1f4a6b8"
+#define BLE_CHARACTERISTIC_LOOPBACK_UUID "0f3b9c6e-7a21-4d58-8e4f-c5a2d7b1e903"
+
+// USB mass storage throughput log interval (only logged while transferring)
+#define USB_MSC_THROUGHPUT_LOG_INTERVAL_MILLIS 5000
+
+// USB mass storage pipeline: two read buffers of this size, write slots collecting contiguous
+// writes, partially filled slots are written after the host was idle for a while
+#define USB_MSC_READ_BUFFER_SIZE (32 * 1024)
+#define USB_MSC_WRITE_SLOT_SIZE (32 * 1024)
+#define USB_MSC_WRITE_SLOTS 4
+#define USB_MSC_WRITE_IDLE_FLUSH_MILLIS 50
+
+// USB mass storage write-back cache for FAT and directory sectors (in PSRAM), dirty sectors
+// are written in runs of up to the flush size after the host was idle for a while
+#define USB_MSC_SECTOR_CACHE_SECTORS 512
+#define USB_MSC_SECTOR_CACHE_FLUSH_SIZE (8 * 1024)
+#define USB_MSC_SECTOR_CACHE_IDLE_FLUSH_MILLIS 1000
+
+// SD card benchmark (play and pause pressed during boot, or build flag SD_BENCHMARK_ON_BOOT=1):
+// every bus width and clock is measured with every block size on a test file of this size
+#define SD_BENCHMARK_FREQUENCIES_KHZ { 10000, 20000, 40000 }
+#define SD_BENCHMARK_BLOCK_SIZES { 512, 4096, 32768 }
+#define SD_BENCHMARK_FILE_SIZE (4 * 1024 * 1024)
+#define SD_BENCHMARK_RANDOM_OPERATIONS 200
+
+// BLE notifications: changes within the window are sent together, battery and RSSI (no change
+// events) are re-read after the refresh interval and only sent when different
+#define BLE_NOTIFY_COALESCE_MILLIS 30
+#define BLE_STATE_REFRESH_MILLIS 5000
+
+// BLE library pages: one notification each, sent back to back. When the stack is out of
+// buffers a page is retried after a short delay, the request is dropped after the retries.
+#define BLE_LIBRARY_REQUEST_QUEUE_SIZE 4
+#define BLE_LIBRARY_NOTIFY_RETRIES 50
+#define BLE_LIBRARY_NOTIFY_RETRY_MILLIS 10
+
+// BLE MTU offered to every client. The client exchanges it once per connection, so the largest
+// one is offered from the start, small packets cost nothing extra with it.
+#define BLE_MTU_MAX 517
+
+// BLE bulk session (requested by a client for transfers): 2M PHY, longest link layer packets and
+// a short connection interval. Without a session the link stays at 1M PHY, short packets and a
+// relaxed interval, which saves power on both sides. Intervals in 1.25 ms, timeout in 10 ms units.
+#define BLE_BULK_DATA_LENGTH 251
+#define BLE_BULK_CONN_INTERVAL_MIN 6
+#define BLE_BULK_CONN_INTERVAL_MAX 12
+#define BLE_DEFAULT_DATA_LENGTH 27
+#define BLE_DEFAULT_CONN_INTERVAL_MIN 24
+#define BLE_DEFAULT_CONN_INTERVAL_MAX 48
+#define BLE_CONN_SUPERVISION_TIMEOUT 400
 
 // Audio playing info update interval
 #define AUDIO_PLAYING_INGO_UPDATE_INTERVAL_MILLIS 500
 
+// Read-ahead buffer of the audio lib between SD card and decoder (in PSRAM), an underrun is
+// counted when it runs below the low watermark while playing
+#define AUDIO_INPUT_BUFFER_SIZE (256 * 1024)
+#define AUDIO_INPUT_BUFFER_LOW_WATERMARK (4 * 1024)
+
+// Next track is looked up after the current one played this long
+#define AUDIO_NEXT_TRACK_LOOKUP_AFTER_SECONDS 3
+
+// Seek tables of the last played files are kept. The first frame and its TOC are read with a
+// temporary buffer on the first seek, frame indexes are built with a larger one.
+#define AUDIO_SEEK_TABLE_CACHE_SIZE 4
+#define AUDIO_SEEK_HEADER_BUFFER_SIZE (16 * 1024)
+#define AUDIO_SEEK_INDEX_BUFFER_SIZE (32 * 1024)
+
 // I2C addresses
 #define I2C_ADDR_LED_DRIVER1 0x40   // (R: 0x81, W: 0x80)
 #define I2C_ADDR_LED_DRIVER2 0x41   // (R: 0x83, W: 0x82)
@@ -134,6 +220,7 @@
     #ifndef SD_MODE_SPI
         #define SD_MODE_SPI
     #endif
+    #define SD_SPI_FREQ 4000
     #define GPIO_SD_SCK 36
     #define GPIO_SD_DO 37
     #define GPIO_SD_DI 35
@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cstring>
+#include "directorylisting.h"
+#include "naturalsort.h"
+
+uint32_t DirectoryListing::addName(const char* name)
+{
+    uint32_t offset = this->names.size();
+    this->names.insert(this->names.end(), name, name + strlen(name) + 1);
+    return offset;
+}
+
+void DirectoryListing::addFile(const char* name, uint32_t size, uint32_t lastWrite)
+{
+    this->files.push_back({ this->addName(name), size, lastWrite });
+}
+
+void DirectoryListing::addDirectory(const char* name)
+{
+    this->directories.push_back({ this->addName(name), 0, 0 });
+}
+
+void DirectoryListing::sortEntries(std::vector<DirectoryListingEntry, PsramAllocator<DirectoryListingEntry>>& entries)
+{
+    const char* base = this->names.data();
+    std::sort(entries.begin(), entries.end(), [base](const DirectoryListingEntry& a, const DirectoryListingEntry& b) {
+        return NaturalSort::less(base + a.nameOffset, base + b.nameOffset);
+    });
+}
+
+// call once after all entries are added
+void DirectoryListing::sort()
+{
+    this->sortEntries(this->files);
+    this->sortEntries(this->directories);
+    this->files.shrink_to_fit();
+    this->directories.shrink_to_fit();
+    this->names.shrink_to_fit();
+}
+
+size_t DirectoryListing::getFileCount() const
+{
+    return this->files.size();
+}
+
+const char* DirectoryListing::getFileName(size_t index) const
+{
+    return this->names.data() + this->files[index].nameOffset;
+}
+
+uint32_t DirectoryListing::getFileSize(size_t index) const
+{
+    return this->files[index].size;
+}
+
+uint32_t DirectoryListing::getFileLastWrite(size_t index) const
+{
+    return this->files[index].lastWrite;
+}
+
+size_t DirectoryListing::getDirectoryCount() const
+{
+    return this->directories.size();
+}
+
+const char* DirectoryListing::getDirectoryName(size_t index) const
+{
+    return this->names.data() + this->directories[index].nameOffset;
+}
+
+size_t DirectoryListing::getSizeBytes() const
+{
+    return sizeof(DirectoryListing) + 
+        (this->files.capacity() + this->directories.capacity()) * sizeof(DirectoryListingEntry) + 
+        this->names.capacity();
+}
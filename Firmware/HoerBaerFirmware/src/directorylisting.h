@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "userconfig.h"
+
+typedef struct {
+    uint32_t nameOffset;
+    uint32_t size;
+    uint32_t lastWrite;     // unix time
+} DirectoryListingEntry;
+
+// Compact listing of one directory as read once from the card: files and subdirectories
+// sorted by name (natural order), all names in one block. Counting and n-th file queries need no card access.
+class DirectoryListing {
+    private:
+        std::vector<DirectoryListingEntry, PsramAllocator<DirectoryListingEntry>> files;
+        std::vector<DirectoryListingEntry, PsramAllocator<DirectoryListingEntry>> directories;
+        std::vector<char, PsramAllocator<char>> names;
+        uint32_t addName(const char* name);
+        void sortEntries(std::vector<DirectoryListingEntry, PsramAllocator<DirectoryListingEntry>>& entries);
+    public:
+        void addFile(const char* name, uint32_t size, uint32_t lastWrite);
+        void addDirectory(const char* name);
+        void sort();
+        size_t getFileCount() const;
+        const char* getFileName(size_t index) const;
+        uint32_t getFileSize(size_t index) const;
+        uint32_t getFileLastWrite(size_t index) const;
+        size_t getDirectoryCount() const;
+        const char* getDirectoryName(size_t index) const;
+        size_t getSizeBytes() const;
+};
@@ -2,24 +2,27 @@
 #include "config.h"
 #include "log.h"
 #include "hbi.h"
+#include "latencytrace.h"
 
 #define QUEUE_CMD_INPUT_INTERRUPT 0xA0
 #define QUEUE_CMD_ENCODER_L 0xB0
 #define QUEUE_CMD_ENCODER_R 0xB1
 
 #define ENCODER_DEBOUNCE_MS 10
+#define INDEXING_BLINK_MS 400
 #define ENCODER_BUTTON_LONG_MS 2000
 #define ENCODER_BUTTON_DOWN_TICKS_NOT_STARTED 0 // magic number for tick counter
 #define ENCODER_BUTTON_DOWN_TICKS_LONG_DONE UINT32_MAX // magic number for tick counter
 
 static QueueHandle_t hbiWorkerInputQueue; // has to be static because of ISR usage
 TickType_t encDebounceLastTicks = 0;
+volatile int64_t inputInterruptUs = 0; // origin of the latency trace of a button press
 TickType_t encButtonDownTicks = ENCODER_BUTTON_DOWN_TICKS_NOT_STARTED;
 
-HBI::HBI(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, shared_ptr<HBIConfig> hbiConfig, shared_ptr<AudioPlayer> audioPlayer, void (*shutdownCallback)(void))
+HBI::HBI(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus, shared_ptr<HBIConfig> hbiConfig, shared_ptr<AudioPlayer> audioPlayer, void (*shutdownCallback)(void))
 {
     this->i2c = i2c;
-    this->i2cSema = i2cSema;
+    this->i2cBus = i2cBus;
     this->hbiConfig = hbiConfig;
     this->audioPlayer = audioPlayer;
     this->shutdownCallback = shutdownCallback;
@@ -37,6 +40,11 @@ HBI::HBI(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, shared_ptr<HBIConfi
     this->playButtonsIoMask = 0;
     this->pauseButtonsIoMask = 0;
     this->powerLedsIoMask = 0;
+    this->currentLedState = UINT32_MAX;
+    this->inputQueuedUs = 0;
+    this->inputReadUs = 0;
+    this->writtenLedFrame.fill(0);
+    this->writtenLedFrameValid = 0;
 
     pinMode(GPIO_HBI_ENCODER_BTN, INPUT);
     pinMode(GPIO_HBI_ENCODER_A, INPUT);
@@ -71,11 +79,12 @@ void HBIWorkerTask(void * param)
 
 uint32_t HBI::getButtonsState()
 {
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-    uint8_t io1 = this->ioExpander1->read8();
-    uint8_t io2 = this->ioExpander2->read8();
-    uint8_t io3 = this->ioExpander3->read8();
-    xSemaphoreGive(this->i2cSema);
+    uint8_t io1, io2, io3;
+    this->i2cBus->run(I2C_DEVICE_IO_EXPANDERS, I2C_PRIO_INPUT, [&]() {
+        io1 = this->ioExpander1->read8();
+        io2 = this->ioExpander2->read8();
+        io3 = this->ioExpander3->read8();
+    });
     return io1 | (io2 << 8) | (io3 << 16);
 }
 
@@ -90,7 +99,9 @@ void HBI::runWorkerTask()
             {
                 case QUEUE_CMD_INPUT_INTERRUPT: 
                 {
+                    this->inputQueuedUs = esp_timer_get_time();
                     uint32_t buttonMask = this->getButtonsState();
+                    this->inputReadUs = esp_timer_get_time();
                     this->dispatchButtonInput(buttonMask);
                     break;
                 }
@@ -121,24 +132,23 @@ void HBI::runWorkerTask()
 
 void HBI::initialize()
 {
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-
-    this->ledDriver1->init(GPIO_HBI_LEDDRIVER_RST);
-    this->ledDriver2->init();
-    this->ledDriver3->init();
-    Log::println("HBI", "LED drivers initialized.");
-
-    this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    Log::println("HBI", "LED drivers output mode set");
-
-    xSemaphoreGive(this->i2cSema);
+    this->i2cBus->run(I2C_DEVICE_LED_DRIVERS, I2C_PRIO_BACKGROUND, [this]() {
+        this->ledDriver1->init(GPIO_HBI_LEDDRIVER_RST);
+        this->ledDriver2->init();
+        this->ledDriver3->init();
+        Log::println("HBI", "LED drivers initialized.");
+
+        this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+        this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+        this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+        Log::println("HBI", "LED drivers output mode set");
+    });
 
     // Initialize devices
     hbiWorkerInputQueue = xQueueCreate(10, sizeof(uint8_t));
 
     attachInterrupt(GPIO_HBI_INPUT_INT, []() {
+        inputInterruptUs = esp_timer_get_time();
         uint8_t command = QUEUE_CMD_INPUT_INTERRUPT;
         xQueueSendFromISR(hbiWorkerInputQueue, &command, NULL);
     }, FALLING);
@@ -203,6 +213,11 @@ void HBI::dispatchButtonInput(uint32_t buttonMask)
         return;
     }
 
+    // traced from here on, releases and dropped presses must not replace the trace of a press
+    LatencyTrace::begin(LATENCY_SOURCE_BUTTON, inputInterruptUs);
+    LatencyTrace::mark(LATENCY_STAGE_QUEUED, this->inputQueuedUs);
+    LatencyTrace::mark(LATENCY_STAGE_INPUT, this->inputReadUs);
+
     switch(mapping) 
     {
         case IO_MAPPING_TYPE_PLAY_SLOT:
@@ -283,19 +298,30 @@ void HBI::dispatchEncoderButton(bool longPress)
 
 void HBI::setLedState() 
 {
+    // the all on/off frame stays until shutdown
+    if(this->ledFrameHeld)
+        return;
+
     uint32_t ledState = 0;
     uint8_t brightness = this->hbiConfig->ledBrightness;
 
     // set leds from current playing slot
-    auto playingInfo = this->audioPlayer->getPlayingInfo();
-    if(playingInfo != nullptr) {
-        ledState |= 1 << slotIos[playingInfo->slot];
-        if(playingInfo->pausedAtPosition > 0)
+    PlayerSnapshot playerState;
+    this->audioPlayer->getPlayerState(playerState);
+    if(playerState.playing) {
+        ledState |= 1 << slotIos[playerState.slot];
+        if(playerState.paused)
             ledState |= pauseButtonsIoMask;
         else
             ledState |= playButtonsIoMask;
     }
 
+    // blink the slot the background indexer is working on
+    int indexingSlot = this->audioPlayer->getIndexingSlot();
+    if(indexingSlot > -1 && indexingSlot < this->slotCount &&
+        (xTaskGetTickCount() / pdMS_TO_TICKS(INDEXING_BLINK_MS)) % 2 == 0)
+        ledState ^= 1 << slotIos[indexingSlot];
+
     // set leds from vegas step
     if(this->currentVegasStep > -1)
         ledState |= 1 << slotIos[this->currentVegasStep];
@@ -307,51 +333,79 @@ void HBI::setLedState()
     if(this->currentLedState == ledState)
         return;
 
-    this->currentLedState = ledState;
+    LedFrame frame;
+    for(size_t i = 0; i < frame.size(); i++) 
+        frame[i] = (ledState & (1 << i)) ? brightness : 0;
 
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
+    // not waited for, queued behind button reads and codec transactions
+    bool queued = this->i2cBus->submit(I2C_DEVICE_LED_DRIVERS, I2C_PRIO_BACKGROUND, [this, frame]() {
+        // a frame queued before the all on/off frame must not replace it
+        if(!this->ledFrameHeld)
+            this->writeLedFrame(frame);
+    });
 
-    this->ledDriver1->setAllBrightness((uint8_t)0x00);
-    this->ledDriver2->setAllBrightness((uint8_t)0x00);
-    this->ledDriver3->setAllBrightness((uint8_t)0x00);
+    // retried with the next call
+    if(queued)
+        this->currentLedState = ledState;
+}
 
-    for(int i = 0; i<24; i++) 
+TLC59108* HBI::getLedDriver(int index)
+{
+    switch(index)
     {
-        if(ledState & (1 << i))
+        case 0: return this->ledDriver1.get();
+        case 1: return this->ledDriver2.get();
+        default: return this->ledDriver3.get();
+    }
+}
+
+// Compares with the values the drivers already have: a driver with changes gets all its PWM
+// registers in one auto increment write, unchanged drivers are skipped. Unchanged LEDs are
+// never switched off in between, so they do not flicker.
+void HBI::writeLedFrame(const LedFrame& frame)
+{
+    for(int iDriver = 0; iDriver < HBI_LED_DRIVERS; iDriver++)
+    {
+        size_t offset = iDriver * TLC59108::NUM_CHANNELS;
+        bool valid = this->writtenLedFrameValid & (1 << iDriver);
+        if(valid && memcmp(&frame[offset], &this->writtenLedFrame[offset], TLC59108::NUM_CHANNELS) == 0)
+            continue;
+
+        if(this->getLedDriver(iDriver)->setAllBrightness(&frame[offset]) != 0)
         {
-            if(i < 8)
-                this->ledDriver1->setBrightness(i, brightness);
-            else if(i < 16)
-                this->ledDriver2->setBrightness(i - 8, brightness);
-            else
-                this->ledDriver3->setBrightness(i - 16, brightness);
+            // state of the driver unknown, written completely next time
+            this->writtenLedFrameValid &= ~(1 << iDriver);
+            continue;
         }
-    }
 
-    xSemaphoreGive(this->i2cSema);
+        memcpy(&this->writtenLedFrame[offset], &frame[offset], TLC59108::NUM_CHANNELS);
+        this->writtenLedFrameValid |= 1 << iDriver;
+    }
 }
 
 void HBI::lightUpAllLeds() {
     uint8_t brightness = this->hbiConfig->ledBrightness;
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-    this->ledDriver1->setAllBrightness(brightness);
-    this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    this->ledDriver2->setAllBrightness(brightness);
-    this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    this->ledDriver3->setAllBrightness(brightness);
-    this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
-    xSemaphoreGive(this->i2cSema);
+    this->ledFrameHeld = true;
+    this->i2cBus->run(I2C_DEVICE_LED_DRIVERS, I2C_PRIO_BACKGROUND, [this, brightness]() {
+        LedFrame frame;
+        frame.fill(brightness);
+        this->writeLedFrame(frame);
+        this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+        this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+        this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::PWM_IND);
+    });
 }
 
 void HBI::shutOffAllLeds() {
-    xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-    this->ledDriver1->setAllBrightness((uint8_t)0x00);
-    this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::OFF);
-    this->ledDriver2->setAllBrightness((uint8_t)0x00);
-    this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::OFF);
-    this->ledDriver3->setAllBrightness((uint8_t)0x00);
-    this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::OFF);
-    xSemaphoreGive(this->i2cSema);
+    this->ledFrameHeld = true;
+    this->i2cBus->run(I2C_DEVICE_LED_DRIVERS, I2C_PRIO_BACKGROUND, [this]() {
+        LedFrame frame;
+        frame.fill(0);
+        this->writeLedFrame(frame);
+        this->ledDriver1->setLedOutputMode(TLC59108::LED_MODE::OFF);
+        this->ledDriver2->setLedOutputMode(TLC59108::LED_MODE::OFF);
+        this->ledDriver3->setLedOutputMode(TLC59108::LED_MODE::OFF);
+    });
 }
 
 void HBI::waitUntilEncoderButtonReleased() {
@@ -364,6 +418,12 @@ bool HBI::getAnyButtonPressed() {
     return buttonState != 0xFFFFFF;
 }
 
+bool HBI::getPlayPauseComboPressed() {
+    // buttons are low active
+    auto pressed = ~this->getButtonsState() & 0xFFFFFF;
+    return (pressed & this->playButtonsIoMask) != 0 && (pressed & this->pauseButtonsIoMask) != 0;
+}
+
 void HBI::runVegasStep() {
     this->currentVegasStep++;
     if(this->currentVegasStep >= slotCount)
@@ -1,15 +1,23 @@
 #pragma once
 
 #include <memory>
+#include <array>
+#include <atomic>
 #include <FreeRTOS.h>
 #include <Wire.h>
 #include "devices/TLC59108.h"
 #include "devices/PCF8574.h"
 #include "userconfig.h"
 #include "audioplayer.h"
+#include "i2cbus.h"
 
 class HBI;
 
+#define HBI_LED_DRIVERS 3
+
+// PWM value of every LED io (driver 1 channel 0 .. driver 3 channel 7)
+typedef std::array<uint8_t, HBI_LED_DRIVERS * TLC59108::NUM_CHANNELS> LedFrame;
+
 class HBI {
     private:
         shared_ptr<TwoWire> i2c;
@@ -23,10 +31,14 @@ class HBI {
         uint32_t powerLedsIoMask;
         uint32_t currentLedState;
         int currentVegasStep;
-        SemaphoreHandle_t i2cSema;
+        shared_ptr<I2CBus> i2cBus;
         unique_ptr<TLC59108> ledDriver1;
         unique_ptr<TLC59108> ledDriver2;
         unique_ptr<TLC59108> ledDriver3;
+        LedFrame writtenLedFrame;       // as the drivers have it, only touched on the I2C bus task
+        uint8_t writtenLedFrameValid;   // bit per driver, cleared when its PWM registers are unknown
+        int64_t inputQueuedUs;          // latency trace of the button input being dispatched
+        int64_t inputReadUs;
         unique_ptr<PCF8574> ioExpander1;
         unique_ptr<PCF8574> ioExpander2;
         unique_ptr<PCF8574> ioExpander3;
@@ -35,19 +47,24 @@ class HBI {
         uint32_t getButtonsState();
         void checkLongPressState();
         void setLedState();
+        TLC59108* getLedDriver(int index);
+        void writeLedFrame(const LedFrame& frame);
         void dispatchButtonInput(uint32_t buttonMask);
         void dispatchEncoderButton(bool longPress);
         bool actionButtonsEnabled = false;
         bool readyToPlay = false;
+        std::atomic<bool> ledFrameHeld{false};  // set by lightUpAllLeds/shutOffAllLeds, never cleared
     public:
-        HBI(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema, shared_ptr<HBIConfig> hbiConfig, shared_ptr<AudioPlayer> audioPlayer, void (*shutdownCallback)(void));
+        HBI(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus, shared_ptr<HBIConfig> hbiConfig, shared_ptr<AudioPlayer> audioPlayer, void (*shutdownCallback)(void));
         void initialize();
         void setReadyToPlay(bool ready);
         void runWorkerTask();
+        // Terminal: for the benchmark and shutdown only, the slot LEDs stay frozen until reboot
         void lightUpAllLeds();
         void shutOffAllLeds();
         void waitUntilEncoderButtonReleased();
         bool getAnyButtonPressed();
+        bool getPlayPauseComboPressed();
         void runVegasStep();
         void setActionButtonsEnabled(bool enabled);
 };
@@ -0,0 +1,164 @@
+#include <esp_timer.h>
+#include "log.h"
+#include "config.h"
+#include "i2cbus.h"
+
+static const char* i2cDeviceNames[I2C_DEVICE_COUNT] = { "io expanders", "led drivers", "audio codec", "fuel gauge" };
+
+void I2CBusTask(void* param)
+{
+    I2CBus* bus = static_cast<I2CBus*>(param);
+    bus->runWorkerTask();
+}
+
+I2CBus::I2CBus()
+{
+    for(int i = 0; i < I2C_PRIO_COUNT; i++)
+        this->queues[i] = xQueueCreate(I2C_BUS_QUEUE_SIZE, sizeof(I2CTransaction*));
+
+    this->freeTransactions = xQueueCreate(I2C_BUS_POOL_SIZE, sizeof(I2CTransaction*));
+    for(int i = 0; i < I2C_BUS_POOL_SIZE; i++)
+    {
+        I2CTransaction* transaction = &this->pool[i];
+        xQueueSend(this->freeTransactions, &transaction, 0);
+    }
+
+    this->pending = xSemaphoreCreateCounting(I2C_BUS_POOL_SIZE, 0);
+    memset(this->stats, 0, sizeof(this->stats));
+    this->statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+    xTaskCreate(I2CBusTask, "i2c_bus",
+        TASK_STACK_SIZE_I2C_BUS_WORDS,
+        this,
+        TASK_PRIO_I2C_BUS,
+        &this->task);
+}
+
+// Queues the transaction and returns, done (if any) is called on the bus task afterwards
+bool I2CBus::submit(I2CDevice device, I2CPriority priority, function<void()> work, function<void()> done)
+{
+    // the pool holds as many transactions as the queues, it only runs out when they are full
+    I2CTransaction* transaction;
+    if(xQueueReceive(this->freeTransactions, &transaction, 0) != pdTRUE)
+    {
+        portENTER_CRITICAL(&this->statsLock);
+        this->stats[device].dropped++;
+        portEXIT_CRITICAL(&this->statsLock);
+        return false;
+    }
+
+    transaction->device = device;
+    transaction->work = std::move(work);
+    transaction->done = std::move(done);
+    transaction->queuedAt = esp_timer_get_time();
+    transaction->waiter = nullptr;
+
+    if(xQueueSend(this->queues[priority], &transaction, 0) != pdTRUE)
+    {
+        portENTER_CRITICAL(&this->statsLock);
+        this->stats[device].dropped++;
+        portEXIT_CRITICAL(&this->statsLock);
+        this->release(transaction);
+        return false;
+    }
+
+    xSemaphoreGive(this->pending);
+    return true;
+}
+
+// Blocking variant for callers that need the result. Waits for a free queue entry, a dropped
+// read would lose a button press. The caller waits on its task notification, so a transaction
+// costs no allocation and no semaphore.
+void I2CBus::run(I2CDevice device, I2CPriority priority, function<void()> work)
+{
+    I2CTransaction transaction{ device, std::move(work), nullptr, esp_timer_get_time(), nullptr };
+    if(xTaskGetCurrentTaskHandle() == this->task)
+    {
+        this->execute(&transaction);
+        return;
+    }
+
+    transaction.waiter = xTaskGetCurrentTaskHandle();
+    I2CTransaction* queued = &transaction;
+    xQueueSend(this->queues[priority], &queued, portMAX_DELAY);
+    xSemaphoreGive(this->pending);
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+// Returns a submitted transaction to the pool, its functions are dropped right away
+void I2CBus::release(I2CTransaction* transaction)
+{
+    transaction->work = nullptr;
+    transaction->done = nullptr;
+    xQueueSend(this->freeTransactions, &transaction, 0);
+}
+
+void I2CBus::execute(I2CTransaction* transaction)
+{
+    int64_t started = esp_timer_get_time();
+    transaction->work();
+    int64_t finished = esp_timer_get_time();
+
+    uint32_t waitUs = started - transaction->queuedAt;
+    uint32_t busUs = finished - started;
+    portENTER_CRITICAL(&this->statsLock);
+    auto& stats = this->stats[transaction->device];
+    stats.transactions++;
+    stats.waitUsTotal += waitUs;
+    stats.waitUsMax = max(stats.waitUsMax, waitUs);
+    stats.busUsTotal += busUs;
+    stats.busUsMax = max(stats.busUsMax, busUs);
+    portEXIT_CRITICAL(&this->statsLock);
+
+    if(transaction->done)
+        transaction->done();
+}
+
+void I2CBus::runWorkerTask()
+{
+    while(1)
+    {
+        xSemaphoreTake(this->pending, portMAX_DELAY);
+
+        // one pending count per queued transaction, the highest priority one is taken
+        I2CTransaction* transaction = nullptr;
+        for(int i = 0; i < I2C_PRIO_COUNT && transaction == nullptr; i++)
+        {
+            if(xQueueReceive(this->queues[i], &transaction, 0) != pdTRUE)
+                transaction = nullptr;
+        }
+
+        if(transaction == nullptr)
+            continue;
+
+        this->execute(transaction);
+        if(transaction->waiter != nullptr)
+            xTaskNotifyGive(transaction->waiter);
+        else
+            this->release(transaction);
+    }
+}
+
+I2CDeviceStats I2CBus::getStats(I2CDevice device)
+{
+    portENTER_CRITICAL(&this->statsLock);
+    I2CDeviceStats stats = this->stats[device];
+    portEXIT_CRITICAL(&this->statsLock);
+    return stats;
+}
+
+void I2CBus::logStats()
+{
+    for(int i = 0; i < I2C_DEVICE_COUNT; i++)
+    {
+        auto stats = this->getStats(static_cast<I2CDevice>(i));
+        if(stats.transactions == 0)
+            continue;
+
+        Log::println("I2C", "%s: %u transactions, %u dropped, wait avg %u us / max %u us, bus avg %u us / max %u us",
+            i2cDeviceNames[i], stats.transactions, stats.dropped,
+            (uint32_t)(stats.waitUsTotal / stats.transactions), stats.waitUsMax,
+            (uint32_t)(stats.busUsTotal / stats.transactions), stats.busUsMax);
+    }
+}
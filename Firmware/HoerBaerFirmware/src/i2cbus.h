@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include <functional>
+#include <Wire.h>
+#include "config.h"
+
+using namespace std;
+
+// Lower value is served first
+typedef enum {
+    I2C_PRIO_INPUT,         // button reads, codec mute: someone is waiting for these
+    I2C_PRIO_AUDIO,         // codec setup and volume
+    I2C_PRIO_BACKGROUND,    // LED refresh, fuel gauge polls
+    I2C_PRIO_COUNT
+} I2CPriority;
+
+typedef enum {
+    I2C_DEVICE_IO_EXPANDERS,
+    I2C_DEVICE_LED_DRIVERS,
+    I2C_DEVICE_AUDIO_CODEC,
+    I2C_DEVICE_FUEL_GAUGE,
+    I2C_DEVICE_COUNT
+} I2CDevice;
+
+typedef struct {
+    uint32_t transactions;
+    uint32_t dropped;       // queue of the priority was full
+    uint64_t waitUsTotal;   // queued until started
+    uint32_t waitUsMax;
+    uint64_t busUsTotal;    // started until done
+    uint32_t busUsMax;
+} I2CDeviceStats;
+
+typedef struct {
+    I2CDevice device;
+    function<void()> work;
+    function<void()> done;
+    int64_t queuedAt;
+    TaskHandle_t waiter;    // run(): notified when done, the transaction lives on its stack
+} I2CTransaction;
+
+#define I2C_BUS_POOL_SIZE (I2C_BUS_QUEUE_SIZE * I2C_PRIO_COUNT)
+
+// Owns the I2C bus: all device access runs as transactions on one task. Transactions are
+// queued per priority and the task always takes the next one from the highest priority
+// queue, so a button read waits at most for the transaction currently on the bus, never
+// for a queue of LED updates. submit() does not block, run() waits for the transaction.
+class I2CBus {
+    private:
+        QueueHandle_t queues[I2C_PRIO_COUNT];
+        I2CTransaction pool[I2C_BUS_POOL_SIZE];    // submitted transactions, no heap per transaction
+        QueueHandle_t freeTransactions;
+        SemaphoreHandle_t pending;
+        TaskHandle_t task;
+        I2CDeviceStats stats[I2C_DEVICE_COUNT];
+        portMUX_TYPE statsLock;
+        void execute(I2CTransaction* transaction);
+        void release(I2CTransaction* transaction);
+    public:
+        I2CBus();
+        I2CBus(const I2CBus&) = delete;
+        I2CBus& operator=(const I2CBus&) = delete;
+        bool submit(I2CDevice device, I2CPriority priority, function<void()> work, function<void()> done = nullptr);
+        void run(I2CDevice device, I2CPriority priority, function<void()> work);
+        I2CDeviceStats getStats(I2CDevice device);
+        void logStats();
+        void runWorkerTask();
+};
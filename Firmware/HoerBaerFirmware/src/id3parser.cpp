@@ -1,5 +1,8 @@
+#include <cstring>
+#include <memory>
 #include "log.h"
 #include "id3parser.h"
+#include "naturalsort.h"
 
 // Function to convert UTF-16 to UTF-8
 std::string ID3Parser::convertUTF16ToUTF8(const char* utf16Buffer, size_t bufferLength, bool hasBOM) {
@@ -79,196 +82,236 @@ std::string ID3Parser::convertUTF16ToUTF8(const char* utf16Buffer, size_t buffer
     return result;
 }
 
-// Helper function to read synchsafe integers (used in ID3v2)
-uint32_t ID3Parser::readSynchsafeInteger(File& file) {
-    uint8_t buffer[4];
-    file.readBytes((char*)buffer, 4);
-
+// Helper function to decode synchsafe integers (used in ID3v2)
+uint32_t ID3Parser::decodeSynchsafeInteger(const uint8_t* data) {
     // Convert from synchsafe integer (7 bits per byte)
-    uint32_t result = 0;
-    result = buffer[0] << 21 |
-        buffer[1] << 14 |
-        buffer[2] << 7 |
-        buffer[3];
-    return result;
+    return (data[0] & 0x7F) << 21 |
+        (data[1] & 0x7F) << 14 |
+        (data[2] & 0x7F) << 7 |
+        (data[3] & 0x7F);
 }
 
-// Helper function to read ID3v2 frame content with encoding
-std::string ID3Parser::readID3v2FrameContent(File& file, uint32_t frameSize, uint8_t encoding) {
-    if (frameSize == 0) return "";
-
-    // First byte is text encoding
-    char* buffer = new char[frameSize + 1];
-    if (!buffer) return ""; // Memory allocation failed
+// Helper function to decode ID3v2 text frame content (first byte is the text encoding)
+std::string ID3Parser::decodeTextFrame(const uint8_t* data, uint32_t frameSize) {
+    if (frameSize <= 1) return "";
 
-    // Read the frame content
-    file.readBytes(buffer, frameSize);
-    buffer[frameSize] = '\0';
-
-    std::string result;
+    uint8_t encoding = data[0];
+    const char* content = reinterpret_cast<const char*>(data + 1);
+    size_t contentLength = frameSize - 1;
 
     // Handle different encodings
     switch (encoding) {
-        case 0: // ISO-8859-1 (Latin-1)
-            result = std::string(buffer);
-            break;
         case 1: // UTF-16 with BOM
             // Convert UTF-16 with BOM to UTF-8
-            result = convertUTF16ToUTF8(buffer, frameSize, true);
-            break;
+            return convertUTF16ToUTF8(content, contentLength, true);
 
         case 2: // UTF-16BE without BOM
             // Convert UTF-16BE without BOM to UTF-8
             // We pretend there's a BE BOM by passing appropriate params
-            result = convertUTF16ToUTF8(buffer, frameSize, false);
-            break;
+            return convertUTF16ToUTF8(content, contentLength, false);
 
+        case 0: // ISO-8859-1 (Latin-1)
         case 3: // UTF-8
-            result = std::string(buffer);
-            break;
-
         default:
-            result = std::string(buffer);
+            return std::string(content, strnlen(content, contentLength));
     }
+}
 
-    delete[] buffer;
-    return result;
+ID3BlockReader::ID3BlockReader(File& file, uint8_t* buffer, size_t capacity) 
+    : file(file), buffer(buffer), capacity(capacity), bufferStart(0), bufferLength(0) {
 }
 
+// Returns a pointer to length bytes at offset. The buffer is only refilled (one seek, 
+// one large read) when the requested range is not already buffered.
+const uint8_t* ID3BlockReader::fetch(uint32_t offset, size_t length) {
+    if (offset >= bufferStart && offset + length <= bufferStart + bufferLength)
+        return buffer + (offset - bufferStart);
 
-std::tuple<std::string, std::string> ID3Parser::readId3Tags(FSTYPE& fs, const std::string& filePath) {
+    if (length > capacity)
+        return nullptr;
 
-    std::string title = "";
-    std::string artist = "";
-    // String album = "";
+    if (!file.seek(offset))
+        return nullptr;
 
-    File mp3File = fs.open(filePath.c_str());
-    if (!mp3File) {
-        Log::println("ID3", "Metadata: failed to open file: %s", filePath.c_str());
-        return std::make_tuple(title, artist);
-    }
+    bufferStart = offset;
+    bufferLength = file.read(buffer, capacity);
 
-    bool metadataFound = false;
+    if (bufferLength < length)
+        return nullptr;
 
-    // Check for ID3v2 tag first (at beginning of file)
-    mp3File.seek(0);
-    char id3Header[4];
-    mp3File.readBytes(id3Header, 3);
-    id3Header[3] = '\0';
-
-    if (strcmp(id3Header, "ID3") == 0) {
-        metadataFound = true;
-
-        // Read version and flags
-        uint8_t majorVersion = mp3File.read();
-        uint8_t minorVersion = mp3File.read();
-        uint8_t flags = mp3File.read();
-
-        // Read tag size (synchsafe integer)
-        uint32_t tagSize = readSynchsafeInteger(mp3File);
-
-        // Skip extended header if present
-        if (flags & 0x40) {
-            uint32_t extHeaderSize = readSynchsafeInteger(mp3File);
-            mp3File.seek(mp3File.position() + extHeaderSize - 4);
-        }
+    return buffer;
+}
 
-        // Read frames until we reach the end of the tag
-        uint32_t bytesRead = 10; // Header is 10 bytes
+bool ID3BlockReader::isBuffered(uint32_t offset, size_t length) const {
+    return offset >= bufferStart && offset + length <= bufferStart + bufferLength;
+}
 
-        while (bytesRead < tagSize) {
-            // Read frame ID (4 bytes)
-            char frameID[5];
-            mp3File.readBytes(frameID, 4);
-            frameID[4] = '\0';
-            bytesRead += 4;
+ID3FrameSet::ID3FrameSet(std::initializer_list<const char*> frameIds, size_t requiredCount) 
+    : count(0), foundCount(0), requiredCount(requiredCount) {
+    for (auto frameId : frameIds) {
+        if (count >= ID3_MAX_WANTED_FRAMES) break;
+        memcpy(ids[count], frameId, 4);
+        found[count] = false;
+        count++;
+    }
+}
 
-            // Break if we've reached padding (indicated by a null byte)
-            if (frameID[0] == 0) break;
+int ID3FrameSet::indexOf(const uint8_t* frameId) const {
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(ids[i], frameId, 4) == 0)
+            return i;
+    }
+    return -1;
+}
 
-            // Read frame size
-            uint32_t frameSize;
-            if (majorVersion >= 4) {
-                frameSize = readSynchsafeInteger(mp3File);
-            }
-            else {
-                uint8_t sizeBuf[4];
-                mp3File.readBytes((char*)sizeBuf, 4);
-                frameSize = (sizeBuf[0] << 24) | (sizeBuf[1] << 16) | (sizeBuf[2] << 8) | sizeBuf[3];
-            }
-            bytesRead += 4;
-
-            // Read frame flags (2 bytes)
-            uint8_t frameFlags[2];
-            mp3File.readBytes((char*)frameFlags, 2);
-            bytesRead += 2;
-
-            // Process known frames
-            if (strcmp(frameID, "TIT2") == 0) {
-                // Title frame
-                uint8_t encoding = mp3File.read();
-                bytesRead++;
-                title = readID3v2FrameContent(mp3File, frameSize - 1, encoding);
-                bytesRead += frameSize - 1;
-            }
-            else if (strcmp(frameID, "TPE1") == 0) {
-                // Artist frame
-                uint8_t encoding = mp3File.read();
-                bytesRead++;
-                artist = readID3v2FrameContent(mp3File, frameSize - 1, encoding);
-                bytesRead += frameSize - 1;
-            }
-            // else if (strcmp(frameID, "TALB") == 0) {
-            //   // Album frame
-            //   uint8_t encoding = mp3File.read();
-            //   bytesRead++;
-            //   album = readID3v2FrameContent(mp3File, frameSize - 1, encoding);
-            //   bytesRead += frameSize - 1;
-            // } 
-            else {
-                // Skip unknown frames
-                mp3File.seek(mp3File.position() + frameSize);
-                bytesRead += frameSize;
-            }
-        }
+void ID3FrameSet::setValue(size_t index, std::string value) {
+    if (!found[index]) {
+        found[index] = true;
+        foundCount++;
     }
+    values[index] = std::move(value);
+}
 
-    // Check for ID3v1 tag if needed (as fallback or additional info)
-    if (!metadataFound || title.empty() || artist.empty()) {
-        if (mp3File.size() > 128) {
-            mp3File.seek(mp3File.size() - 128);
+bool ID3FrameSet::isFound(size_t index) const {
+    return found[index];
+}
 
-            char tag[4];
-            mp3File.readBytes(tag, 3);
-            tag[3] = '\0';
+bool ID3FrameSet::isComplete() const {
+    return foundCount == count;
+}
+
+bool ID3FrameSet::isRequiredComplete() const {
+    for (size_t i = 0; i < count && i < requiredCount; i++) {
+        if (!found[i])
+            return false;
+    }
+    return true;
+}
 
-            if (strcmp(tag, "TAG") == 0) {
-                metadataFound = true;
+const std::string& ID3FrameSet::getValue(size_t index) const {
+    return values[index];
+}
+
+// Walks the ID3v2 frames and stops as soon as all wanted frames are found. Unwanted frames
+// (e.g. cover art) are skipped by arithmetic only, they never cause a read.
+bool ID3Parser::scanId3Frames(ID3BlockReader& reader, ID3FrameSet& frames, size_t maxFrameSize) {
+    // The first fetch pulls in the header and usually all text frames with one read
+    const uint8_t* header = reader.fetch(0, 10);
+
+    if (header == nullptr || memcmp(header, "ID3", 3) != 0)
+        return false;
+
+    // Read version and flags
+    uint8_t majorVersion = header[3];
+    uint8_t flags = header[5];
+
+    // Read tag size (synchsafe integer, excluding the 10 byte header)
+    uint32_t tagEnd = 10 + decodeSynchsafeInteger(header + 6);
+    uint32_t position = 10;
+
+    // Skip extended header if present
+    if (flags & 0x40) {
+        const uint8_t* extHeader = reader.fetch(position, 4);
+        if (extHeader == nullptr)
+            return true;
+        position += decodeSynchsafeInteger(extHeader);
+    }
 
-                // Read ID3v1 fields
-                char titleBuffer[31];
-                char artistBuffer[31];
-                char albumBuffer[31];
+    // Read frames until we reach the end of the tag or found everything
+    while (position + 10 <= tagEnd && !frames.isComplete()) {
+        // Frame header: ID (4 bytes), size (4 bytes), flags (2 bytes)
+        // no extra read just for optional frames
+        if (frames.isRequiredComplete() && !reader.isBuffered(position, 10)) break;
 
-                mp3File.readBytes(titleBuffer, 30);
-                titleBuffer[30] = '\0';
+        const uint8_t* frameHeader = reader.fetch(position, 10);
+        if (frameHeader == nullptr) break;
 
-                mp3File.readBytes(artistBuffer, 30);
-                artistBuffer[30] = '\0';
+        // Break if we've reached padding (indicated by a null byte), the rest of the tag is padding
+        if (frameHeader[0] == 0) break;
 
-                mp3File.readBytes(albumBuffer, 30);
-                albumBuffer[30] = '\0';
+        uint32_t frameSize;
+        if (majorVersion >= 4)
+            frameSize = decodeSynchsafeInteger(frameHeader + 4);
+        else
+            frameSize = (frameHeader[4] << 24) | (frameHeader[5] << 16) | (frameHeader[6] << 8) | frameHeader[7];
 
-                // Use ID3v1 data only if ID3v2 didn't provide it
-                if (title.empty()) title = std::string(titleBuffer);
-                if (artist.empty()) artist = std::string(artistBuffer);
-                //   if (album.empty()) album = std::string(albumBuffer);
-            }
+        int wanted = frames.indexOf(frameHeader);
+        position += 10;
+
+        if (frameSize > tagEnd - position) break; // broken frame size
+
+        // Oversized text frames are truncated to the buffer size instead of being read completely
+        if (wanted >= 0 && !frames.isFound(wanted)) {
+            size_t length = frameSize < maxFrameSize ? frameSize : maxFrameSize;
+            const uint8_t* frameData = reader.fetch(position, length);
+            frames.setValue(wanted, frameData != nullptr ? decodeTextFrame(frameData, length) : "");
         }
+
+        position += frameSize;
+    }
+
+    return true;
+}
+
+ID3Tags ID3Parser::readId3Tags(FSTYPE& fs, const std::string& filePath) {
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[ID3_PARSER_BUFFER_SIZE]);
+    return readId3Tags(fs, filePath, buffer.get(), ID3_PARSER_BUFFER_SIZE);
+}
+
+ID3Tags ID3Parser::readId3Tags(FSTYPE& fs, const std::string& filePath, uint8_t* buffer, size_t bufferSize) {
+    File mp3File = fs.open(filePath.c_str());
+    if (!mp3File) {
+        Log::println("ID3", "Metadata: failed to open file: %s", filePath.c_str());
+        return { "", "", 0, 0 };
     }
 
+    ID3BlockReader reader(mp3File, buffer, bufferSize);
+    ID3Tags tags = readId3Tags(reader, mp3File.size(), bufferSize);
+
     // Close the file
     mp3File.close();
 
-    return std::make_tuple(title, artist);
-}
\ No newline at end of file
+    return tags;
+}
+
+// Reads through the reader of a file that is opened already, so the caller can go on with
+// the same reader (and the block it holds) after the tags.
+ID3Tags ID3Parser::readId3Tags(ID3BlockReader& reader, uint32_t fileSize, size_t maxFrameSize) {
+
+    ID3Tags tags = { "", "", 0, 0 };
+    // String album = "";
+
+    // track and disc number (optional) are for ordering the tracks of a slot
+    ID3FrameSet frames({ "TIT2", "TPE1", "TRCK", "TPOS" }, 2);
+
+    // Check for ID3v2 tag first (at beginning of file)
+    bool metadataFound = scanId3Frames(reader, frames, maxFrameSize);
+    tags.title = frames.getValue(0);
+    tags.artist = frames.getValue(1);
+    tags.trackNumber = NaturalSort::parseNumber(frames.getValue(2));
+    tags.discNumber = NaturalSort::parseNumber(frames.getValue(3));
+
+    // Check for ID3v1 tag if needed (as fallback or additional info), one read of the trailing 128 bytes
+    if (!metadataFound || tags.title.empty() || tags.artist.empty()) {
+        const uint8_t* tag = fileSize > 128 ? reader.fetch(fileSize - 128, 128) : nullptr;
+
+        if (tag != nullptr && memcmp(tag, "TAG", 3) == 0) {
+            metadataFound = true;
+
+            // ID3v1 fields: title (30), artist (30), album (30)
+            const char* titleField = reinterpret_cast<const char*>(tag + 3);
+            const char* artistField = reinterpret_cast<const char*>(tag + 33);
+            // const char* albumField = reinterpret_cast<const char*>(tag + 63);
+
+            // Use ID3v1 data only if ID3v2 didn't provide it
+            if (tags.title.empty()) tags.title = std::string(titleField, strnlen(titleField, 30));
+            if (tags.artist.empty()) tags.artist = std::string(artistField, strnlen(artistField, 30));
+            //   if (album.empty()) album = std::string(albumField, strnlen(albumField, 30));
+
+            // ID3v1.1: track number in the last byte of the comment
+            if (tags.trackNumber == 0 && tag[125] == 0) tags.trackNumber = tag[126];
+        }
+    }
+
+    return tags;
+}
@@ -1,13 +1,63 @@
 #pragma once
 
+#include <initializer_list>
 #include "sdcard.h"
 
+// Size of the block that is read at once: covers the ID3v2 header and the text frames of most files
+#define ID3_PARSER_BUFFER_SIZE 4096
+
+class ID3BlockReader {
+    private:
+        File& file;
+        uint8_t* buffer;
+        size_t capacity;
+        uint32_t bufferStart;
+        size_t bufferLength;
+    public:
+        ID3BlockReader(File& file, uint8_t* buffer, size_t capacity);
+        const uint8_t* fetch(uint32_t offset, size_t length);
+        bool isBuffered(uint32_t offset, size_t length) const;
+};
+
+#define ID3_MAX_WANTED_FRAMES 4
+
+// Text frames a scan is looking for (e.g. "TIT2", "TPE1"), the scan ends when all are found.
+// Frames after the first requiredCount ones are optional: they are only taken from data that
+// is already read, once the required frames are found.
+class ID3FrameSet {
+    private:
+        char ids[ID3_MAX_WANTED_FRAMES][4];
+        std::string values[ID3_MAX_WANTED_FRAMES];
+        bool found[ID3_MAX_WANTED_FRAMES];
+        size_t count;
+        size_t foundCount;
+        size_t requiredCount;
+    public:
+        ID3FrameSet(std::initializer_list<const char*> frameIds, size_t requiredCount = ID3_MAX_WANTED_FRAMES);
+        int indexOf(const uint8_t* frameId) const;
+        void setValue(size_t index, std::string value);
+        bool isFound(size_t index) const;
+        bool isComplete() const;
+        bool isRequiredComplete() const;
+        const std::string& getValue(size_t index) const;
+};
+
+typedef struct {
+    std::string title;
+    std::string artist;
+    uint16_t trackNumber;   // TRCK (or ID3v1.1 track), 0 if not tagged
+    uint16_t discNumber;    // TPOS, 0 if not tagged
+} ID3Tags;
+
 class ID3Parser {
     private:
         static std::string convertUTF16ToUTF8(const char* utf16Buffer, size_t bufferLength, bool hasBOM);
-        static std::string readID3v2FrameContent(File &file, uint32_t frameSize, uint8_t encoding);
-        static uint32_t readSynchsafeInteger(File &file);
+        static std::string decodeTextFrame(const uint8_t* data, uint32_t frameSize);
+        static uint32_t decodeSynchsafeInteger(const uint8_t* data);
 
     public:
-        static std::tuple<std::string, std::string> readId3Tags(FSTYPE& fs, const std::string& filePath);
+        static bool scanId3Frames(ID3BlockReader& reader, ID3FrameSet& frames, size_t maxFrameSize);
+        static ID3Tags readId3Tags(FSTYPE& fs, const std::string& filePath);
+        static ID3Tags readId3Tags(FSTYPE& fs, const std::string& filePath, uint8_t* buffer, size_t bufferSize);
+        static ID3Tags readId3Tags(ID3BlockReader& reader, uint32_t fileSize, size_t maxFrameSize);
 };
\ No newline at end of file
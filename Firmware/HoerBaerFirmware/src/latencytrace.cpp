@@ -0,0 +1,140 @@
+#include <esp_timer.h>
+#include "log.h"
+#include "latencytrace.h"
+
+static const char* latencySourceNames[LATENCY_SOURCE_COUNT] = { "button", "rfid", "ble" };
+static const char* latencyStageNames[LATENCY_STAGE_COUNT] = { "queued", "input", "dispatched", "opened", "firstAudio", "total" };
+
+static portMUX_TYPE latencyLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t latencyHistograms[LATENCY_SOURCE_COUNT][LATENCY_STAGE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+static uint32_t latencyMaxUs[LATENCY_SOURCE_COUNT][LATENCY_STAGE_COUNT];
+
+static bool traceActive = false;
+static LatencySource traceSource;
+static int64_t traceOriginUs;
+static int64_t traceLastUs;
+static int traceLastStage;
+
+static int bucketOf(uint32_t us)
+{
+    int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+    return bucket < LATENCY_HISTOGRAM_BUCKETS ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1;
+}
+
+static void record(LatencySource source, LatencyStage stage, int64_t us)
+{
+    uint32_t value = us > UINT32_MAX ? UINT32_MAX : (us < 0 ? 0 : us);
+    latencyHistograms[source][stage][bucketOf(value)]++;
+    if(value > latencyMaxUs[source][stage])
+        latencyMaxUs[source][stage] = value;
+}
+
+// originUs may be taken earlier, e.g. in the interrupt handler (esp_timer_get_time is ISR safe)
+void LatencyTrace::begin(LatencySource source, int64_t originUs)
+{
+    portENTER_CRITICAL(&latencyLock);
+    traceActive = true;
+    traceSource = source;
+    traceOriginUs = originUs;
+    traceLastUs = originUs;
+    traceLastStage = -1;
+    portEXIT_CRITICAL(&latencyLock);
+}
+
+// Stages are only taken in order, once per trace: later calls on the same path (gapless track
+// changes, a second resume) do not count.
+void LatencyTrace::mark(LatencyStage stage, int64_t now)
+{
+    portENTER_CRITICAL(&latencyLock);
+    if(traceActive && now - traceOriginUs > LATENCY_TRACE_TIMEOUT_US)
+        traceActive = false;
+
+    if(traceActive && static_cast<int>(stage) > traceLastStage)
+    {
+        record(traceSource, stage, now - traceLastUs);
+        traceLastUs = now;
+        traceLastStage = stage;
+
+        if(stage == LATENCY_STAGE_FIRST_AUDIO)
+        {
+            record(traceSource, LATENCY_STAGE_TOTAL, now - traceOriginUs);
+            traceActive = false;
+        }
+    }
+    portEXIT_CRITICAL(&latencyLock);
+}
+
+bool LatencyTrace::isActive()
+{
+    portENTER_CRITICAL(&latencyLock);
+    bool active = traceActive && esp_timer_get_time() - traceOriginUs <= LATENCY_TRACE_TIMEOUT_US;
+    portEXIT_CRITICAL(&latencyLock);
+    return active;
+}
+
+void LatencyTrace::reset()
+{
+    portENTER_CRITICAL(&latencyLock);
+    memset(latencyHistograms, 0, sizeof(latencyHistograms));
+    memset(latencyMaxUs, 0, sizeof(latencyMaxUs));
+    portEXIT_CRITICAL(&latencyLock);
+}
+
+// One line per stage: count, max and the non empty buckets as <upper bound in ms>:<count>
+void LatencyTrace::log()
+{
+    uint32_t histogram[LATENCY_HISTOGRAM_BUCKETS];
+    for(int iSource = 0; iSource < LATENCY_SOURCE_COUNT; iSource++)
+    {
+        for(int iStage = 0; iStage < LATENCY_STAGE_COUNT; iStage++)
+        {
+            portENTER_CRITICAL(&latencyLock);
+            memcpy(histogram, latencyHistograms[iSource][iStage], sizeof(histogram));
+            uint32_t maxUs = latencyMaxUs[iSource][iStage];
+            portEXIT_CRITICAL(&latencyLock);
+
+            uint32_t count = 0;
+            for(int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+                count += histogram[i];
+
+            char buckets[200] = {0};
+            size_t length = 0;
+            for(int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+            {
+                if(histogram[i] == 0)
+                    continue;
+                length += snprintf(buckets + length, sizeof(buckets) - length, " <%.3f:%u", 
+                    (1 << i) / 1000.0f, histogram[i]);
+                if(length >= sizeof(buckets))
+                    break;
+            }
+
+            if(count > 0)
+                Log::println("LATENCY", "%s %s: %u, max %.1f ms,%s", latencySourceNames[iSource], 
+                    latencyStageNames[iStage], count, maxUs / 1000.0f, buckets);
+        }
+    }
+}
+
+// {"button": {"total": {"maxUs": 123, "buckets": [0, 0, ...]}, ...}, ...}, bucket n < 2^n us
+void LatencyTrace::serialize(JsonDocument& doc)
+{
+    for(int iSource = 0; iSource < LATENCY_SOURCE_COUNT; iSource++)
+    {
+        JsonObject source = doc.createNestedObject(latencySourceNames[iSource]);
+        for(int iStage = 0; iStage < LATENCY_STAGE_COUNT; iStage++)
+        {
+            uint32_t histogram[LATENCY_HISTOGRAM_BUCKETS];
+            portENTER_CRITICAL(&latencyLock);
+            memcpy(histogram, latencyHistograms[iSource][iStage], sizeof(histogram));
+            uint32_t maxUs = latencyMaxUs[iSource][iStage];
+            portEXIT_CRITICAL(&latencyLock);
+
+            JsonObject stage = source.createNestedObject(latencyStageNames[iStage]);
+            stage["maxUs"] = maxUs;
+            JsonArray buckets = stage.createNestedArray("buckets");
+            for(int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+                buckets.add(histogram[i]);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <esp_timer.h>
+
+// log2 buckets of microseconds: bucket n counts latencies in [2^(n-1), 2^n), the last one
+// also everything longer (above 0.5 s)
+#define LATENCY_HISTOGRAM_BUCKETS 21
+// an input that did not lead to audio within this time is dropped (pause, stop, ...)
+#define LATENCY_TRACE_TIMEOUT_US (3 * 1000 * 1000)
+// all histograms as JSON (sources x stages x buckets)
+#define JSON_BUFFER_SIZE_LATENCY (12*1024)
+
+typedef enum {
+    LATENCY_SOURCE_BUTTON,
+    LATENCY_SOURCE_RFID,
+    LATENCY_SOURCE_BLE,
+    LATENCY_SOURCE_COUNT
+} LatencySource;
+
+// In path order, a stage measures the time since the previous stage that was marked
+typedef enum {
+    LATENCY_STAGE_QUEUED,       // picked up by the worker task (button interrupt, BLE write)
+    LATENCY_STAGE_INPUT,        // input read: buttons over I2C, tag UID and mapping, command decoded
+    LATENCY_STAGE_DISPATCHED,   // audio player got the lock and starts the track (or resumes)
+    LATENCY_STAGE_OPENED,       // connecttoFS returned
+    LATENCY_STAGE_FIRST_AUDIO,  // decoder consumed the first frame, its samples are in the I2S DMA buffer
+    LATENCY_STAGE_TOTAL,        // origin to first audio
+    LATENCY_STAGE_COUNT
+} LatencyStage;
+
+// Traces the path from an input (paw press, RFID tag, BLE command) to the first audio sample.
+// One trace is active at a time, a newer input replaces it. Trace points only take a timestamp
+// and update a histogram, they are cheap enough to stay in the release build.
+class LatencyTrace {
+    public:
+        static void begin(LatencySource source, int64_t originUs);
+        static void mark(LatencyStage stage, int64_t us = esp_timer_get_time());
+        static bool isActive();
+        static void log();
+        static void serialize(JsonDocument& doc);
+        static void reset();
+};
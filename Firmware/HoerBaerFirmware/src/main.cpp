@@ -5,6 +5,9 @@
 
 #include "log.h"
 #include "power.h"
+#include "i2cbus.h"
+#include "latencytrace.h"
+#include "stateevents.h"
 #include "hbi.h"
 #include "audioplayer.h"
 #include "config.h"
@@ -15,10 +18,11 @@
 #include "bleremote.h"
 #include "webserver.h"
 #include "usb_msc.h"
+#include "sdbenchmark.h"
 #include "rfid.h"
 
 shared_ptr<TwoWire> i2c;
-SemaphoreHandle_t i2cSema;
+shared_ptr<I2CBus> i2cBus;
 
 shared_ptr<SDCard> sdCard;
 shared_ptr<AudioPlayer> audioPlayer;
@@ -46,12 +50,12 @@ void setup() {
   try {
 
     shuttingDown = false;
+    StateEvents::init();
     i2c = make_shared<TwoWire>(0);
-    i2cSema = xSemaphoreCreateBinary();
-    xSemaphoreGive(i2cSema);
+    i2cBus = make_shared<I2CBus>();
 
     // First (has to be first!), disable 3V3 ~PSAVE
-    power = make_shared<Power>(i2c, i2cSema);
+    power = make_shared<Power>(i2c, i2cBus);
     power->disableVCCPowerSave();
 
     i2c->begin(GPIO_I2C_SDA, GPIO_I2C_SCL, 100000);
@@ -85,12 +89,12 @@ void setup() {
 
 
     // keeps 12V supply off (NPDN down) - has to be before HBI
-    audioPlayer = make_shared<AudioPlayer>(i2c, i2cSema, userConfig, sdCard);
+    audioPlayer = make_shared<AudioPlayer>(i2c, i2cBus, userConfig, sdCard);
 
     Log::logCurrentHeap("After audio player constructor");
 
 
-    hbi = make_unique<HBI>(i2c, i2cSema, userConfig->getHBIConfig(), audioPlayer, shutdown);
+    hbi = make_unique<HBI>(i2c, i2cBus, userConfig->getHBIConfig(), audioPlayer, shutdown);
     hbi->initialize();
 
     Log::logCurrentHeap("After HBI init");
@@ -105,6 +109,21 @@ void setup() {
       return;
     }
 
+#if ( SD_BENCHMARK_ON_BOOT == 1 )
+    bool benchmarkMode = true;
+#else
+    bool benchmarkMode = hbi->getPlayPauseComboPressed(); // play and pause pressed during boot
+#endif
+
+    if (benchmarkMode) {
+      Log::println("MAIN", "SD card benchmark mode.");
+      hbi->lightUpAllLeds();
+      SDBenchmark(sdCard).run();
+      hbi->shutOffAllLeds();
+      shutdown();
+      return;
+    }
+
     usbStorageMode = hbi->getAnyButtonPressed(); // any button pressed during boot will enable USB Storage mode
 
     if (!usbStorageMode) {
@@ -112,7 +131,7 @@ void setup() {
       power->enableAudioVoltage();
 
       audioPlayer->initialize();
-      audioPlayer->populateAudioMetadata();
+      audioPlayer->startMetadataIndexing();
 
       Log::logCurrentHeap("After Audio init");
 
@@ -167,8 +186,7 @@ void loop() {
     return;
 
   if (!usbStorageMode) {
-    // Normal mode: audio loop and check battery
-    audioPlayer->loop();
+    // Normal mode: check battery (audio is decoded in its own task)
     if (power->checkBatteryShutdownLoop())
     {
       shutdown();
@@ -180,14 +198,22 @@ void loop() {
       lastMemoryPrintout = xTaskGetTickCount();
 #if ( PRINT_MEMORY_INFO == 1 )
       Log::printMemoryInfo();
+      auto audioStats = audioPlayer->getAudioStats();
+      Log::println("AUDIO", "Input buffer: %u bytes, min filled %u bytes, %u underruns",
+        audioStats.bufferSize, audioStats.minBufferFilled, audioStats.underruns);
+      i2cBus->logStats();
+      LatencyTrace::log();
 #endif
 #if ( PRINT_TASK_INFO == 1 )
       Log::printTaskInfo();
 #endif
     }
+
+    delay(20);
   }
   else {
-    // USB Storage mode: do nothing, just blink HMI
+    // USB Storage mode: do nothing, just blink HMI (and report transfer rates)
+    usbMsc->loop();
     hbi->runVegasStep();
     delay(200);
   }
@@ -197,6 +223,10 @@ void shutdown() {
   Log::println("MAIN", "Shutting down...");
   shuttingDown = true;
 
+  if (usbMsc != nullptr && !usbMsc->flush()) {
+    Log::println("MAIN", "Failed to write USB mass storage data to the SD card");
+  }
+
   if (bleRemote != nullptr) {
     bleRemote->shutdown();
     bleRemote.reset();
@@ -0,0 +1,474 @@
+#include <algorithm>
+#include <cstring>
+#include "log.h"
+#include "metadatacache.h"
+#include "naturalsort.h"
+
+MetadataCache::MetadataCache()
+{
+    this->data = nullptr;
+    this->dataSize = 0;
+    this->header = nullptr;
+    this->slots = nullptr;
+    this->tracks = nullptr;
+    this->strings = nullptr;
+    this->pathIndex = nullptr;
+    this->pathIndexMask = 0;
+}
+
+MetadataCache::MetadataCache(uint8_t* block, size_t size) : MetadataCache()
+{
+    if(!this->attach(block, size))
+        heap_caps_free(block);
+}
+
+MetadataCache::~MetadataCache()
+{
+    this->release();
+}
+
+void MetadataCache::release()
+{
+    if(this->data != nullptr)
+        heap_caps_free(this->data);
+
+    if(this->pathIndex != nullptr)
+        heap_caps_free(this->pathIndex);
+
+    this->data = nullptr;
+    this->dataSize = 0;
+    this->header = nullptr;
+    this->slots = nullptr;
+    this->tracks = nullptr;
+    this->strings = nullptr;
+    this->pathIndex = nullptr;
+    this->pathIndexMask = 0;
+}
+
+// Takes ownership of the block and validates it, so that the accessors never have to.
+bool MetadataCache::attach(uint8_t* block, size_t size)
+{
+    this->release();
+
+    if(block == nullptr || size < sizeof(MetadataCacheHeader))
+        return false;
+
+    auto hdr = reinterpret_cast<const MetadataCacheHeader*>(block);
+    if(hdr->magic != METADATA_CACHE_MAGIC || hdr->version != METADATA_CACHE_VERSION)
+        return false;
+
+    size_t expectedSize = sizeof(MetadataCacheHeader)
+        + hdr->slotCount * sizeof(MetadataCacheSlot)
+        + hdr->trackCount * sizeof(MetadataCacheTrack)
+        + hdr->stringTableSize;
+
+    if(expectedSize != size || hdr->stringTableSize == 0)
+        return false;
+
+    auto slotTable = reinterpret_cast<const MetadataCacheSlot*>(block + sizeof(MetadataCacheHeader));
+    auto trackTable = reinterpret_cast<const MetadataCacheTrack*>(slotTable + hdr->slotCount);
+    auto stringTable = reinterpret_cast<const char*>(trackTable + hdr->trackCount);
+
+    if(stringTable[hdr->stringTableSize - 1] != '\0')
+        return false;
+
+    for(size_t i = 0; i < hdr->slotCount; i++)
+    {
+        auto& slot = slotTable[i];
+        if(slot.pathOffset >= hdr->stringTableSize || slot.firstTrack + slot.trackCount > hdr->trackCount)
+            return false;
+    }
+
+    for(size_t i = 0; i < hdr->trackCount; i++)
+    {
+        auto& track = trackTable[i];
+        if(track.pathOffset >= hdr->stringTableSize ||
+            track.titleOffset >= hdr->stringTableSize ||
+            track.artistOffset >= hdr->stringTableSize)
+            return false;
+    }
+
+    this->data = block;
+    this->dataSize = size;
+    this->header = hdr;
+    this->slots = slotTable;
+    this->tracks = trackTable;
+    this->strings = stringTable;
+    this->buildPathIndex();
+    return true;
+}
+
+// Hash table from track path to (slot, index), so that tag and remote playback do not have to
+// compare the path of every track. Load factor is kept below 0.5, probing is linear.
+void MetadataCache::buildPathIndex()
+{
+    size_t capacity = 16;
+    while(capacity < this->header->trackCount * 2)
+        capacity <<= 1;
+
+    this->pathIndex = static_cast<MetadataPathIndexEntry*>(heap_caps_malloc(capacity * sizeof(MetadataPathIndexEntry), MALLOC_CAP_SPIRAM));
+    if(this->pathIndex == nullptr)
+    {
+        Log::println("CACHE", "Unable to allocate path index, falling back to linear search");
+        return;
+    }
+
+    memset(this->pathIndex, 0xFF, capacity * sizeof(MetadataPathIndexEntry));
+    this->pathIndexMask = capacity - 1;
+
+    for(size_t iSlot = 0; iSlot < this->header->slotCount; iSlot++)
+    {
+        for(size_t iTrack = 0; iTrack < this->slots[iSlot].trackCount; iTrack++)
+        {
+            auto path = this->getTrackPath(iSlot, iTrack);
+            auto hash = hashPath(path, strlen(path));
+            size_t pos = hash & this->pathIndexMask;
+            while(this->pathIndex[pos].slot != METADATA_PATH_INDEX_EMPTY)
+                pos = (pos + 1) & this->pathIndexMask;
+
+            this->pathIndex[pos].hash = hash;
+            this->pathIndex[pos].slot = iSlot;
+            this->pathIndex[pos].index = iTrack;
+        }
+    }
+}
+
+bool MetadataCache::load(FSTYPE& fs, const char* path)
+{
+    File file = fs.open(path);
+    if(!file)
+        return false;
+
+    size_t size = file.size();
+    MetadataCacheHeader hdr;
+    if(size < sizeof(hdr) || file.read(reinterpret_cast<uint8_t*>(&hdr), sizeof(hdr)) != sizeof(hdr))
+    {
+        file.close();
+        Log::println("CACHE", "Metadata cache %s is truncated", path);
+        return false;
+    }
+
+    if(hdr.magic != METADATA_CACHE_MAGIC || hdr.version != METADATA_CACHE_VERSION)
+    {
+        file.close();
+        Log::println("CACHE", "Metadata cache %s has unknown format (version %d)", path, hdr.version);
+        return false;
+    }
+
+    auto block = static_cast<uint8_t*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+    if(block == nullptr)
+    {
+        file.close();
+        Log::println("CACHE", "Unable to allocate %u bytes for metadata cache", size);
+        return false;
+    }
+
+    memcpy(block, &hdr, sizeof(hdr));
+    size_t remaining = size - sizeof(hdr);
+    size_t read = file.read(block + sizeof(hdr), remaining);
+    file.close();
+
+    if(read != remaining || !this->attach(block, size))
+    {
+        heap_caps_free(block);
+        Log::println("CACHE", "Metadata cache %s is corrupt", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool MetadataCache::save(FSTYPE& fs, const char* path) const
+{
+    if(this->data == nullptr)
+        return false;
+
+    File file = fs.open(path, FILE_WRITE);
+    if(!file)
+        return false;
+
+    size_t written = file.write(this->data, this->dataSize);
+    file.close();
+
+    return written == this->dataSize;
+}
+
+bool MetadataCache::matchesSlots(const SlotDirectoryList& slotDirectories) const
+{
+    if(this->header == nullptr || this->header->slotCount != slotDirectories.size())
+        return false;
+
+    for(size_t i = 0; i < slotDirectories.size(); i++)
+    {
+        if(strcmp(this->getSlotPath(i), slotDirectories.at(i).c_str()) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+size_t MetadataCache::getSizeBytes() const
+{
+    return this->dataSize;
+}
+
+size_t MetadataCache::getSlotCount() const
+{
+    return this->header != nullptr ? this->header->slotCount : 0;
+}
+
+size_t MetadataCache::getTotalTrackCount() const
+{
+    return this->header != nullptr ? this->header->trackCount : 0;
+}
+
+const char* MetadataCache::getSlotPath(size_t slot) const
+{
+    return this->strings + this->slots[slot].pathOffset;
+}
+
+uint32_t MetadataCache::getSlotLastWrite(size_t slot) const
+{
+    return this->slots[slot].lastWrite;
+}
+
+int MetadataCache::findSlot(const char* path) const
+{
+    for(size_t i = 0; i < this->getSlotCount(); i++)
+    {
+        if(strcmp(this->getSlotPath(i), path) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+size_t MetadataCache::getTrackCount(size_t slot) const
+{
+    if(slot >= this->getSlotCount())
+        return 0;
+
+    return this->slots[slot].trackCount;
+}
+
+// Listings mostly come in the cached order, so the hint (expected index) is checked first.
+int MetadataCache::findTrack(size_t slot, const char* path, size_t hint) const
+{
+    size_t count = this->getTrackCount(slot);
+    if(hint < count && strcmp(this->getTrackPath(slot, hint), path) == 0)
+        return hint;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(strcmp(this->getTrackPath(slot, i), path) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// The path does not need to be zero terminated (e.g. string_view of a config entry).
+bool MetadataCache::findPath(const char* path, size_t length, size_t& slot, size_t& index) const
+{
+    auto matches = [&](size_t iSlot, size_t iTrack) {
+        auto trackPath = this->getTrackPath(iSlot, iTrack);
+        return strncmp(trackPath, path, length) == 0 && trackPath[length] == '\0';
+    };
+
+    if(this->pathIndex == nullptr)
+    {
+        for(size_t iSlot = 0; iSlot < this->getSlotCount(); iSlot++)
+        {
+            for(size_t iTrack = 0; iTrack < this->getTrackCount(iSlot); iTrack++)
+            {
+                if(matches(iSlot, iTrack))
+                {
+                    slot = iSlot;
+                    index = iTrack;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    auto hash = hashPath(path, length);
+    for(size_t pos = hash & this->pathIndexMask; this->pathIndex[pos].slot != METADATA_PATH_INDEX_EMPTY; pos = (pos + 1) & this->pathIndexMask)
+    {
+        auto& entry = this->pathIndex[pos];
+        if(entry.hash == hash && matches(entry.slot, entry.index))
+        {
+            slot = entry.slot;
+            index = entry.index;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char* MetadataCache::getTrackPath(size_t slot, size_t index) const
+{
+    return this->strings + this->tracks[this->slots[slot].firstTrack + index].pathOffset;
+}
+
+const char* MetadataCache::getTrackTitle(size_t slot, size_t index) const
+{
+    return this->strings + this->tracks[this->slots[slot].firstTrack + index].titleOffset;
+}
+
+const char* MetadataCache::getTrackArtist(size_t slot, size_t index) const
+{
+    return this->strings + this->tracks[this->slots[slot].firstTrack + index].artistOffset;
+}
+
+uint32_t MetadataCache::getTrackSize(size_t slot, size_t index) const
+{
+    return this->tracks[this->slots[slot].firstTrack + index].size;
+}
+
+uint32_t MetadataCache::getTrackLastWrite(size_t slot, size_t index) const
+{
+    return this->tracks[this->slots[slot].firstTrack + index].lastWrite;
+}
+
+uint16_t MetadataCache::getTrackNumber(size_t slot, size_t index) const
+{
+    return this->tracks[this->slots[slot].firstTrack + index].trackNumber;
+}
+
+uint16_t MetadataCache::getDiscNumber(size_t slot, size_t index) const
+{
+    return this->tracks[this->slots[slot].firstTrack + index].discNumber;
+}
+
+uint32_t MetadataCache::getTrackDurationMs(size_t slot, size_t index) const
+{
+    return this->tracks[this->slots[slot].firstTrack + index].durationMs;
+}
+
+// FNV-1a
+uint32_t MetadataCache::hashPath(const char* path, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<uint8_t>(path[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+MetadataCacheBuilder::MetadataCacheBuilder()
+{
+    // offset 0 is always the empty string
+    this->strings.push_back('\0');
+}
+
+uint32_t MetadataCacheBuilder::addString(const char* str)
+{
+    if(str == nullptr || str[0] == '\0')
+        return 0;
+
+    // consecutive tracks of an album mostly share the artist, reuse the previous entry then
+    if(!this->tracks.empty())
+    {
+        auto lastArtist = this->tracks.back().artistOffset;
+        if(strcmp(this->strings.data() + lastArtist, str) == 0)
+            return lastArtist;
+    }
+
+    uint32_t offset = this->strings.size();
+    this->strings.insert(this->strings.end(), str, str + strlen(str) + 1);
+    return offset;
+}
+
+void MetadataCacheBuilder::beginSlot(const char* path, uint32_t lastWrite)
+{
+    MetadataCacheSlot slot;
+    slot.pathOffset = this->addString(path);
+    slot.firstTrack = this->tracks.size();
+    slot.trackCount = 0;
+    slot.lastWrite = lastWrite;
+    this->slots.push_back(slot);
+}
+
+void MetadataCacheBuilder::addTrack(const char* path, const char* title, const char* artist, uint32_t size, uint32_t lastWrite,
+    uint16_t trackNumber, uint16_t discNumber, uint32_t durationMs)
+{
+    MetadataCacheTrack track;
+    track.pathOffset = this->addString(path);
+    track.titleOffset = this->addString(title);
+    track.artistOffset = this->addString(artist);
+    track.size = size;
+    track.lastWrite = lastWrite;
+    track.trackNumber = trackNumber;
+    track.discNumber = discNumber;
+    track.durationMs = durationMs;
+    this->tracks.push_back(track);
+    this->slots.back().trackCount++;
+}
+
+// Track numbers are only used if they are unique in the slot: several albums in one slot
+// (each starting at track 1) would be interleaved otherwise.
+void MetadataCacheBuilder::sortSlot(const MetadataCacheSlot& slot)
+{
+    auto first = this->tracks.begin() + slot.firstTrack;
+    auto last = first + slot.trackCount;
+    const char* strings = this->strings.data();
+
+    auto byPath = [strings](const MetadataCacheTrack& a, const MetadataCacheTrack& b) {
+        return NaturalSort::less(strings + a.pathOffset, strings + b.pathOffset);
+    };
+    auto byNumber = [byPath](const MetadataCacheTrack& a, const MetadataCacheTrack& b) {
+        if(a.discNumber != b.discNumber)
+            return a.discNumber < b.discNumber;
+        if(a.trackNumber != b.trackNumber)
+            return a.trackNumber < b.trackNumber;
+        return byPath(a, b);
+    };
+
+    bool numbered = std::all_of(first, last, [](const MetadataCacheTrack& track) { return track.trackNumber != 0; });
+    if(numbered)
+    {
+        std::sort(first, last, byNumber);
+        numbered = std::adjacent_find(first, last, [](const MetadataCacheTrack& a, const MetadataCacheTrack& b) {
+            return a.trackNumber == b.trackNumber && a.discNumber == b.discNumber;
+        }) == last;
+    }
+
+    if(!numbered)
+        std::sort(first, last, byPath);
+}
+
+std::unique_ptr<MetadataCache> MetadataCacheBuilder::build()
+{
+    for(const auto& slot : this->slots)
+        this->sortSlot(slot);
+
+    MetadataCacheHeader hdr;
+    hdr.magic = METADATA_CACHE_MAGIC;
+    hdr.version = METADATA_CACHE_VERSION;
+    hdr.slotCount = this->slots.size();
+    hdr.trackCount = this->tracks.size();
+    hdr.stringTableSize = this->strings.size();
+
+    size_t slotsSize = this->slots.size() * sizeof(MetadataCacheSlot);
+    size_t tracksSize = this->tracks.size() * sizeof(MetadataCacheTrack);
+    size_t size = sizeof(hdr) + slotsSize + tracksSize + this->strings.size();
+
+    auto block = static_cast<uint8_t*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+    if(block == nullptr)
+        throw std::bad_alloc();
+
+    uint8_t* dst = block;
+    memcpy(dst, &hdr, sizeof(hdr));
+    dst += sizeof(hdr);
+    memcpy(dst, this->slots.data(), slotsSize);
+    dst += slotsSize;
+    memcpy(dst, this->tracks.data(), tracksSize);
+    dst += tracksSize;
+    memcpy(dst, this->strings.data(), this->strings.size());
+
+    return std::make_unique<MetadataCache>(block, size);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "userconfig.h"
+
+// Binary metadata cache file layout (little endian, as written by the ESP32):
+//
+//   MetadataCacheHeader
+//   MetadataCacheSlot[slotCount]
+//   MetadataCacheTrack[trackCount]
+//   char stringTable[stringTableSize]   (zero terminated strings, referenced by offset)
+//
+// The whole file is read with one sequential read into a single PSRAM block,
+// all accessors point directly into that block.
+//
+// Size and last write stamp of every file (and the stamp of every slot directory)
+// are stored, so a rescan only has to parse the tags of added or changed files.
+//
+// The tracks of a slot are stored in play order, sorted once when the cache is built: by
+// disc and track number if every track of the slot has a distinct one, otherwise by path
+// in natural order ("Kapitel 2" before "Kapitel 10").
+//
+// The duration of a track is taken from its first MPEG frame (Xing/VBRI header or bitrate),
+// so the app can list a slot without opening every file.
+
+#define METADATA_CACHE_MAGIC 0x434D4248 // "HBMC"
+#define METADATA_CACHE_VERSION 4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slotCount;
+    uint32_t trackCount;
+    uint32_t stringTableSize;
+} MetadataCacheHeader;
+
+typedef struct {
+    uint32_t pathOffset;
+    uint32_t firstTrack;
+    uint32_t trackCount;
+    uint32_t lastWrite;
+} MetadataCacheSlot;
+
+typedef struct {
+    uint32_t pathOffset;
+    uint32_t titleOffset;
+    uint32_t artistOffset;
+    uint32_t size;
+    uint32_t lastWrite;
+    uint16_t trackNumber;   // 0 if not tagged
+    uint16_t discNumber;
+    uint32_t durationMs;    // 0 if unknown
+} MetadataCacheTrack;
+
+// Entry of the in-memory path index (open addressing, not persisted)
+typedef struct {
+    uint32_t hash;
+    uint32_t slot;
+    uint32_t index;
+} MetadataPathIndexEntry;
+
+#define METADATA_PATH_INDEX_EMPTY UINT32_MAX
+
+static_assert(sizeof(MetadataCacheHeader) == 16, "cache header layout changed");
+static_assert(sizeof(MetadataCacheSlot) == 16, "cache slot layout changed");
+static_assert(sizeof(MetadataCacheTrack) == 28, "cache track layout changed");
+
+class MetadataCache {
+    private:
+        uint8_t* data;
+        size_t dataSize;
+        const MetadataCacheHeader* header;
+        const MetadataCacheSlot* slots;
+        const MetadataCacheTrack* tracks;
+        const char* strings;
+        MetadataPathIndexEntry* pathIndex;
+        size_t pathIndexMask;
+        bool attach(uint8_t* block, size_t size);
+        void buildPathIndex();
+        void release();
+    public:
+        MetadataCache();
+        MetadataCache(uint8_t* block, size_t size);
+        ~MetadataCache();
+        MetadataCache(const MetadataCache&) = delete;
+        MetadataCache& operator=(const MetadataCache&) = delete;
+        bool load(FSTYPE& fs, const char* path);
+        bool save(FSTYPE& fs, const char* path) const;
+        bool matchesSlots(const SlotDirectoryList& slotDirectories) const;
+        size_t getSizeBytes() const;
+        size_t getSlotCount() const;
+        size_t getTotalTrackCount() const;
+        const char* getSlotPath(size_t slot) const;
+        uint32_t getSlotLastWrite(size_t slot) const;
+        int findSlot(const char* path) const;
+        size_t getTrackCount(size_t slot) const;
+        int findTrack(size_t slot, const char* path, size_t hint) const;
+        bool findPath(const char* path, size_t length, size_t& slot, size_t& index) const;
+        const char* getTrackPath(size_t slot, size_t index) const;
+        const char* getTrackTitle(size_t slot, size_t index) const;
+        const char* getTrackArtist(size_t slot, size_t index) const;
+        uint32_t getTrackSize(size_t slot, size_t index) const;
+        uint32_t getTrackLastWrite(size_t slot, size_t index) const;
+        uint16_t getTrackNumber(size_t slot, size_t index) const;
+        uint16_t getDiscNumber(size_t slot, size_t index) const;
+        uint32_t getTrackDurationMs(size_t slot, size_t index) const;
+        static uint32_t hashPath(const char* path, size_t length);
+};
+
+class MetadataCacheBuilder {
+    private:
+        std::vector<MetadataCacheSlot, PsramAllocator<MetadataCacheSlot>> slots;
+        std::vector<MetadataCacheTrack, PsramAllocator<MetadataCacheTrack>> tracks;
+        std::vector<char, PsramAllocator<char>> strings;
+        uint32_t addString(const char* str);
+        void sortSlot(const MetadataCacheSlot& slot);
+    public:
+        MetadataCacheBuilder();
+        void beginSlot(const char* path, uint32_t lastWrite);
+        void addTrack(const char* path, const char* title, const char* artist, uint32_t size, uint32_t lastWrite,
+            uint16_t trackNumber, uint16_t discNumber, uint32_t durationMs);
+        std::unique_ptr<MetadataCache> build();
+};
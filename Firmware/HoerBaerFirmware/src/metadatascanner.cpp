@@ -0,0 +1,115 @@
+#include <memory>
+#include "log.h"
+#include "config.h"
+#include "metadatascanner.h"
+
+void MetadataScanWorkerTask(void* param)
+{
+    MetadataScanner* scanner = static_cast<MetadataScanner*>(param);
+    scanner->runWorkerTask();
+}
+
+MetadataScanner::MetadataScanner(FSTYPE& fs) : fs(fs)
+{
+    this->pending = 0;
+    this->workers = 0;
+    this->jobs = xQueueCreate(METADATA_SCAN_QUEUE_SIZE, sizeof(MetadataScanEntry*));
+    this->parsed = xSemaphoreCreateCounting(UINT16_MAX, 0);
+    this->stopped = xSemaphoreCreateCounting(METADATA_SCAN_WORKERS, 0);
+
+    for(int i = 0; i < METADATA_SCAN_WORKERS; i++)
+    {
+        auto result = xTaskCreatePinnedToCore(MetadataScanWorkerTask, "metadata_scan",
+            TASK_STACK_SIZE_METADATA_SCAN_WORKER_WORDS,
+            this,
+            TASK_PRIO_METADATA_SCAN_WORKER,
+            NULL,
+            i % portNUM_PROCESSORS);
+
+        if(result != pdPASS)
+        {
+            Log::println("ID3", "Failed to create metadata scan worker %d", i);
+            break;
+        }
+        this->workers++;
+    }
+
+    if(this->workers == 0)
+    {
+        Log::println("ID3", "No metadata scan workers, parsing inline");
+        this->inlineBuffer.reset(new uint8_t[ID3_PARSER_BUFFER_SIZE]);
+    }
+}
+
+MetadataScanner::~MetadataScanner()
+{
+    this->waitUntilParsed();
+
+    // one stop job (null entry) per worker
+    MetadataScanEntry* stop = nullptr;
+    for(int i = 0; i < this->workers; i++)
+        xQueueSend(this->jobs, &stop, portMAX_DELAY);
+
+    for(int i = 0; i < this->workers; i++)
+        xSemaphoreTake(this->stopped, portMAX_DELAY);
+
+    vQueueDelete(this->jobs);
+    vSemaphoreDelete(this->parsed);
+    vSemaphoreDelete(this->stopped);
+}
+
+// Blocks while the queue is full, so the producer does not run ahead of the card
+void MetadataScanner::parse(MetadataScanEntry* entry)
+{
+    if(this->workers == 0)
+    {
+        this->parseEntry(entry, this->inlineBuffer.get());
+        return;
+    }
+
+    this->pending++;
+    xQueueSend(this->jobs, &entry, portMAX_DELAY);
+}
+
+void MetadataScanner::waitUntilParsed()
+{
+    for(; this->pending > 0; this->pending--)
+        xSemaphoreTake(this->parsed, portMAX_DELAY);
+}
+
+void MetadataScanner::runWorkerTask()
+{
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[ID3_PARSER_BUFFER_SIZE]); // reused for all files
+    MetadataScanEntry* entry;
+
+    while(xQueueReceive(this->jobs, &entry, portMAX_DELAY) == pdTRUE && entry != nullptr)
+    {
+        this->parseEntry(entry, buffer.get());
+        xSemaphoreGive(this->parsed);
+    }
+
+    buffer.reset();
+    xSemaphoreGive(this->stopped);
+    vTaskDelete(NULL);
+}
+
+// tags and duration in one pass: the first frame mostly follows the tag in the same block
+void MetadataScanner::parseEntry(MetadataScanEntry* entry, uint8_t* buffer)
+{
+    entry->tags = { "", "", 0, 0 };
+    entry->durationMs = 0;
+
+    File file = this->fs.open(entry->path.c_str());
+    if(!file)
+    {
+        Log::println("ID3", "Metadata: failed to open file: %s", entry->path.c_str());
+        return;
+    }
+
+    ID3BlockReader reader(file, buffer, ID3_PARSER_BUFFER_SIZE);
+    entry->tags = ID3Parser::readId3Tags(reader, file.size(), ID3_PARSER_BUFFER_SIZE);
+    MP3SeekTable header;
+    if(header.readHeader(reader, file.size()))
+        entry->durationMs = header.getDurationMs();
+    file.close();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string>
+#include <memory>
+#include "sdcard.h"
+#include "id3parser.h"
+#include "mp3seektable.h"
+
+typedef struct {
+    std::string path;
+    uint32_t size;
+    uint32_t lastWrite;
+    int cachedIndex;    // index of the unchanged track in the cached slot, -1 if parsed
+    ID3Tags tags;       // filled by the scanner workers
+    uint32_t durationMs;
+} MetadataScanEntry;
+
+// Parses the tags of queued files on a pool of worker tasks, one per core, each with its own
+// read buffer. While one worker waits for the card, the other parses, and the producer
+// (walking the directories) keeps the queue filled. Entries must stay in place until
+// waitUntilParsed() returns, the caller merges them in its own order.
+class MetadataScanner {
+    private:
+        FSTYPE& fs;
+        QueueHandle_t jobs;
+        SemaphoreHandle_t parsed;
+        SemaphoreHandle_t stopped;
+        size_t pending;
+        int workers;
+        std::unique_ptr<uint8_t[]> inlineBuffer;   // without workers the producer parses itself
+        void parseEntry(MetadataScanEntry* entry, uint8_t* buffer);
+    public:
+        MetadataScanner(FSTYPE& fs);
+        ~MetadataScanner();
+        MetadataScanner(const MetadataScanner&) = delete;
+        MetadataScanner& operator=(const MetadataScanner&) = delete;
+        void parse(MetadataScanEntry* entry);
+        void waitUntilParsed();
+        void runWorkerTask();
+};
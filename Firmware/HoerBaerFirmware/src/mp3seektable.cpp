@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cstring>
+#include "log.h"
+#include "mp3seektable.h"
+
+// kbit/s by bitrate index: MPEG1 layer I, II, III, MPEG2/2.5 layer I, II & III
+static const uint16_t bitrateTable[4][15] = {
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+};
+
+static const uint16_t mpeg2Layer1Bitrates[15] = { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 };
+
+static const uint32_t sampleRateTable[3] = { 44100, 48000, 32000 };
+
+MP3SeekTable::MP3SeekTable()
+{
+    this->type = MP3_SEEK_TABLE_NONE;
+    this->intervalMs = 1;
+    this->durationMs = 0;
+    this->audioStart = 0;
+    this->audioEnd = 0;
+    this->firstBitrate = 0;
+}
+
+uint32_t MP3SeekTable::readBigEndian(const uint8_t* data, size_t length)
+{
+    uint32_t value = 0;
+    for(size_t i = 0; i < length; i++)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+bool MP3SeekTable::parseFrameHeader(const uint8_t* data, MP3FrameHeader& header)
+{
+    if(data[0] != 0xFF || (data[1] & 0xE0) != 0xE0)
+        return false;
+
+    uint8_t versionBits = (data[1] >> 3) & 0x03;
+    uint8_t layerBits = (data[1] >> 1) & 0x03;
+    uint8_t bitrateIndex = data[2] >> 4;
+    uint8_t sampleRateIndex = (data[2] >> 2) & 0x03;
+
+    if(versionBits == 1 || layerBits == 0 || bitrateIndex == 0 || bitrateIndex == 15 || sampleRateIndex == 3)
+        return false;
+
+    header.version = versionBits == 3 ? 1 : (versionBits == 2 ? 2 : 25);
+    header.layer = 4 - layerBits;
+    header.mono = (data[3] >> 6) == 3;
+
+    if(header.version == 1)
+        header.bitrate = bitrateTable[header.layer - 1][bitrateIndex] * 1000;
+    else
+        header.bitrate = (header.layer == 1 ? mpeg2Layer1Bitrates[bitrateIndex] : bitrateTable[3][bitrateIndex]) * 1000;
+
+    header.sampleRate = sampleRateTable[sampleRateIndex] / (header.version == 1 ? 1 : (header.version == 2 ? 2 : 4));
+
+    uint32_t padding = (data[2] >> 1) & 0x01;
+    if(header.layer == 1)
+    {
+        header.samplesPerFrame = 384;
+        header.frameSize = (12 * header.bitrate / header.sampleRate + padding) * 4;
+    }
+    else
+    {
+        header.samplesPerFrame = (header.layer == 3 && header.version != 1) ? 576 : 1152;
+        header.frameSize = header.samplesPerFrame / 8 * header.bitrate / header.sampleRate + padding;
+    }
+
+    return header.frameSize > 4;
+}
+
+// Skips an ID3v2 tag and searches the first frame, which is accepted only if another
+// frame header follows it (sync patterns also show up in garbage and cover art).
+bool MP3SeekTable::findFirstFrame(ID3BlockReader& reader, uint32_t& offset, MP3FrameHeader& header)
+{
+    uint32_t pos = 0;
+    const uint8_t* tag = reader.fetch(0, 10);
+    if(tag != nullptr && memcmp(tag, "ID3", 3) == 0)
+    {
+        uint32_t tagSize = (tag[6] & 0x7F) << 21 | (tag[7] & 0x7F) << 14 | (tag[8] & 0x7F) << 7 | (tag[9] & 0x7F);
+        pos = 10 + tagSize + ((tag[5] & 0x10) ? 10 : 0);
+    }
+
+    for(uint32_t limit = pos + MP3_SEEK_SYNC_SEARCH_LIMIT; pos < limit; pos++)
+    {
+        const uint8_t* data = reader.fetch(pos, 4);
+        if(data == nullptr)
+            return false;
+
+        if(!parseFrameHeader(data, header))
+            continue;
+
+        MP3FrameHeader nextHeader;
+        const uint8_t* next = reader.fetch(pos + header.frameSize, 4);
+        if(next == nullptr || parseFrameHeader(next, nextHeader))
+        {
+            offset = pos;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool MP3SeekTable::readXingHeader(const uint8_t* frame, const MP3FrameHeader& header, uint32_t frameOffset)
+{
+    size_t sideInfoSize = header.version == 1 ? (header.mono ? 17 : 32) : (header.mono ? 9 : 17);
+    const uint8_t* xing = frame + 4 + sideInfoSize;
+    if(header.layer != 3 || 4 + sideInfoSize + 16 > header.frameSize)
+        return false;
+
+    if(memcmp(xing, "Xing", 4) != 0 && memcmp(xing, "Info", 4) != 0)
+        return false;
+
+    uint32_t flags = readBigEndian(xing + 4, 4);
+    const uint8_t* field = xing + 8;
+    const uint8_t* frameEnd = frame + header.frameSize;
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+
+    if(flags & 0x01)
+    {
+        frames = readBigEndian(field, 4);
+        field += 4;
+    }
+
+    if(flags & 0x02)
+    {
+        bytes = readBigEndian(field, 4);
+        field += 4;
+    }
+
+    if(frames == 0)
+        return false;
+
+    if(bytes > 0 && frameOffset + bytes <= this->audioEnd)
+        this->audioEnd = frameOffset + bytes;
+
+    uint32_t audioBytes = this->audioEnd - frameOffset;
+    this->durationMs = (uint64_t)frames * header.samplesPerFrame * 1000 / header.sampleRate;
+    this->offsets.clear();
+
+    if((flags & 0x04) && field + 100 <= frameEnd)
+    {
+        // TOC: entry i is the file position at i% of the duration, in 1/256 of the audio bytes
+        this->offsets.reserve(100);
+        for(size_t i = 0; i < 100; i++)
+            this->offsets.push_back(frameOffset + (uint64_t)field[i] * audioBytes / 256);
+        this->intervalMs = std::max<uint32_t>(this->durationMs / 100, 1);
+    }
+    else
+    {
+        // no TOC (typical for CBR "Info" headers): position is linear from the first to the last byte
+        this->offsets.push_back(frameOffset);
+        this->intervalMs = std::max<uint32_t>(this->durationMs, 1);
+    }
+
+    this->type = MP3_SEEK_TABLE_XING;
+    return true;
+}
+
+bool MP3SeekTable::readVbriHeader(ID3BlockReader& reader, const MP3FrameHeader& header, uint32_t frameOffset)
+{
+    // VBRI header is always 32 bytes after the frame header, 26 bytes followed by the TOC
+    const uint8_t* vbri = reader.fetch(frameOffset + 36, 26);
+    if(vbri == nullptr || memcmp(vbri, "VBRI", 4) != 0)
+        return false;
+
+    uint32_t bytes = readBigEndian(vbri + 10, 4);
+    uint32_t frames = readBigEndian(vbri + 14, 4);
+    uint32_t entries = readBigEndian(vbri + 18, 2);
+    uint32_t scale = readBigEndian(vbri + 20, 2);
+    uint32_t entrySize = readBigEndian(vbri + 22, 2);
+    uint32_t framesPerEntry = readBigEndian(vbri + 24, 2);
+
+    if(frames == 0 || entries == 0 || entrySize == 0 || entrySize > 4 || framesPerEntry == 0)
+        return false;
+
+    if(bytes > 0 && frameOffset + bytes <= this->audioEnd)
+        this->audioEnd = frameOffset + bytes;
+
+    this->durationMs = (uint64_t)frames * header.samplesPerFrame * 1000 / header.sampleRate;
+    this->intervalMs = std::max<uint32_t>((uint64_t)framesPerEntry * header.samplesPerFrame * 1000 / header.sampleRate, 1);
+
+    // TOC entries are the byte sizes of each interval
+    this->offsets.clear();
+    this->offsets.reserve(entries + 1);
+    uint32_t offset = frameOffset;
+    this->offsets.push_back(offset);
+
+    uint32_t tocOffset = frameOffset + 36 + 26;
+    for(uint32_t i = 0; i < entries; i++)
+    {
+        const uint8_t* entry = reader.fetch(tocOffset + i * entrySize, entrySize);
+        if(entry == nullptr)
+        {
+            this->offsets.clear();
+            return false;
+        }
+
+        offset += readBigEndian(entry, entrySize) * scale;
+        this->offsets.push_back(std::min(offset, this->audioEnd));
+    }
+
+    this->type = MP3_SEEK_TABLE_VBRI;
+    return true;
+}
+
+// Cheap part, done synchronously on the first seek: the first frame and a Xing or VBRI TOC
+// if the encoder wrote one. Without a TOC the table only estimates from the first bitrate.
+bool MP3SeekTable::readHeader(FSTYPE& fs, const char* path, uint8_t* buffer, size_t bufferSize)
+{
+    this->type = MP3_SEEK_TABLE_NONE;
+
+    File file = fs.open(path);
+    if(!file)
+    {
+        Log::println("SEEK", "Unable to open %s", path);
+        return false;
+    }
+
+    ID3BlockReader reader(file, buffer, bufferSize);
+    bool read = this->readHeader(reader, file.size());
+    file.close();
+
+    if(!read)
+        Log::println("SEEK", "No MPEG frame found in %s", path);
+    return read;
+}
+
+// Same on a file that is opened already, e.g. right after its tags were read through the reader
+bool MP3SeekTable::readHeader(ID3BlockReader& reader, uint32_t fileSize)
+{
+    this->type = MP3_SEEK_TABLE_NONE;
+    this->audioEnd = fileSize;
+
+    uint32_t frameOffset;
+    MP3FrameHeader header;
+    if(!this->findFirstFrame(reader, frameOffset, header))
+        return false;
+
+    this->audioStart = frameOffset;
+    this->firstBitrate = header.bitrate;
+
+    const uint8_t* frame = reader.fetch(frameOffset, header.frameSize);
+    bool hasToc = (frame != nullptr && this->readXingHeader(frame, header, frameOffset)) ||
+        this->readVbriHeader(reader, header, frameOffset);
+
+    if(!hasToc)
+    {
+        this->type = MP3_SEEK_TABLE_ESTIMATE;
+        this->durationMs = (uint64_t)(this->audioEnd - this->audioStart) * 8000 / this->firstBitrate;
+    }
+
+    return true;
+}
+
+// Walks all frame headers once (buffered, no decoding) and records the offset of the first
+// frame of every MP3_SEEK_INDEX_INTERVAL_MS. Takes a while for long files, run it in the background.
+bool MP3SeekTable::buildFrameIndex(FSTYPE& fs, const char* path, uint8_t* buffer, size_t bufferSize)
+{
+    File file = fs.open(path);
+    if(!file)
+    {
+        Log::println("SEEK", "Unable to open %s", path);
+        return false;
+    }
+
+    ID3BlockReader reader(file, buffer, bufferSize);
+    uint32_t fileSize = file.size();
+
+    uint32_t pos;
+    MP3FrameHeader header;
+    if(!this->findFirstFrame(reader, pos, header))
+    {
+        file.close();
+        return false;
+    }
+
+    this->audioStart = pos;
+    this->audioEnd = fileSize;
+    this->firstBitrate = header.bitrate;
+    this->intervalMs = MP3_SEEK_INDEX_INTERVAL_MS;
+    this->offsets.clear();
+
+    uint32_t sampleRate = header.sampleRate;
+    uint64_t samples = 0;
+
+    while(pos + 4 <= fileSize)
+    {
+        const uint8_t* data = reader.fetch(pos, 4);
+        if(data == nullptr || !parseFrameHeader(data, header))
+        {
+            // ID3v1 tag at the end or a broken frame, try to sync again
+            bool synced = false;
+            uint32_t limit = std::min(pos + MP3_SEEK_SYNC_SEARCH_LIMIT, fileSize - 4);
+            while(++pos <= limit)
+            {
+                data = reader.fetch(pos, 4);
+                if(data != nullptr && parseFrameHeader(data, header))
+                {
+                    synced = true;
+                    break;
+                }
+            }
+
+            if(!synced)
+                break;
+        }
+
+        while(samples * 1000 / sampleRate >= (uint64_t)this->offsets.size() * this->intervalMs)
+            this->offsets.push_back(pos);
+
+        samples += header.samplesPerFrame;
+        pos += header.frameSize;
+    }
+
+    file.close();
+
+    this->audioEnd = std::min(pos, fileSize);
+    this->durationMs = samples * 1000 / sampleRate;
+    this->type = MP3_SEEK_TABLE_FRAME_INDEX;
+    return !this->offsets.empty();
+}
+
+MP3SeekTableType MP3SeekTable::getType() const
+{
+    return this->type;
+}
+
+// Estimated tables are only exact for CBR files, a frame index is worth building for them
+bool MP3SeekTable::isExact() const
+{
+    return this->type == MP3_SEEK_TABLE_XING || this->type == MP3_SEEK_TABLE_VBRI || this->type == MP3_SEEK_TABLE_FRAME_INDEX;
+}
+
+uint32_t MP3SeekTable::getDurationMs() const
+{
+    return this->durationMs;
+}
+
+uint32_t MP3SeekTable::getOffset(uint32_t positionMs) const
+{
+    if(this->type == MP3_SEEK_TABLE_NONE)
+        return 0;
+
+    if(this->type == MP3_SEEK_TABLE_ESTIMATE || this->offsets.empty())
+    {
+        uint64_t offset = this->audioStart + (uint64_t)positionMs * this->firstBitrate / 8000;
+        return std::min<uint64_t>(offset, this->audioEnd);
+    }
+
+    size_t index = positionMs / this->intervalMs;
+    if(index >= this->offsets.size())
+        index = this->offsets.size() - 1;
+
+    // frame index entries are frame starts, no interpolation
+    if(this->type == MP3_SEEK_TABLE_FRAME_INDEX)
+        return this->offsets[index];
+
+    uint32_t startMs = index * this->intervalMs;
+    uint32_t endMs = index + 1 < this->offsets.size() ? (index + 1) * this->intervalMs : this->durationMs;
+    uint32_t start = this->offsets[index];
+    uint32_t end = index + 1 < this->offsets.size() ? this->offsets[index + 1] : this->audioEnd;
+
+    if(endMs <= startMs || end <= start || positionMs <= startMs)
+        return start;
+
+    positionMs = std::min(positionMs, endMs);
+    return start + (uint64_t)(end - start) * (positionMs - startMs) / (endMs - startMs);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "userconfig.h"
+#include "id3parser.h"
+
+// Distance of the entries of a frame index built by walking the file
+#define MP3_SEEK_INDEX_INTERVAL_MS 1000
+// Bytes searched for a frame sync after the ID3v2 tag (or after a broken frame)
+#define MP3_SEEK_SYNC_SEARCH_LIMIT (16 * 1024)
+
+typedef enum {
+    MP3_SEEK_TABLE_NONE,        // no MPEG frame found
+    MP3_SEEK_TABLE_ESTIMATE,    // bitrate of the first frame only (exact for CBR files)
+    MP3_SEEK_TABLE_XING,        // Xing/Info header TOC (100 entries)
+    MP3_SEEK_TABLE_VBRI,        // Fraunhofer VBRI header TOC
+    MP3_SEEK_TABLE_FRAME_INDEX  // built by walking all frame headers
+} MP3SeekTableType;
+
+typedef struct {
+    uint8_t version;        // 1 = MPEG1, 2 = MPEG2, 25 = MPEG2.5
+    uint8_t layer;
+    bool mono;
+    uint32_t bitrate;       // bits per second
+    uint32_t sampleRate;
+    uint32_t samplesPerFrame;
+    uint32_t frameSize;     // bytes including header
+} MP3FrameHeader;
+
+// Maps a play position (milliseconds) to the file offset of the frame to continue decoding at,
+// so a seek is one file seek. The table holds offsets in equal time steps, lookups interpolate
+// linearly between the two surrounding entries.
+class MP3SeekTable {
+    private:
+        MP3SeekTableType type;
+        std::vector<uint32_t, PsramAllocator<uint32_t>> offsets;
+        uint32_t intervalMs;
+        uint32_t durationMs;
+        uint32_t audioStart;
+        uint32_t audioEnd;
+        uint32_t firstBitrate;
+        static uint32_t readBigEndian(const uint8_t* data, size_t length);
+        bool findFirstFrame(ID3BlockReader& reader, uint32_t& offset, MP3FrameHeader& header);
+        bool readXingHeader(const uint8_t* frame, const MP3FrameHeader& header, uint32_t frameOffset);
+        bool readVbriHeader(ID3BlockReader& reader, const MP3FrameHeader& header, uint32_t frameOffset);
+    public:
+        MP3SeekTable();
+        static bool parseFrameHeader(const uint8_t* data, MP3FrameHeader& header);
+        bool readHeader(FSTYPE& fs, const char* path, uint8_t* buffer, size_t bufferSize);
+        bool readHeader(ID3BlockReader& reader, uint32_t fileSize);
+        bool buildFrameIndex(FSTYPE& fs, const char* path, uint8_t* buffer, size_t bufferSize);
+        MP3SeekTableType getType() const;
+        bool isExact() const;
+        uint32_t getDurationMs() const;
+        uint32_t getOffset(uint32_t positionMs) const;
+};
@@ -0,0 +1,593 @@
+#include <algorithm>
+#include "log.h"
+#include "mscpipeline.h"
+
+// The SD card driver only transfers DMA capable buffers with multi block commands (PSRAM
+// buffers are bounced sector by sector), so internal RAM is preferred. Nothing else runs in
+// USB mode, there is enough of it.
+static uint8_t* allocateTransferBuffer(size_t size)
+{
+    auto buffer = static_cast<uint8_t*>(heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL));
+    if(buffer != nullptr)
+        return buffer;
+
+    Log::println("USBMSC", "No internal DMA memory for %d bytes buffer, using PSRAM", size);
+    buffer = static_cast<uint8_t*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+    if(buffer == nullptr)
+        throw std::bad_alloc();
+
+    return buffer;
+}
+
+static uint16_t readLE16(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t readLE32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool isBootSector(const uint8_t* sector, size_t sectorSize)
+{
+    bool jump = sector[0] == 0xEB || sector[0] == 0xE9;
+    bool exfat = memcmp(sector + 3, "EXFAT   ", 8) == 0;
+    return jump && (exfat || readLE16(sector + 0x0B) == sectorSize);
+}
+
+void MSCWorkerTask(void* param)
+{
+    MSCPipeline* pipeline = static_cast<MSCPipeline*>(param);
+    pipeline->runWorkerTask();
+}
+
+MSCPipeline::MSCPipeline(shared_ptr<BlockDevice> device)
+{
+    this->device = device;
+    this->sectorSize = device->getSectorSize();
+    this->readSectors = USB_MSC_READ_BUFFER_SIZE / this->sectorSize;
+    this->slotSectors = USB_MSC_WRITE_SLOT_SIZE / this->sectorSize;
+    this->openSlot = -1;
+    this->lastReadEnd = 0;
+    this->writeErrors = 0;
+    this->reportedWriteErrors = 0;
+    this->sectorCache = make_unique<SectorCache>(USB_MSC_SECTOR_CACHE_SECTORS, this->sectorSize);
+    this->cacheFlushBuffer = allocateTransferBuffer(USB_MSC_SECTOR_CACHE_FLUSH_SIZE);
+    this->cacheFlushQueued = false;
+    this->metadataStart = 0;
+    this->metadataEnd = 0;
+    this->lastWrite = 0;
+    this->lastReportedCacheStats = {};
+
+    for(auto& buffer : this->readBuffers)
+    {
+        buffer.data = allocateTransferBuffer(USB_MSC_READ_BUFFER_SIZE);
+        buffer.sector = 0;
+        buffer.count = 0;
+        buffer.generation = 0;
+        buffer.valid = false;
+        buffer.failed = false;
+        buffer.pending = false;
+        buffer.done = xSemaphoreCreateBinary();
+    }
+
+    for(auto& slot : this->writeSlots)
+    {
+        slot.data = allocateTransferBuffer(USB_MSC_WRITE_SLOT_SIZE);
+        slot.sector = 0;
+        slot.count = 0;
+        slot.state = MSC_SLOT_FREE;
+    }
+
+    this->lock = xSemaphoreCreateMutex();
+    this->freeSlots = xSemaphoreCreateCounting(USB_MSC_WRITE_SLOTS, USB_MSC_WRITE_SLOTS);
+    this->flushDone = xSemaphoreCreateBinary();
+    // every buffer and slot has at most one job queued, plus one cache flush and one flush
+    this->jobs = xQueueCreate(MSC_READ_BUFFERS + USB_MSC_WRITE_SLOTS + 2, sizeof(MSCJob));
+}
+
+MSCPipeline::~MSCPipeline()
+{
+    for(auto& buffer : this->readBuffers)
+        heap_caps_free(buffer.data);
+
+    for(auto& slot : this->writeSlots)
+        heap_caps_free(slot.data);
+
+    heap_caps_free(this->cacheFlushBuffer);
+}
+
+void MSCPipeline::initialize()
+{
+    this->detectMetadataRegion();
+
+    xTaskCreate(MSCWorkerTask, "msc_worker",
+        TASK_STACK_SIZE_USB_MSC_WORKER_WORDS,
+        this,
+        TASK_PRIO_USB_MSC_WORKER,
+        NULL);
+}
+
+void MSCPipeline::queueJob(MSCJobType type, uint8_t index)
+{
+    MSCJob job = { type, index };
+    xQueueSend(this->jobs, &job, portMAX_DELAY);
+}
+
+// Finds the area in front of the first data cluster (boot sector, FATs and the FAT12/16 root
+// directory, or the exFAT FAT and bitmap area). Runs before the worker is started.
+void MSCPipeline::detectMetadataRegion()
+{
+    uint8_t* sector = this->readBuffers[0].data;
+    uint32_t volumeStart = 0;
+
+    if(!this->device->readSectors(sector, 0, 1) || readLE16(sector + 510) != 0xAA55)
+    {
+        Log::println("USBMSC", "No boot sector found, caching single sector writes only");
+        return;
+    }
+
+    if(!isBootSector(sector, this->sectorSize))
+    {
+        // partitioned card, the volume starts at the first MBR partition
+        volumeStart = readLE32(sector + 0x1BE + 8);
+        if(volumeStart == 0 || !this->device->readSectors(sector, volumeStart, 1) || !isBootSector(sector, this->sectorSize))
+        {
+            Log::println("USBMSC", "No FAT volume found, caching single sector writes only");
+            return;
+        }
+    }
+
+    uint32_t end;
+    if(memcmp(sector + 3, "EXFAT   ", 8) == 0)
+    {
+        end = volumeStart + readLE32(sector + 0x58); // cluster heap offset
+    }
+    else
+    {
+        uint32_t reservedSectors = readLE16(sector + 0x0E);
+        uint32_t fatCount = sector[0x10];
+        uint32_t rootEntries = readLE16(sector + 0x11);
+        uint32_t fatSectors = readLE16(sector + 0x16);
+        if(fatSectors == 0)
+            fatSectors = readLE32(sector + 0x24); // FAT32
+
+        uint32_t rootSectors = (rootEntries * 32 + this->sectorSize - 1) / this->sectorSize;
+        end = volumeStart + reservedSectors + fatCount * fatSectors + rootSectors;
+    }
+
+    if(end <= volumeStart || end > this->device->getSectorCount())
+    {
+        Log::println("USBMSC", "Invalid FAT layout, caching single sector writes only");
+        return;
+    }
+
+    this->metadataStart = volumeStart;
+    this->metadataEnd = end;
+    Log::println("USBMSC", "File system metadata in sectors %u - %u", this->metadataStart, this->metadataEnd);
+}
+
+bool MSCPipeline::isCacheable(uint32_t sector, uint32_t count)
+{
+    return count == 1 || (sector >= this->metadataStart && sector + count <= this->metadataEnd);
+}
+
+// Caches as much of the write as possible, returns the number of sectors taken.
+// caller holds the lock
+uint32_t MSCPipeline::writeToCache(const uint8_t* data, uint32_t sector, uint32_t count)
+{
+    // older data of these sectors still waits in a slot, the slot must be written first
+    if(!this->isCacheable(sector, count) || this->overlapsQueuedWrites(sector, count))
+        return 0;
+
+    uint32_t n = 0;
+    while(n < count && this->sectorCache->put(sector + n, data + n * this->sectorSize, true))
+        n++;
+
+    if(!this->cacheFlushQueued && this->sectorCache->getDirtyCount() >= this->sectorCache->getCapacity() * 3 / 4)
+    {
+        this->cacheFlushQueued = true;
+        this->queueJob(MSC_JOB_CACHE_FLUSH, 0);
+    }
+
+    return n;
+}
+
+// Puts cached sectors over what was read from the card and keeps metadata sectors for later.
+// caller holds the lock
+void MSCPipeline::readFromCache(uint8_t* data, uint32_t sector, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint8_t* sectorData = data + i * this->sectorSize;
+        const uint8_t* cached = this->sectorCache->lookup(sector + i);
+        if(cached != nullptr)
+        {
+            memcpy(sectorData, cached, this->sectorSize);
+            this->sectorCache->countReadHits(1);
+        }
+        else if(sector + i >= this->metadataStart && sector + i < this->metadataEnd)
+        {
+            this->sectorCache->put(sector + i, sectorData, false);
+            this->sectorCache->countReadMisses(1);
+        }
+    }
+}
+
+// Writes all dirty sectors in runs of consecutive sectors. Only called by the worker.
+void MSCPipeline::flushSectorCache()
+{
+    uint32_t maxSectors = USB_MSC_SECTOR_CACHE_FLUSH_SIZE / this->sectorSize;
+    while(true)
+    {
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        uint32_t sector;
+        size_t count = this->sectorCache->collectDirtyRun(sector, this->cacheFlushBuffer, maxSectors);
+        // read buffers filled before could hold older data, once clean the sectors may be evicted
+        if(count > 0)
+            this->invalidateReadBuffers(sector, count);
+        xSemaphoreGive(this->lock);
+
+        if(count == 0)
+            break;
+
+        bool written = this->device->writeSectors(this->cacheFlushBuffer, sector, count);
+
+        // after a failed write the sectors stay dirty, the next flush tries again (at the
+        // latest once the host was idle for another USB_MSC_SECTOR_CACHE_IDLE_FLUSH_MILLIS)
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        this->sectorCache->finishFlush(sector, count, written);
+        if(!written)
+            this->lastWrite = xTaskGetTickCount();
+        xSemaphoreGive(this->lock);
+
+        if(!written)
+        {
+            this->writeErrors++;
+            break;
+        }
+    }
+}
+
+// caller holds the lock
+void MSCPipeline::closeOpenSlot()
+{
+    if(this->openSlot < 0)
+        return;
+
+    this->writeSlots[this->openSlot].state = MSC_SLOT_QUEUED;
+    this->queueJob(MSC_JOB_WRITE, this->openSlot);
+    this->openSlot = -1;
+}
+
+// caller holds the lock
+void MSCPipeline::invalidateReadBuffers(uint32_t sector, uint32_t count)
+{
+    for(auto& buffer : this->readBuffers)
+    {
+        if(sector < buffer.sector + buffer.count && buffer.sector < sector + count)
+        {
+            // a running read finishes, but is discarded because of the generation change
+            buffer.generation++;
+            buffer.valid = false;
+            buffer.count = 0;
+        }
+    }
+}
+
+// caller holds the lock
+bool MSCPipeline::overlapsQueuedWrites(uint32_t sector, uint32_t count)
+{
+    for(auto& slot : this->writeSlots)
+    {
+        if(slot.state != MSC_SLOT_FREE && sector < slot.sector + slot.count && slot.sector < sector + count)
+            return true;
+    }
+
+    return false;
+}
+
+// caller holds the lock
+int MSCPipeline::findReadBuffer(uint32_t sector)
+{
+    for(int i = 0; i < MSC_READ_BUFFERS; i++)
+    {
+        auto& buffer = this->readBuffers[i];
+        if((buffer.valid || buffer.pending) && sector >= buffer.sector && sector < buffer.sector + buffer.count)
+            return i;
+    }
+
+    return -1;
+}
+
+// caller holds the lock
+void MSCPipeline::startPrefetch(int index, uint32_t sector)
+{
+    auto& buffer = this->readBuffers[index];
+    buffer.sector = sector;
+    buffer.count = std::min<uint32_t>(this->readSectors, this->device->getSectorCount() - sector);
+    buffer.valid = false;
+    buffer.failed = false;
+    buffer.pending = true;
+    this->queueJob(MSC_JOB_READ, index);
+}
+
+bool MSCPipeline::read(uint8_t* data, uint32_t sector, uint32_t count)
+{
+    // metadata the host reads again and again
+    xSemaphoreTake(this->lock, portMAX_DELAY);
+    if(this->sectorCache->containsAll(sector, count))
+    {
+        this->readFromCache(data, sector, count);
+        xSemaphoreGive(this->lock);
+        return true;
+    }
+    xSemaphoreGive(this->lock);
+
+    while(count > 0)
+    {
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        bool overlapsWrites = this->overlapsQueuedWrites(sector, count);
+        xSemaphoreGive(this->lock);
+
+        // the host reads back what it just wrote, write it out first (cached sectors can stay)
+        if(overlapsWrites && !this->drain(false))
+            return false;
+
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        int index = this->findReadBuffer(sector);
+        if(index < 0)
+        {
+            // miss: read into a buffer that is not busy, waiting for one if both are
+            for(int i = 0; i < MSC_READ_BUFFERS && index < 0; i++)
+            {
+                if(!this->readBuffers[i].pending)
+                    index = i;
+            }
+
+            while(index < 0)
+            {
+                xSemaphoreGive(this->lock);
+                xSemaphoreTake(this->readBuffers[0].done, portMAX_DELAY);
+                xSemaphoreTake(this->lock, portMAX_DELAY);
+                if(!this->readBuffers[0].pending)
+                    index = 0;
+            }
+
+            this->startPrefetch(index, sector);
+        }
+
+        // wait for the worker, the done semaphore may also be left over from an earlier read
+        auto& buffer = this->readBuffers[index];
+        while(buffer.pending)
+        {
+            xSemaphoreGive(this->lock);
+            xSemaphoreTake(buffer.done, portMAX_DELAY);
+            xSemaphoreTake(this->lock, portMAX_DELAY);
+        }
+
+        if(buffer.failed)
+        {
+            xSemaphoreGive(this->lock);
+            Log::println("USBMSC", "Failed to read sector %u", sector);
+            return false;
+        }
+
+        // discarded by a write or flush overlapping it, read again
+        if(!buffer.valid || sector < buffer.sector || sector >= buffer.sector + buffer.count)
+        {
+            xSemaphoreGive(this->lock);
+            continue;
+        }
+
+        uint32_t n = std::min(count, buffer.sector + buffer.count - sector);
+        memcpy(data, buffer.data + (sector - buffer.sector) * this->sectorSize, n * this->sectorSize);
+        this->readFromCache(data, sector, n);
+
+        // sequential reading: while the host gets this buffer, fill the other one with what follows
+        uint32_t nextSector = buffer.sector + buffer.count;
+        auto& other = this->readBuffers[(index + 1) % MSC_READ_BUFFERS];
+        if(sector == this->lastReadEnd && nextSector < this->device->getSectorCount() && !other.pending &&
+            !(other.valid && other.sector == nextSector))
+            this->startPrefetch((index + 1) % MSC_READ_BUFFERS, nextSector);
+
+        this->lastReadEnd = sector + n;
+        xSemaphoreGive(this->lock);
+
+        data += n * this->sectorSize;
+        sector += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+bool MSCPipeline::write(const uint8_t* data, uint32_t sector, uint32_t count)
+{
+    // failed background writes were already acknowledged, report them with the next write at least
+    if(this->writeErrors != this->reportedWriteErrors)
+    {
+        this->reportedWriteErrors = this->writeErrors;
+        return false;
+    }
+
+    xSemaphoreTake(this->lock, portMAX_DELAY);
+    this->lastWrite = xTaskGetTickCount();
+    this->invalidateReadBuffers(sector, count);
+    uint32_t cached = this->writeToCache(data, sector, count);
+    data += cached * this->sectorSize;
+    sector += cached;
+    count -= cached;
+    // written around the cache from here, cached copies would be stale
+    this->sectorCache->remove(sector, count);
+    xSemaphoreGive(this->lock);
+
+    while(count > 0)
+    {
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        this->invalidateReadBuffers(sector, count);
+
+        if(this->openSlot >= 0)
+        {
+            auto& slot = this->writeSlots[this->openSlot];
+            if(slot.sector + slot.count == sector && slot.count < this->slotSectors)
+            {
+                uint32_t n = std::min(count, this->slotSectors - slot.count);
+                memcpy(slot.data + slot.count * this->sectorSize, data, n * this->sectorSize);
+                slot.count += n;
+
+                if(slot.count == this->slotSectors)
+                    this->closeOpenSlot();
+
+                xSemaphoreGive(this->lock);
+                data += n * this->sectorSize;
+                sector += n;
+                count -= n;
+                continue;
+            }
+
+            this->closeOpenSlot();
+        }
+        xSemaphoreGive(this->lock);
+
+        // blocks while all slots are written, that is the back pressure to the host
+        xSemaphoreTake(this->freeSlots, portMAX_DELAY);
+
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        for(int i = 0; i < USB_MSC_WRITE_SLOTS; i++)
+        {
+            auto& slot = this->writeSlots[i];
+            if(slot.state == MSC_SLOT_FREE)
+            {
+                slot.state = MSC_SLOT_OPEN;
+                slot.sector = sector;
+                slot.count = 0;
+                this->openSlot = i;
+                break;
+            }
+        }
+        xSemaphoreGive(this->lock);
+    }
+
+    return true;
+}
+
+// Writes everything acknowledged so far and syncs the card, e.g. when the host ejects or
+// before deep sleep.
+bool MSCPipeline::flush()
+{
+    return this->drain(true);
+}
+
+bool MSCPipeline::drain(bool writeCache)
+{
+    xSemaphoreTake(this->lock, portMAX_DELAY);
+    this->closeOpenSlot();
+    if(writeCache && !this->cacheFlushQueued)
+    {
+        this->cacheFlushQueued = true;
+        this->queueJob(MSC_JOB_CACHE_FLUSH, 0);
+    }
+    xSemaphoreGive(this->lock);
+
+    // jobs run in order, when the flush job is done all writes queued before are as well
+    xSemaphoreTake(this->flushDone, 0);
+    this->queueJob(MSC_JOB_FLUSH, 0);
+    xSemaphoreTake(this->flushDone, portMAX_DELAY);
+
+    return this->writeErrors == this->reportedWriteErrors;
+}
+
+void MSCPipeline::runJob(const MSCJob& job)
+{
+    if(job.type == MSC_JOB_READ)
+    {
+        auto& buffer = this->readBuffers[job.index];
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        uint32_t generation = buffer.generation;
+        uint32_t sector = buffer.sector;
+        uint32_t count = buffer.count;
+        xSemaphoreGive(this->lock);
+
+        bool ok = count > 0 && this->device->readSectors(buffer.data, sector, count);
+
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        buffer.valid = ok && buffer.generation == generation;
+        buffer.failed = !ok && buffer.generation == generation;
+        buffer.pending = false;
+        xSemaphoreGive(this->lock);
+        xSemaphoreGive(buffer.done);
+    }
+    else if(job.type == MSC_JOB_WRITE)
+    {
+        // slot content does not change while queued
+        auto& slot = this->writeSlots[job.index];
+        if(!this->device->writeSectors(slot.data, slot.sector, slot.count))
+            this->writeErrors++;
+
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        slot.state = MSC_SLOT_FREE;
+        xSemaphoreGive(this->lock);
+        xSemaphoreGive(this->freeSlots);
+    }
+    else if(job.type == MSC_JOB_CACHE_FLUSH)
+    {
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        this->cacheFlushQueued = false;
+        xSemaphoreGive(this->lock);
+        this->flushSectorCache();
+    }
+    else if(job.type == MSC_JOB_FLUSH)
+    {
+        this->device->sync();
+        xSemaphoreGive(this->flushDone);
+    }
+}
+
+void MSCPipeline::runWorkerTask()
+{
+    MSCJob job;
+    while(true)
+    {
+        if(xQueueReceive(this->jobs, &job, pdMS_TO_TICKS(USB_MSC_WRITE_IDLE_FLUSH_MILLIS)) == pdTRUE)
+        {
+            this->runJob(job);
+            continue;
+        }
+
+        // host is idle: do not keep acknowledged data in a partially filled slot
+        xSemaphoreTake(this->lock, portMAX_DELAY);
+        this->closeOpenSlot();
+        bool writeCache = this->sectorCache->getDirtyCount() > 0 &&
+            xTaskGetTickCount() - this->lastWrite >= pdMS_TO_TICKS(USB_MSC_SECTOR_CACHE_IDLE_FLUSH_MILLIS);
+        xSemaphoreGive(this->lock);
+
+        // the slot job queued just now runs first, the cache is written with the next timeout
+        if(writeCache && uxQueueMessagesWaiting(this->jobs) == 0)
+            this->flushSectorCache();
+    }
+}
+
+void MSCPipeline::logCacheStats()
+{
+    xSemaphoreTake(this->lock, portMAX_DELAY);
+    SectorCacheStats stats = this->sectorCache->getStats();
+    size_t dirty = this->sectorCache->getDirtyCount();
+    xSemaphoreGive(this->lock);
+
+    auto& last = this->lastReportedCacheStats;
+    uint32_t readHits = stats.readHits - last.readHits;
+    uint32_t reads = readHits + stats.readMisses - last.readMisses;
+    uint32_t writes = stats.writes - last.writes;
+    uint32_t writeHits = stats.writeHits - last.writeHits;
+    if(reads == 0 && writes == 0 && stats.flushedSectors == last.flushedSectors)
+        return;
+
+    Log::println("USBMSC", "Sector cache: read hits %u/%u (%u%%), rewrites %u/%u (%u%%), %u written to card, %u evicted, %u dirty",
+        readHits, reads, reads > 0 ? readHits * 100 / reads : 0,
+        writeHits, writes, writes > 0 ? writeHits * 100 / writes : 0,
+        stats.flushedSectors - last.flushedSectors, stats.evictions - last.evictions, dirty);
+
+    this->lastReportedCacheStats = stats;
+}
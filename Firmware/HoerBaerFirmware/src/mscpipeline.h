@@ -0,0 +1,106 @@
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include "config.h"
+#include "blockdevice.h"
+#include "sectorcache.h"
+
+using namespace std;
+
+#define MSC_READ_BUFFERS 2
+
+typedef enum {
+    MSC_JOB_READ,
+    MSC_JOB_WRITE,
+    MSC_JOB_CACHE_FLUSH,
+    MSC_JOB_FLUSH
+} MSCJobType;
+
+typedef struct {
+    MSCJobType type;
+    uint8_t index;
+} MSCJob;
+
+typedef struct {
+    uint8_t* data;
+    uint32_t sector;
+    uint32_t count;
+    uint32_t generation;    // bumped by overlapping writes, a running read is then discarded
+    bool valid;
+    bool failed;            // card read error, not set when the read was discarded
+    bool pending;
+    SemaphoreHandle_t done;
+} MSCReadBuffer;
+
+typedef enum {
+    MSC_SLOT_FREE,
+    MSC_SLOT_OPEN,          // filled by the USB callbacks, contiguous writes are appended
+    MSC_SLOT_QUEUED         // handed to the worker
+} MSCWriteSlotState;
+
+typedef struct {
+    uint8_t* data;
+    uint32_t sector;
+    uint32_t count;
+    MSCWriteSlotState state;
+} MSCWriteSlot;
+
+// Decouples the TinyUSB callbacks from the SD card: a worker task does all card I/O.
+// - Reads are served from two buffers (ping-pong). While the host gets one, the worker
+//   already reads the following sectors into the other.
+// - Writes are acknowledged as soon as they are copied into a write slot. Contiguous writes
+//   are collected into one slot, full slots are written by the worker with one multi block
+//   command. When all slots are busy, the callback blocks (back pressure).
+// - File system metadata (the FAT area in front of the first data cluster) and single sector
+//   writes (directory entries) go to a write-back sector cache instead. The host rewrites these
+//   sectors with every file, the cache absorbs the rewrites and writes the dirty sectors in
+//   runs: when it is filling up, after the host was idle for a while and on flush.
+// Reads overlapping queued writes wait until these are written, overlapping read buffers are
+// invalidated by writes. Cached sectors always take precedence over what is read from the card.
+class MSCPipeline {
+    private:
+        shared_ptr<BlockDevice> device;
+        size_t sectorSize;
+        uint32_t readSectors;
+        uint32_t slotSectors;
+        MSCReadBuffer readBuffers[MSC_READ_BUFFERS];
+        MSCWriteSlot writeSlots[USB_MSC_WRITE_SLOTS];
+        int openSlot;
+        uint32_t lastReadEnd;
+        uint32_t writeErrors;
+        uint32_t reportedWriteErrors;
+        unique_ptr<SectorCache> sectorCache;
+        uint8_t* cacheFlushBuffer;
+        bool cacheFlushQueued;
+        uint32_t metadataStart;
+        uint32_t metadataEnd;
+        TickType_t lastWrite;
+        SectorCacheStats lastReportedCacheStats;
+        SemaphoreHandle_t lock;
+        SemaphoreHandle_t freeSlots;
+        SemaphoreHandle_t flushDone;
+        QueueHandle_t jobs;
+        void queueJob(MSCJobType type, uint8_t index);
+        void closeOpenSlot();
+        void invalidateReadBuffers(uint32_t sector, uint32_t count);
+        bool overlapsQueuedWrites(uint32_t sector, uint32_t count);
+        int findReadBuffer(uint32_t sector);
+        void startPrefetch(int index, uint32_t sector);
+        void detectMetadataRegion();
+        bool isCacheable(uint32_t sector, uint32_t count);
+        uint32_t writeToCache(const uint8_t* data, uint32_t sector, uint32_t count);
+        void readFromCache(uint8_t* data, uint32_t sector, uint32_t count);
+        void flushSectorCache();
+        bool drain(bool writeCache);
+        void runJob(const MSCJob& job);
+    public:
+        MSCPipeline(shared_ptr<BlockDevice> device);
+        ~MSCPipeline();
+        void initialize();
+        bool read(uint8_t* buffer, uint32_t sector, uint32_t count);
+        bool write(const uint8_t* buffer, uint32_t sector, uint32_t count);
+        bool flush();
+        void logCacheStats();
+        void runWorkerTask();
+};
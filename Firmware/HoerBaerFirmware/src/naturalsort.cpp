@@ -0,0 +1,81 @@
+#include <cctype>
+#include <cstring>
+#include "naturalsort.h"
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+int NaturalSort::compare(const char* a, const char* b)
+{
+    const char* pa = a;
+    const char* pb = b;
+
+    while(*pa != '\0' && *pb != '\0')
+    {
+        if(isDigit(*pa) && isDigit(*pb))
+        {
+            // without leading zeros, the longer digit run is the larger number
+            while(*pa == '0' && isDigit(pa[1]))
+                pa++;
+            while(*pb == '0' && isDigit(pb[1]))
+                pb++;
+
+            const char* endA = pa;
+            const char* endB = pb;
+            while(isDigit(*endA))
+                endA++;
+            while(isDigit(*endB))
+                endB++;
+
+            if(endA - pa != endB - pb)
+                return endA - pa < endB - pb ? -1 : 1;
+
+            int result = strncmp(pa, pb, endA - pa);
+            if(result != 0)
+                return result < 0 ? -1 : 1;
+
+            pa = endA;
+            pb = endB;
+            continue;
+        }
+
+        int ca = tolower(static_cast<unsigned char>(*pa));
+        int cb = tolower(static_cast<unsigned char>(*pb));
+        if(ca != cb)
+            return ca < cb ? -1 : 1;
+
+        pa++;
+        pb++;
+    }
+
+    if(*pa != '\0' || *pb != '\0')
+        return *pa != '\0' ? 1 : -1;
+
+    int result = strcmp(a, b);
+    return result < 0 ? -1 : (result > 0 ? 1 : 0);
+}
+
+bool NaturalSort::less(const char* a, const char* b)
+{
+    return compare(a, b) < 0;
+}
+
+// Leading number of a position like "3/12" (ID3 TRCK, TPOS), 0 if there is none
+uint16_t NaturalSort::parseNumber(const std::string& value)
+{
+    size_t i = 0;
+    while(i < value.size() && value[i] == ' ')
+        i++;
+
+    uint32_t number = 0;
+    for(; i < value.size() && isDigit(value[i]); i++)
+    {
+        number = number * 10 + (value[i] - '0');
+        if(number > UINT16_MAX)
+            return UINT16_MAX;
+    }
+
+    return number;
+}
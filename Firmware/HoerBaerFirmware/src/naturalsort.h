@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Orders names the way people number files: "Kapitel 2" before "Kapitel 10".
+// Digit runs compare by value, letters ignore case, the rest compares bytewise. Names that
+// only differ in case or leading zeros are ordered bytewise, so the order is always total.
+class NaturalSort {
+    public:
+        static int compare(const char* a, const char* b);
+        static bool less(const char* a, const char* b);
+        static uint16_t parseNumber(const std::string& value);
+};
@@ -3,12 +3,14 @@
 #include "Adafruit_MAX1704X.h"
 #include "config.h"
 #include "power.h"
+#include "stateevents.h"
 
 using namespace std;
 
 Adafruit_MAX17048 fuelGauge;
 
-Power::Power(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema) 
+Power::Power(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus) 
+  : state(PowerState{ false, 0, 0 })
 {
   pinMode(GPIO_POWER_CHG_STAT, INPUT_PULLUP);
   pinMode(GPIO_POWER_3V3_NPSAVE, OUTPUT);
@@ -21,8 +23,10 @@ Power::Power(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema)
   digitalWrite(GPIO_POWER_HV_ENABLE, LOW);
 
   this->i2c = i2c;
-  this->i2cSema = i2cSema;
+  this->i2cBus = i2cBus;
   initialized = false;
+  pollQueued = false;
+  pollDone = false;
   batteryPresent = false;
   lastBatteryCheck = 0;
 }
@@ -81,22 +85,24 @@ void Power::initializeChargerAndGauge(bool batteryPresent)
     return;
   }
 
-  xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-  batteryPresent = fuelGauge.begin(this->i2c.get());
-  fuelGauge.sleep(false);
+  this->i2cBus->run(I2C_DEVICE_FUEL_GAUGE, I2C_PRIO_BACKGROUND, [&]() {
+    batteryPresent = fuelGauge.begin(this->i2c.get());
+    fuelGauge.sleep(false);
+  });
   this->initialized = true;
-  xSemaphoreGive(this->i2cSema);
 
   if(!batteryPresent) {
     Log::println("POWER", "No battery present. Skip initialization of fuel gauge.");
     return;
   }
 
-  xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-  auto chipId = fuelGauge.getChipID();
-  fuelGauge.getAlertVoltages(minV, maxV);
-  auto hyber = fuelGauge.getHibernationThreshold();
-  xSemaphoreGive(this->i2cSema);
+  uint16_t chipId;
+  float hyber;
+  this->i2cBus->run(I2C_DEVICE_FUEL_GAUGE, I2C_PRIO_BACKGROUND, [&]() {
+    chipId = fuelGauge.getChipID();
+    fuelGauge.getAlertVoltages(minV, maxV);
+    hyber = fuelGauge.getHibernationThreshold();
+  });
 
   Log::println("POWER", "Fuel gauge initialized, chip ID: 0x%x, minV: %f, maxV %f, hybernation: %f", chipId, minV, maxV, hyber);
 }
@@ -109,9 +115,19 @@ void Power::setGaugeToSleep()
   }
   
   Log::println("POWER", "Set fuel gauge to sleep");
-  xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-  fuelGauge.sleep(true);
-  xSemaphoreGive(this->i2cSema);
+  this->i2cBus->run(I2C_DEVICE_FUEL_GAUGE, I2C_PRIO_BACKGROUND, []() {
+    fuelGauge.sleep(true);
+  });
+}
+
+void Power::readGauge()
+{
+  PowerState state;
+  state.voltage = fuelGauge.cellVoltage();
+  state.percentage = fuelGauge.cellPercent();
+  state.charging = isCharging();
+  this->state.write(state);
+  StateEvents::publish(STATE_EVENT_POWER);
 }
 
 void Power::updateState() 
@@ -121,12 +137,17 @@ void Power::updateState()
     return;
   }
   
-  xSemaphoreTake(this->i2cSema, portMAX_DELAY);
-  state.voltage = fuelGauge.cellVoltage();
-  state.percentage = fuelGauge.cellPercent();
-  xSemaphoreGive(this->i2cSema);
+  this->i2cBus->run(I2C_DEVICE_FUEL_GAUGE, I2C_PRIO_BACKGROUND, [this]() { this->readGauge(); });
+}
 
-  state.charging = isCharging();
+// Polls the gauge without waiting, the loop checks the result with its next call
+void Power::queueStatePoll()
+{
+  bool queued = this->i2cBus->submit(I2C_DEVICE_FUEL_GAUGE, I2C_PRIO_BACKGROUND, [this]() { this->readGauge(); }, [this]() {
+    this->pollDone = true;
+  });
+
+  this->pollQueued = queued;
 }
 
 bool Power::checkBatteryShutdownLoop() 
@@ -134,15 +155,31 @@ bool Power::checkBatteryShutdownLoop()
   if(!batteryPresent)
     return false;
 
+  if(pollQueued)
+  {
+    if(!pollDone)
+      return false;
+
+    pollQueued = false;
+    pollDone = false;
+    return isBatteryEmpty();
+  }
+
   auto tickCount = xTaskGetTickCount();
   if(tickCount - lastBatteryCheck < pdMS_TO_TICKS(POWER_BATTERY_CHECK_INTERVAL_MILLIS))
     return false;
 
   lastBatteryCheck = tickCount;
-  return checkBatteryShutdown();
+  if(!initialized)
+    return false;
+
+  queueStatePoll();
+  return false;
 }
 
-PowerState& Power::getState() {
+PowerState Power::getState() {
+  PowerState state;
+  this->state.read(state);
   return state;
 }
 
@@ -152,6 +189,12 @@ bool Power::checkBatteryShutdown()
     return false;
 
   updateState();
+  return isBatteryEmpty();
+}
+
+bool Power::isBatteryEmpty()
+{
+  PowerState state = getState();
   Log::println("POWER", "Battery: %.2fV (%.1f percent), charging: %i", state.voltage, state.percentage, state.charging);
 
   if(state.charging)
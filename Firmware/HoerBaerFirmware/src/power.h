@@ -2,6 +2,8 @@
 
 #include <memory>
 #include <Wire.h>
+#include "i2cbus.h"
+#include "seqlock.h"
 
 using namespace std;
 
@@ -14,14 +16,19 @@ typedef struct {
 class Power {
     private:
         shared_ptr<TwoWire> i2c;
-        SemaphoreHandle_t i2cSema;
-        PowerState state;
+        shared_ptr<I2CBus> i2cBus;
+        SeqLock<PowerState> state;  // written on the I2C bus task, read by BLE and the loop
         TickType_t lastBatteryCheck;
         bool isCharging();
+        bool isBatteryEmpty();
+        void readGauge();
+        void queueStatePoll();
         bool initialized;
         bool batteryPresent;
+        bool pollQueued;
+        volatile bool pollDone;     // set on the I2C bus task
     public:
-        Power(shared_ptr<TwoWire> i2c, SemaphoreHandle_t i2cSema);
+        Power(shared_ptr<TwoWire> i2c, shared_ptr<I2CBus> i2cBus);
         void disableVCCPowerSave();
         void enableVCCPowerSave();
         void enableAudioVoltage();
@@ -31,5 +38,5 @@ class Power {
         void updateState();
         bool checkBatteryShutdown();
         bool checkBatteryShutdownLoop();
-        PowerState& getState();
+        PowerState getState();
 };
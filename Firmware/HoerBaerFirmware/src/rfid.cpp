@@ -1,11 +1,12 @@
 #include "rfid.h"
 
 #include <algorithm>
-#include <cstdio>
 #include <string_view>
 #include <utility>
 
 #include "log.h"
+#include "uidparser.h"
+#include "latencytrace.h"
 
 namespace {
 constexpr size_t RFID_UID_BUFFER_LENGTH = 32;
@@ -108,6 +109,7 @@ void RFID::processTag() {
         return;
     }
 
+    int64_t detectedUs = esp_timer_get_time();
     if (!_reader->PICC_ReadCardSerial()) {
         return;
     }
@@ -119,19 +121,10 @@ void RFID::processTag() {
     }
 
     rememberUid(_reader->uid);
+    LatencyTrace::begin(LATENCY_SOURCE_RFID, detectedUs);
 
     char uidBuffer[RFID_UID_BUFFER_LENGTH] = {0};
-    size_t offset = 0;
-    for (uint8_t i = 0; i < _reader->uid.size && offset < sizeof(uidBuffer); ++i) {
-        int written = std::snprintf(uidBuffer + offset, sizeof(uidBuffer) - offset, "%02X", _reader->uid.uidByte[i]);
-        if (written < 0) {
-            break;
-        }
-        offset += static_cast<size_t>(written);
-        if (i + 1 < _reader->uid.size && offset < sizeof(uidBuffer) - 1) {
-            uidBuffer[offset++] = ':';
-        }
-    }
+    UIDParser::format(_reader->uid.uidByte, _reader->uid.size, uidBuffer, sizeof(uidBuffer));
 
     Log::println("RFID", "Tag UID %s", uidBuffer);
 
@@ -185,8 +178,8 @@ void RFID::handleMappedTag(const MFRC522::Uid& uid, const char* uidString) {
     }
 
     Log::println("RFID", "Mapped UID %s -> %s", uidString ? uidString : "<unknown>", it->filePath.c_str());
-    std::string_view pathView(it->filePath.data(), it->filePath.size());
-    if (!_audioPlayer->playFileByPath(pathView)) {
+    LatencyTrace::mark(LATENCY_STAGE_INPUT);
+    if (!_audioPlayer->playRfidMapping(*it)) {
         Log::println("RFID", "Failed to play mapped file %s", it->filePath.c_str());
     }
 }
@@ -0,0 +1,166 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstdarg>
+#include "log.h"
+#include "config.h"
+#include "sdbenchmark.h"
+
+static const int benchmarkFrequencies[] = SD_BENCHMARK_FREQUENCIES_KHZ;
+static const uint32_t benchmarkBlockSizes[] = SD_BENCHMARK_BLOCK_SIZES;
+
+static const char* testNames[] = { "seq_write", "seq_read", "rand_read", "rand_write" };
+
+SDBenchmark::SDBenchmark(shared_ptr<SDCard> sdCard)
+{
+    this->sdCard = sdCard;
+    this->randomState = 0;
+
+    // internal DMA memory, so the driver transfers blocks directly (as the audio player reads)
+    uint32_t maxBlockSize = *std::max_element(std::begin(benchmarkBlockSizes), std::end(benchmarkBlockSizes));
+    this->buffer = static_cast<uint8_t*>(heap_caps_malloc(maxBlockSize, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL));
+    if(this->buffer == nullptr)
+        throw std::bad_alloc();
+
+    for(uint32_t i = 0; i < maxBlockSize; i++)
+        this->buffer[i] = i & 0xFF;
+}
+
+SDBenchmark::~SDBenchmark()
+{
+    heap_caps_free(this->buffer);
+}
+
+// xorshift with a fixed seed per test: every card sees the same access pattern
+uint32_t SDBenchmark::nextRandom()
+{
+    this->randomState ^= this->randomState << 13;
+    this->randomState ^= this->randomState >> 17;
+    this->randomState ^= this->randomState << 5;
+    return this->randomState;
+}
+
+void SDBenchmark::addReportLine(const char* format, ...)
+{
+    char line[160];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    Log::println("SDBENCH", "%s", line);
+    this->report += line;
+    this->report += "\n";
+}
+
+void SDBenchmark::run()
+{
+    bool defaultMode1bit = this->sdCard->getMode1bit();
+    int defaultFrequency = this->sdCard->getFrequencyKhz();
+    auto& fs = this->sdCard->getFs();
+
+    this->report.clear();
+    this->addReportLine("# HoerBaer SD benchmark: card type %d, %llu MB, test file %u KB, %u random operations",
+        fs.cardType(), fs.cardSize() / (1024 * 1024), SD_BENCHMARK_FILE_SIZE / 1024, SD_BENCHMARK_RANDOM_OPERATIONS);
+    this->addReportLine("# bus clock_khz test block_bytes operations mb_per_s p50_us p90_us p99_us max_us");
+
+#ifdef SD_MODE_SDMMC
+    const bool busWidths[] = { true, false };
+#else
+    const bool busWidths[] = { true };
+#endif
+
+    for(bool mode1bit : busWidths)
+    {
+        for(int frequencyKhz : benchmarkFrequencies)
+        {
+            try
+            {
+                this->sdCard->remount(mode1bit, frequencyKhz);
+                this->runConfiguration(mode1bit, frequencyKhz);
+            }
+            catch(const std::exception& e)
+            {
+                this->addReportLine("%s %d failed: %s", mode1bit ? "1bit" : "4bit", frequencyKhz, e.what());
+            }
+        }
+    }
+
+    this->sdCard->remount(defaultMode1bit, defaultFrequency);
+    this->sdCard->removeFile(SDCARD_FILE_BENCHMARK_TEST);
+    this->sdCard->writeTextFile(SDCARD_FILE_BENCHMARK_RESULTS, this->report.c_str());
+}
+
+void SDBenchmark::runConfiguration(bool mode1bit, int frequencyKhz)
+{
+    // the sequential write (re)creates the test file the other tests work on
+    static const SDBenchmarkTest tests[] = {
+        SD_BENCHMARK_SEQUENTIAL_WRITE,
+        SD_BENCHMARK_SEQUENTIAL_READ,
+        SD_BENCHMARK_RANDOM_READ,
+        SD_BENCHMARK_RANDOM_WRITE
+    };
+
+    for(auto test : tests)
+    {
+        for(uint32_t blockSize : benchmarkBlockSizes)
+            this->runTest(test, mode1bit, frequencyKhz, blockSize);
+    }
+}
+
+void SDBenchmark::runTest(SDBenchmarkTest test, bool mode1bit, int frequencyKhz, uint32_t blockSize)
+{
+    bool write = test == SD_BENCHMARK_SEQUENTIAL_WRITE || test == SD_BENCHMARK_RANDOM_WRITE;
+    bool random = test == SD_BENCHMARK_RANDOM_READ || test == SD_BENCHMARK_RANDOM_WRITE;
+    uint32_t blocks = SD_BENCHMARK_FILE_SIZE / blockSize;
+    uint32_t operations = random ? SD_BENCHMARK_RANDOM_OPERATIONS : blocks;
+
+    const char* mode = FILE_READ;
+    if(test == SD_BENCHMARK_SEQUENTIAL_WRITE)
+        mode = FILE_WRITE;
+    else if(test == SD_BENCHMARK_RANDOM_WRITE)
+        mode = "r+";
+
+    File file = this->sdCard->getFs().open(SDCARD_FILE_BENCHMARK_TEST, mode);
+    if(!file)
+        throw std::runtime_error("Failed to open test file");
+
+    this->latencies.clear();
+    this->latencies.reserve(operations);
+    this->randomState = 0x48425344; // "HBSD"
+
+    int64_t start = esp_timer_get_time();
+    for(uint32_t i = 0; i < operations; i++)
+    {
+        int64_t operationStart = esp_timer_get_time();
+
+        if(random && !file.seek((this->nextRandom() % blocks) * blockSize))
+            break;
+
+        size_t transferred = write ? file.write(this->buffer, blockSize) : file.read(this->buffer, blockSize);
+        if(transferred != blockSize)
+            break;
+
+        this->latencies.push_back(esp_timer_get_time() - operationStart);
+    }
+
+    // written data counts once it is on the card
+    if(write)
+        file.flush();
+    file.close();
+    if(write)
+        this->sdCard->invalidateDirectory(SDCARD_FILE_BENCHMARK_TEST);
+    int64_t micros = esp_timer_get_time() - start;
+
+    if(this->latencies.size() != operations)
+        throw std::runtime_error("Transfer failed");
+
+    std::sort(this->latencies.begin(), this->latencies.end());
+    auto percentile = [this](uint32_t p) { return this->latencies[(this->latencies.size() - 1) * p / 100]; };
+
+    // bytes per microsecond equals MB/s
+    this->addReportLine("%s %d %s %u %u %.2f %u %u %u %u",
+        mode1bit ? "1bit" : "4bit", frequencyKhz, testNames[test], blockSize, operations,
+        micros > 0 ? (double)operations * blockSize / micros : 0.0,
+        percentile(50), percentile(90), percentile(99), this->latencies.back());
+}
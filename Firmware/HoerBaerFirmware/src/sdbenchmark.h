@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "sdcard.h"
+#include "userconfig.h"
+
+using namespace std;
+
+typedef enum {
+    SD_BENCHMARK_SEQUENTIAL_WRITE,
+    SD_BENCHMARK_SEQUENTIAL_READ,
+    SD_BENCHMARK_RANDOM_READ,
+    SD_BENCHMARK_RANDOM_WRITE
+} SDBenchmarkTest;
+
+// Measures what a card delivers through the file system: sequential and random reads and
+// writes of a test file for every block size, with every bus width and clock. Results
+// (throughput and latency percentiles per operation) are logged and written to the card.
+// Used to qualify SD card models, the card is mounted with the default settings afterwards.
+class SDBenchmark {
+    private:
+        shared_ptr<SDCard> sdCard;
+        uint8_t* buffer;
+        std::vector<uint32_t, PsramAllocator<uint32_t>> latencies;
+        std::string report;
+        uint32_t randomState;
+        uint32_t nextRandom();
+        void runConfiguration(bool mode1bit, int frequencyKhz);
+        void runTest(SDBenchmarkTest test, bool mode1bit, int frequencyKhz, uint32_t blockSize);
+        void addReportLine(const char* format, ...);
+    public:
+        SDBenchmark(shared_ptr<SDCard> sdCard);
+        ~SDBenchmark();
+        SDBenchmark(const SDBenchmark&) = delete;
+        SDBenchmark& operator=(const SDBenchmark&) = delete;
+        void run();
+};
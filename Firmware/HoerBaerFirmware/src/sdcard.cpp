@@ -3,6 +3,11 @@
 #include "SD.h"
 #include "SD_MMC.h"
 #include "config.h"
+#include "diskio.h"
+#include "diskio_impl.h"
+
+#include "ff.h"
+#include "directorylisting.h"
 
 #include "sdcard.h"
 
@@ -13,12 +18,41 @@
     SPIClass sdSpi;
 #endif
 
+static std::string normalizeDirectory(const std::string& path)
+{
+    if (path.size() > 1 && path.back() == '/')
+        return path.substr(0, path.size() - 1);
+
+    return path.empty() ? "/" : path;
+}
+
+// FAT stores local time without a zone. It is converted as if it was UTC, independent of
+// the TZ that WLAN sets later on, so a file keeps its last write across boots.
+static uint32_t fatTimeToUnix(uint16_t fdate, uint16_t ftime)
+{
+    int year = (fdate >> 9) + 1980;
+    int month = (fdate >> 5) & 0x0F;
+    int day = fdate & 0x1F;
+
+    // days since 1970-01-01 of the proleptic Gregorian calendar, years start in March
+    int y = year - (month <= 2 ? 1 : 0);
+    int era = y / 400;
+    int yearOfEra = y - era * 400;
+    int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    uint32_t days = era * 146097 + dayOfEra - 719468;
+
+    return days * 86400 + (ftime >> 11) * 3600 + ((ftime >> 5) & 0x3F) * 60 + (ftime & 0x1F) * 2;
+}
+
 SDCard::SDCard()
 {
     #ifdef SD_MODE_SDMMC
         SD_MMC.setPins(GPIO_SD_CLK, GPIO_SD_CMD, GPIO_SD_D0, GPIO_SD_D1, GPIO_SD_D2, GPIO_SD_D3);
+        this->frequencyKhz = SDMMC_FREQ;
     #else
         sdSpi.begin(GPIO_SD_SCK, GPIO_SD_DO, GPIO_SD_DI, -1);
+        this->frequencyKhz = SD_SPI_FREQ;
     #endif
 
     pinMode(GPIO_SD_DETECT, INPUT);
@@ -47,10 +81,10 @@ void SDCard::mountOrThrow()
     uint8_t cardType = CARD_NONE;
 
 #ifdef SD_MODE_SDMMC
-    if (!SD_MMC.begin("/sdcard", false, false, SDMMC_FREQ))
+    if (!SD_MMC.begin("/sdcard", this->mode1bit, false, this->frequencyKhz))
         throw std::runtime_error("Failed to mount SD card");
 #else
-    if (!SD.begin(GPIO_SD_CS, sdSpi))
+    if (!SD.begin(GPIO_SD_CS, sdSpi, this->frequencyKhz * 1000))
         throw std::runtime_error("Failed to mount SD card");
 #endif
 
@@ -59,6 +93,14 @@ void SDCard::mountOrThrow()
     if (cardType == CARD_NONE)
         throw std::runtime_error("SD card not present (but should be according to the detect-pin)");
 
+    // FatFs drive of the card for directory reads and raw block access
+    this->diskDrive = this->findCardDrive();
+    if (this->diskDrive == 0xFF)
+    {
+        SDLIB.end();
+        throw std::runtime_error("FatFs drive of the SD card not found");
+    }
+
     if (cardType == CARD_MMC)
         Log::println("SDCARD", "Mounted SD card (type MMC)");
     else if (cardType == CARD_SD)
@@ -68,138 +110,153 @@ void SDCard::mountOrThrow()
     else
         Log::println("SDCARD", "Mounted SD card (type UNKNOWN)");
 
+    Log::println("SDCARD", "Bus: %s, %d kHz", this->mode1bit ? "1-bit" : "4-bit", this->frequencyKhz);
     this->cardMounted = true;
 }
 
-void SDCard::listFiles(std::function<void(const std::string&)> fileCallback)
+// The mount registers the card at a FatFs drive of its choice: the drive with a mounted volume
+// whose disk has the sector count of the card
+uint8_t SDCard::findCardDrive()
 {
-    this->listFiles("/", fileCallback);
-}
-
-void SDCard::listFiles(const std::string& path, std::function<void(const std::string&)> fileCallback)
-{
-    this->mountOrThrow();
-
-    File root = SDLIB.open(path.c_str());
-
-    if (!root)
+    LBA_t cardSectors = SDLIB.numSectors();
+    for (uint8_t pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
     {
-        Log::println("SDCARD", "Failed to open directory: %s", path.c_str());
-        return;
-    }
+        char drive[4];
+        snprintf(drive, sizeof(drive), "%u:", pdrv);
 
-    if (!root.isDirectory())
-    {
-        Log::println("SDCARD", "Failed to list: %s is not a directory!", path.c_str());
-        return;
-    }
-
-    File file = root.openNextFile();
-    while (file)
-    {
-        if (file.name()[0] == '.')
-        {
-            file = root.openNextFile();
+        // fails without touching the disk if no volume is mounted at the drive
+        FF_DIR dir;
+        if (f_opendir(&dir, drive) != FR_OK)
             continue;
-        }
+        f_closedir(&dir);
 
-        std::string fullPath = path;
+        LBA_t sectors = 0;
+        if (ff_disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectors) == RES_OK && sectors == cardSectors)
+            return pdrv;
+    }
 
-        if (fullPath.back() != '/')
-            fullPath += "/";
-        
-        fullPath += file.name();
-        
-        if (!file.isDirectory())
-            fileCallback(fullPath);
-        else
-            listFiles(fullPath, fileCallback); // Recursive call for subdirectories
+    return 0xFF;
+}
 
-        file = root.openNextFile();
+// Mounts the card again with another bus width (SDMMC only, SPI is always 1-bit) and clock,
+// all open files become invalid. Used by the SD benchmark.
+void SDCard::remount(bool mode1bit, int frequencyKhz)
+{
+    if (this->cardMounted)
+    {
+        SDLIB.end();
+        this->cardMounted = false;
     }
 
-    root.close();
+    this->mode1bit = mode1bit;
+    this->frequencyKhz = frequencyKhz;
+    this->clearDirectoryCache(); // the drive number may change
+    this->mountOrThrow();
 }
 
-std::string SDCard::nextFile(std::string dir, int skip)
+void SDCard::listFiles(SDFileCallback fileCallback)
 {
-    this->mountOrThrow();
+    this->listFiles("/", fileCallback);
+}
 
-    File root = SDLIB.open(dir.c_str());
+// Files of a directory sorted by name, then its subdirectories (recursive)
+void SDCard::listFiles(const std::string& path, SDFileCallback fileCallback)
+{
+    auto listing = this->getDirectoryListing(path);
+    if (listing == nullptr)
+        return;
 
-    if (!root)
-    {
-        Log::println("SDCARD", "Failed to open directory %s!", dir.c_str());
-        return "";
-    }
+    std::string fullPath = path;
+    if (fullPath.back() != '/')
+        fullPath += "/";
+    size_t dirLength = fullPath.size();
 
-    if (!root.isDirectory())
+    for (size_t i = 0; i < listing->getFileCount(); i++)
     {
-        Log::println("SDCARD", "Failed to list %s: not a directory!", dir.c_str());
-        return "";
+        fullPath.resize(dirLength);
+        fullPath += listing->getFileName(i);
+        fileCallback(fullPath, listing->getFileSize(i), listing->getFileLastWrite(i));
     }
 
-    File file = root.openNextFile();
-    while (file)
+    for (size_t i = 0; i < listing->getDirectoryCount(); i++)
     {
-        if (file.isDirectory() || file.name()[0] == '.')
-        {
-            file = root.openNextFile();
-            continue;
-        }
-
-        if(skip > 0)
-        {
-            skip--;
-            file = root.openNextFile();
-            continue;
-        }
-
-        auto path = file.path();
-        root.close();
-        return path;
+        fullPath.resize(dirLength);
+        fullPath += listing->getDirectoryName(i);
+        listFiles(fullPath, fileCallback); // Recursive call for subdirectories
     }
-
-    root.close();
-    return "";
 }
 
-int SDCard::countFiles(std::string dir)
+// Listing of a directory, read from the card on first use only
+std::shared_ptr<const DirectoryListing> SDCard::getDirectoryListing(const std::string& path)
 {
-    Serial.println("COUNTING FILES IN: " + String(dir.c_str()));
     this->mountOrThrow();
 
-    File root = SDLIB.open(dir.c_str());
+    std::string key = normalizeDirectory(path);
+    {
+        std::lock_guard<std::mutex> guard(this->directoryCacheMutex);
+        auto it = this->directoryCache.find(key);
+        if (it != this->directoryCache.end())
+            return it->second;
+    }
 
-    if (!root)
+    auto listing = this->readDirectory(key);
+    if (listing != nullptr)
     {
-        Log::println("SDCARD", "Failed to open directory %s!", dir.c_str());
-        return 0;
+        std::lock_guard<std::mutex> guard(this->directoryCacheMutex);
+        this->directoryCache[key] = listing;
     }
 
-    if (!root.isDirectory())
+    return listing;
+}
+
+// Enumerates the directory with the FatFs API directly: one readdir per entry, no file
+// object (and no open/stat) per entry as with openNextFile.
+std::shared_ptr<const DirectoryListing> SDCard::readDirectory(const std::string& path)
+{
+    char fatPath[FF_MAX_LFN + 8];
+    snprintf(fatPath, sizeof(fatPath), "%u:%s", this->diskDrive, path.c_str());
+
+    FF_DIR dir;
+    if (f_opendir(&dir, fatPath) != FR_OK)
     {
-        Log::println("SDCARD", "Failed to list %s: not a directory!", dir.c_str());
-        root.close();
-        return 0;
+        Log::println("SDCARD", "Failed to open directory: %s", path.c_str());
+        return nullptr;
     }
 
-    int count = 0;
-    File file = root.openNextFile();
-    while (file)
+    auto listing = std::make_shared<DirectoryListing>();
+    FILINFO info;
+    while (f_readdir(&dir, &info) == FR_OK && info.fname[0] != 0)
     {
-        if (file.isDirectory() || file.name()[0] == '.')
-        {
-            file = root.openNextFile();
+        if (info.fname[0] == '.')
             continue;
-        }
 
-        count++;
-        file = root.openNextFile();
+        if (info.fattrib & AM_DIR)
+            listing->addDirectory(info.fname);
+        else
+            listing->addFile(info.fname, info.fsize, fatTimeToUnix(info.fdate, info.ftime));
     }
 
-    root.close();
-    return count;
+    f_closedir(&dir);
+    listing->sort();
+    return listing;
+}
+
+// Drops the cached listing of the directory containing the file
+// Has to be called when a file is created, removed or changes its size through getFs()
+void SDCard::invalidateDirectory(const std::string& filename)
+{
+    size_t slash = filename.find_last_of('/');
+    std::string dir = slash == std::string::npos || slash == 0 ? "/" : filename.substr(0, slash);
+
+    std::lock_guard<std::mutex> guard(this->directoryCacheMutex);
+    this->directoryCache.erase(dir);
+}
+
+// Has to be called when files are changed without the SDCard methods
+void SDCard::clearDirectoryCache()
+{
+    std::lock_guard<std::mutex> guard(this->directoryCacheMutex);
+    this->directoryCache.clear();
 }
 
 bool SDCard::fileExists(const std::string filename) 
@@ -208,10 +265,18 @@ bool SDCard::fileExists(const std::string filename)
     return SDLIB.exists(filename.c_str());
 }
 
+bool SDCard::removeFile(const std::string filename) 
+{
+    this->mountOrThrow();
+    this->invalidateDirectory(filename);
+    return SDLIB.remove(filename.c_str());
+}
+
 void SDCard::writeJsonFile(const std::string filename, JsonDocument& jsonDocument)
 {
     this->mountOrThrow();
 
+    this->invalidateDirectory(filename);
     File file = SDLIB.open(filename.c_str(), FILE_WRITE);
     if (!file)
         throw std::runtime_error("Failed to create file");
@@ -226,6 +291,7 @@ void SDCard::writeTextFile(const std::string filename, const char* text)
 {
     this->mountOrThrow();
 
+    this->invalidateDirectory(filename);
     File file = SDLIB.open(filename.c_str(), FILE_WRITE);
     if (!file)
         throw std::runtime_error("Failed to create file");
@@ -266,6 +332,21 @@ size_t SDCard::getFileSize(const std::string filename)
     return size;
 }
 
+time_t SDCard::getLastWrite(const std::string filename)
+{
+    this->mountOrThrow();
+
+    // read with FatFs like the directory listings, the VFS converts with the current TZ
+    char fatPath[FF_MAX_LFN + 8];
+    snprintf(fatPath, sizeof(fatPath), "%u:%s", this->diskDrive, filename.c_str());
+
+    FILINFO info;
+    if (f_stat(fatPath, &info) != FR_OK)
+        throw std::runtime_error("Failed to open file");
+
+    return fatTimeToUnix(info.fdate, info.ftime);
+}
+
 size_t SDCard::getSectorCount()
 {
     this->mountOrThrow();
@@ -277,3 +358,19 @@ size_t SDCard::getSectorSize()
     this->mountOrThrow();
     return SDLIB.sectorSize();
 }
+
+uint8_t SDCard::getDiskDrive()
+{
+    this->mountOrThrow();
+    return this->diskDrive;
+}
+
+bool SDCard::getMode1bit()
+{
+    return this->mode1bit;
+}
+
+int SDCard::getFrequencyKhz()
+{
+    return this->frequencyKhz;
+}
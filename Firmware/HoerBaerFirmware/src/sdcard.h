@@ -1,8 +1,16 @@
 #pragma once
 
 #include <ArduinoJson.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
-#ifdef SD_MODE_SDMMC
+#if defined(NATIVE_BUILD)
+#include <functional>
+#include "fakefs.h"
+#define FSTYPE fs::FakeFS
+#elif defined(SD_MODE_SDMMC)
 #include <SD_MMC.h>
 #define FSTYPE fs::SDMMCFS
 #else 
@@ -10,23 +18,42 @@
 #define FSTYPE fs::SDFS
 #endif
 
+class DirectoryListing;
+
+// path, size in bytes and last write (unix time) of a listed file
+using SDFileCallback = std::function<void(const std::string&, size_t, time_t)>;
+
 class SDCard {
     private:
         bool cardMounted = false;
+        bool mode1bit = false;
+        int frequencyKhz;
+        uint8_t diskDrive = 0xFF;
+        std::unordered_map<std::string, std::shared_ptr<const DirectoryListing>> directoryCache;
+        std::mutex directoryCacheMutex;
         void mountOrThrow();
+        uint8_t findCardDrive();
+        std::shared_ptr<const DirectoryListing> readDirectory(const std::string& path);
     public:
         SDCard();
         FSTYPE& getFs();
         bool cardPresent();
         bool fileExists(const std::string filename);
+        bool removeFile(const std::string filename);
         void writeJsonFile(const std::string filename, JsonDocument& jsonDocument);
         void writeTextFile(const std::string filename, const char* text);
-        void listFiles(std::function<void(const std::string&)> fileCallback);
-        void listFiles(const std::string& path, std::function<void(const std::string&)> fileCallback);
-        std::string nextFile(std::string dir, int skip);
-        int countFiles(std::string dir);
+        void listFiles(SDFileCallback fileCallback);
+        void listFiles(const std::string& path, SDFileCallback fileCallback);
+        std::shared_ptr<const DirectoryListing> getDirectoryListing(const std::string& path);
+        void invalidateDirectory(const std::string& filename);
+        void clearDirectoryCache();
         void readParseJsonFile(const std::string filename, JsonDocument& targetJsonDocument);
         size_t getFileSize(const std::string filename);
+        time_t getLastWrite(const std::string filename);
         size_t getSectorCount();
         size_t getSectorSize();
+        uint8_t getDiskDrive();
+        void remount(bool mode1bit, int frequencyKhz);
+        bool getMode1bit();
+        int getFrequencyKhz();
 };
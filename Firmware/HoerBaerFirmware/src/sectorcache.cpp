@@ -0,0 +1,214 @@
+#include <cstring>
+#include "sectorcache.h"
+
+SectorCache::SectorCache(size_t capacity, size_t sectorSize)
+{
+    this->capacity = capacity;
+    this->sectorSize = sectorSize;
+    this->useCounter = 0;
+    this->dirtyCount = 0;
+    this->stats = {};
+
+    this->data = static_cast<uint8_t*>(heap_caps_malloc(capacity * sectorSize, MALLOC_CAP_SPIRAM));
+    if(this->data == nullptr)
+        throw std::bad_alloc();
+
+    this->entries.resize(capacity, SectorCacheEntry{ 0, 0, false, false, false });
+    this->index.reserve(capacity);
+}
+
+SectorCache::~SectorCache()
+{
+    heap_caps_free(this->data);
+}
+
+// unused entries first, then the least recently used clean one
+int SectorCache::findVictim()
+{
+    int victim = -1;
+    for(size_t i = 0; i < this->capacity; i++)
+    {
+        auto& entry = this->entries[i];
+        if(!entry.used)
+            return i;
+
+        if(!entry.dirty && (victim < 0 || entry.lastUse < this->entries[victim].lastUse))
+            victim = i;
+    }
+
+    return victim;
+}
+
+const uint8_t* SectorCache::lookup(uint32_t sector)
+{
+    auto it = this->index.find(sector);
+    if(it == this->index.end())
+        return nullptr;
+
+    this->entries[it->second].lastUse = ++this->useCounter;
+    return this->data + it->second * this->sectorSize;
+}
+
+bool SectorCache::containsAll(uint32_t sector, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(this->index.find(sector + i) == this->index.end())
+            return false;
+    }
+
+    return true;
+}
+
+// A clean put never overwrites a cached (possibly dirty) sector, the cache is newer than the card.
+bool SectorCache::put(uint32_t sector, const uint8_t* sectorData, bool dirty)
+{
+    int slot;
+    auto it = this->index.find(sector);
+    if(it != this->index.end())
+    {
+        slot = it->second;
+        if(!dirty)
+            return true;
+
+        if(this->entries[slot].dirty)
+            this->stats.writeHits++;
+    }
+    else
+    {
+        slot = this->findVictim();
+        if(slot < 0)
+            return false;
+
+        auto& victim = this->entries[slot];
+        if(victim.used)
+        {
+            this->index.erase(victim.sector);
+            this->stats.evictions++;
+        }
+
+        victim.sector = sector;
+        victim.used = true;
+        victim.dirty = false;
+        victim.flushing = false;
+        this->index[sector] = slot;
+    }
+
+    auto& entry = this->entries[slot];
+    memcpy(this->data + slot * this->sectorSize, sectorData, this->sectorSize);
+    entry.lastUse = ++this->useCounter;
+
+    if(dirty)
+    {
+        this->stats.writes++;
+        if(!entry.dirty)
+            this->dirtyCount++;
+        entry.dirty = true;
+        entry.flushing = false; // the data being written is outdated already
+    }
+
+    return true;
+}
+
+// Drops sectors that are written around the cache, so that the cache never returns stale data.
+void SectorCache::remove(uint32_t sector, uint32_t count)
+{
+    if(this->index.empty())
+        return;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        auto it = this->index.find(sector + i);
+        if(it == this->index.end())
+            continue;
+
+        auto& entry = this->entries[it->second];
+        if(entry.dirty)
+            this->dirtyCount--;
+        entry.used = false;
+        entry.dirty = false;
+        entry.flushing = false;
+        this->index.erase(it);
+    }
+}
+
+size_t SectorCache::getCapacity()
+{
+    return this->capacity;
+}
+
+size_t SectorCache::getDirtyCount()
+{
+    return this->dirtyCount;
+}
+
+// Copies the lowest run of consecutive dirty sectors (at most maxSectors) into the buffer, so
+// they can be written with one multi block command. Returns the count. The sectors stay dirty
+// until finishFlush() is told the write succeeded.
+size_t SectorCache::collectDirtyRun(uint32_t& firstSector, uint8_t* buffer, size_t maxSectors)
+{
+    if(this->dirtyCount == 0)
+        return 0;
+
+    int first = -1;
+    for(size_t i = 0; i < this->capacity; i++)
+    {
+        auto& entry = this->entries[i];
+        if(entry.dirty && !entry.flushing && (first < 0 || entry.sector < this->entries[first].sector))
+            first = i;
+    }
+
+    if(first < 0)
+        return 0;
+
+    firstSector = this->entries[first].sector;
+    size_t count = 0;
+    while(count < maxSectors)
+    {
+        auto it = this->index.find(firstSector + count);
+        if(it == this->index.end() || !this->entries[it->second].dirty || this->entries[it->second].flushing)
+            break;
+
+        memcpy(buffer + count * this->sectorSize, this->data + it->second * this->sectorSize, this->sectorSize);
+        this->entries[it->second].flushing = true;
+        count++;
+    }
+
+    return count;
+}
+
+// Marks a collected run clean once it is on the card. Sectors rewritten during the write stay
+// dirty, after a failed write all of them do and are written again with the next flush.
+void SectorCache::finishFlush(uint32_t firstSector, size_t count, bool written)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        auto it = this->index.find(firstSector + i);
+        if(it == this->index.end() || !this->entries[it->second].flushing)
+            continue;
+
+        auto& entry = this->entries[it->second];
+        entry.flushing = false;
+        if(!written)
+            continue;
+
+        entry.dirty = false;
+        this->dirtyCount--;
+        this->stats.flushedSectors++;
+    }
+}
+
+void SectorCache::countReadHits(uint32_t count)
+{
+    this->stats.readHits += count;
+}
+
+void SectorCache::countReadMisses(uint32_t count)
+{
+    this->stats.readMisses += count;
+}
+
+SectorCacheStats SectorCache::getStats()
+{
+    return this->stats;
+}
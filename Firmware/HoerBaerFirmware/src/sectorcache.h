@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "userconfig.h"
+
+typedef struct {
+    uint32_t readHits;      // sectors served from the cache
+    uint32_t readMisses;    // cacheable sectors that had to be read from the card
+    uint32_t writes;        // sectors written into the cache
+    uint32_t writeHits;     // of these, rewrites of an already dirty sector (saved card writes)
+    uint32_t evictions;
+    uint32_t flushedSectors;
+} SectorCacheStats;
+
+typedef struct {
+    uint32_t sector;
+    uint32_t lastUse;
+    bool used;
+    bool dirty;
+    bool flushing;  // collected for writing, cleared by a rewrite in the meantime
+} SectorCacheEntry;
+
+// Write-back LRU cache of single sectors (in PSRAM). Only clean entries are evicted, dirty
+// ones stay until they are written to the card, so a full dirty cache rejects new sectors.
+class SectorCache {
+    private:
+        size_t capacity;
+        size_t sectorSize;
+        uint8_t* data;
+        std::vector<SectorCacheEntry, PsramAllocator<SectorCacheEntry>> entries;
+        std::unordered_map<uint32_t, uint16_t, std::hash<uint32_t>, std::equal_to<uint32_t>,
+            PsramAllocator<std::pair<const uint32_t, uint16_t>>> index;
+        uint32_t useCounter;
+        size_t dirtyCount;
+        SectorCacheStats stats;
+        int findVictim();
+    public:
+        SectorCache(size_t capacity, size_t sectorSize);
+        ~SectorCache();
+        SectorCache(const SectorCache&) = delete;
+        SectorCache& operator=(const SectorCache&) = delete;
+        const uint8_t* lookup(uint32_t sector);
+        bool containsAll(uint32_t sector, uint32_t count);
+        bool put(uint32_t sector, const uint8_t* sectorData, bool dirty);
+        void remove(uint32_t sector, uint32_t count);
+        size_t getCapacity();
+        size_t getDirtyCount();
+        size_t collectDirtyRun(uint32_t& firstSector, uint8_t* buffer, size_t maxSectors);
+        void finishFlush(uint32_t firstSector, size_t count, bool written);
+        void countReadHits(uint32_t count);
+        void countReadMisses(uint32_t count);
+        SectorCacheStats getStats();
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+// Publishes a small POD value from one writer to any number of readers on other tasks.
+// Readers never take a lock and never wait for a writer: the value is kept twice and the
+// sequence counter says which copy is stable (a sequence "latch"). While the writer updates
+// one copy, readers use the other. A reader retries only if the writer completed a write
+// during its copy. Writers must be serialized by the caller.
+// The copies are plain objects that a reader may copy while the writer changes them, formally
+// a data race. A torn copy is never returned: the sequence check after the copy discards it,
+// as in the Linux latch. The fences stand in for smp_wmb/smp_rmb around the copies.
+template<typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock values are copied byte wise");
+
+    private:
+        std::atomic<uint32_t> sequence;
+        T copies[2];
+    public:
+        SeqLock(const T& initial) : sequence(0)
+        {
+            this->copies[0] = initial;
+            this->copies[1] = initial;
+        }
+
+        SeqLock(const SeqLock&) = delete;
+        SeqLock& operator=(const SeqLock&) = delete;
+
+        void write(const T& value)
+        {
+            uint32_t sequence = this->sequence.load(std::memory_order_relaxed);
+
+            // copy 1 of the previous write has to be complete before readers are sent to it
+            std::atomic_thread_fence(std::memory_order_release);
+
+            // odd: readers switch to copy 1, copy 0 is updated
+            this->sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            this->copies[0] = value;
+
+            // even: readers switch back to copy 0, copy 1 is updated
+            std::atomic_thread_fence(std::memory_order_release);
+            this->sequence.store(sequence + 2, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            this->copies[1] = value;
+        }
+
+        // Returns the version of the value, counting up with every write
+        uint32_t read(T& value) const
+        {
+            while(true)
+            {
+                uint32_t sequence = this->sequence.load(std::memory_order_acquire);
+                value = this->copies[sequence & 1];
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(this->sequence.load(std::memory_order_relaxed) == sequence)
+                    return sequence / 2;
+            }
+        }
+};
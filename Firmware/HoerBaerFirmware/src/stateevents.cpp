@@ -0,0 +1,33 @@
+#include "stateevents.h"
+
+static EventGroupHandle_t stateEventGroup = NULL;
+
+void StateEvents::init()
+{
+    if(stateEventGroup == NULL)
+        stateEventGroup = xEventGroupCreate();
+}
+
+void StateEvents::publish(EventBits_t events)
+{
+    if(stateEventGroup != NULL)
+        xEventGroupSetBits(stateEventGroup, events);
+}
+
+// Blocks until one of the events is set, returns and clears the set ones (0 on timeout)
+EventBits_t StateEvents::wait(EventBits_t events, TickType_t timeout)
+{
+    if(stateEventGroup == NULL)
+        return 0;
+
+    return xEventGroupWaitBits(stateEventGroup, events, pdTRUE, pdFALSE, timeout) & events;
+}
+
+// Returns and clears the set events without waiting
+EventBits_t StateEvents::take(EventBits_t events)
+{
+    if(stateEventGroup == NULL)
+        return 0;
+
+    return xEventGroupClearBits(stateEventGroup, events) & events;
+}
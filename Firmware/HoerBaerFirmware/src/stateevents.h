@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/event_groups.h>
+
+// Change bits, set by the owner of a state whenever it changed
+#define STATE_EVENT_PLAYER      (1 << 0)    // AudioPlayer: playing info or volume
+#define STATE_EVENT_POWER       (1 << 1)    // Power: battery state read
+#define STATE_EVENT_NETWORK     (1 << 2)    // WLAN: connected, disconnected, got IP
+#define STATE_EVENT_BLE_CLIENT  (1 << 3)    // BLE: client connected, everything is sent again
+#define STATE_EVENT_BLE_REQUEST (1 << 4)    // BLE: library request queued
+#define STATE_EVENT_BLE_SESSION (1 << 5)    // BLE: bulk session started or ended, link parameters changed
+#define STATE_EVENTS_ALL (STATE_EVENT_PLAYER | STATE_EVENT_POWER | STATE_EVENT_NETWORK | STATE_EVENT_BLE_CLIENT | \
+    STATE_EVENT_BLE_REQUEST | STATE_EVENT_BLE_SESSION)
+
+// Change notification bus (one FreeRTOS event group): publishers set bits, a consumer waits
+// for any of them instead of polling. Publishing is cheap and never blocks, repeated changes
+// before the consumer runs collapse into one bit.
+class StateEvents {
+    public:
+        static void init();
+        static void publish(EventBits_t events);
+        static EventBits_t wait(EventBits_t events, TickType_t timeout);
+        static EventBits_t take(EventBits_t events);
+};
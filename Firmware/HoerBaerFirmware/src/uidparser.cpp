@@ -0,0 +1,77 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "uidparser.h"
+
+bool UIDParser::parse(const char* uidString, std::array<uint8_t, UID_MAX_SIZE>& uidBuffer, uint8_t& uidSize) {
+    if (uidString == nullptr) {
+        return false;
+    }
+
+    uidBuffer.fill(0);
+    uidSize = 0;
+
+    size_t index = 0;
+    const size_t length = std::strlen(uidString);
+
+    while (index < length) {
+        while (index < length && (uidString[index] == ':' || uidString[index] == '-' || uidString[index] == ' ')) {
+            ++index;
+        }
+
+        if (index >= length) {
+            break;
+        }
+
+        if (uidSize >= uidBuffer.size()) {
+            return false;
+        }
+
+        if (index + 1 >= length) {
+            return false;
+        }
+
+        char high = uidString[index];
+        char low = uidString[index + 1];
+
+        if (!std::isxdigit(static_cast<unsigned char>(high)) ||
+            !std::isxdigit(static_cast<unsigned char>(low))) {
+            return false;
+        }
+
+        char hexByte[3] = {high, low, '\0'};
+        char* endPtr = nullptr;
+        auto value = std::strtoul(hexByte, &endPtr, 16);
+        if (endPtr == nullptr || *endPtr != '\0' || value > 0xFF) {
+            return false;
+        }
+
+        uidBuffer[uidSize++] = static_cast<uint8_t>(value & 0xFF);
+        index += 2;
+    }
+
+    return uidSize > 0;
+}
+
+size_t UIDParser::format(const uint8_t* uid, uint8_t uidSize, char* buffer, size_t bufferSize) {
+    if (buffer == nullptr || bufferSize == 0) {
+        return 0;
+    }
+
+    buffer[0] = '\0';
+    size_t offset = 0;
+    for (uint8_t i = 0; i < uidSize && offset < bufferSize; ++i) {
+        int written = std::snprintf(buffer + offset, bufferSize - offset, "%02X", uid[i]);
+        if (written < 0) {
+            break;
+        }
+        offset += static_cast<size_t>(written);
+        if (i + 1 < uidSize && offset < bufferSize - 1) {
+            buffer[offset++] = ':';
+            buffer[offset] = '\0';
+        }
+    }
+
+    return offset < bufferSize ? offset : bufferSize - 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#define UID_MAX_SIZE 10
+
+class UIDParser {
+    public:
+        // parses "04:A3:1F:22" style strings (separators ':', '-' or ' ' are optional)
+        static bool parse(const char* uidString, std::array<uint8_t, UID_MAX_SIZE>& uidBuffer, uint8_t& uidSize);
+        // formats to "04:A3:1F:22", returns the string length
+        static size_t format(const uint8_t* uid, uint8_t uidSize, char* buffer, size_t bufferSize);
+};
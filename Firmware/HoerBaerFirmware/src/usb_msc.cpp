@@ -1,27 +1,28 @@
 #include <Arduino.h>
 #include "log.h"
+#include "config.h"
 #include "USB.h"
 #include "USBMSC.h"
 
 #include "usb_msc.h"
 
-// TODO: find out from SD card
-#define DISK_SECTOR_SIZE 512
-
 // ugly globals... missing context in callbacks
 static USBMSC msc;
-static FSTYPE* usbmsc_sd;
-static size_t usbmc_sdSectorCount;
-static size_t usbmc_sdSectorSize;
+static BlockDevice* usbmscDevice;
+static MSCPipeline* usbmscPipeline;
 
 int32_t onRead(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 int32_t onWrite(uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
 bool onStartStop(uint8_t power_condition, bool start, bool load_eject);
 
 USBStorage::USBStorage(shared_ptr<SDCard> sdCard) {
-    usbmsc_sd = &sdCard->getFs();
-    usbmc_sdSectorCount = sdCard->getSectorCount();
-    usbmc_sdSectorSize = sdCard->getSectorSize();
+    size_t sectorCount = sdCard->getSectorCount();
+    size_t sectorSize = sdCard->getSectorSize();
+    this->blockDevice = make_shared<BlockDevice>(sdCard->getDiskDrive(), sectorCount, sectorSize);
+    this->lastThroughputLog = 0;
+    this->pipeline = make_unique<MSCPipeline>(this->blockDevice);
+    usbmscDevice = this->blockDevice.get();
+    usbmscPipeline = this->pipeline.get();
 }
 
 void USBStorage::initialize() {
@@ -33,56 +34,60 @@ void USBStorage::initialize() {
     msc.onWrite(onWrite);
     msc.onStartStop(onStartStop);
     msc.mediaPresent(true);
+    this->pipeline->initialize();
     USB.begin();
 
-    if(!msc.begin(usbmc_sdSectorCount, usbmc_sdSectorSize))
+    if(!msc.begin(this->blockDevice->getSectorCount(), this->blockDevice->getSectorSize()))
         throw std::runtime_error("Failed to initialize USB Mass Storage");
 
-    Log::println("USBMSC", "Initialized! Sector count: %i, Sector size: %i", usbmc_sdSectorCount, usbmc_sdSectorSize);
+    Log::println("USBMSC", "Initialized! Sector count: %i, Sector size: %i", 
+        this->blockDevice->getSectorCount(), this->blockDevice->getSectorSize());
+}
+
+void USBStorage::loop() {
+    auto tickCount = xTaskGetTickCount();
+    if(tickCount - this->lastThroughputLog < pdMS_TO_TICKS(USB_MSC_THROUGHPUT_LOG_INTERVAL_MILLIS))
+        return;
+
+    this->lastThroughputLog = tickCount;
+    this->blockDevice->logThroughput();
+    this->pipeline->logCacheStats();
 }
 
-// SD card read callback
+// Writes cached and queued sectors to the card, e.g. before deep sleep
+bool USBStorage::flush() {
+    return this->pipeline->flush();
+}
+
+// SD card read callback, served from the read-ahead buffers of the pipeline
 int32_t onRead(uint32_t startSector, uint32_t offset, void* buffer, uint32_t bufsize) {
-    uint8_t *dst = (uint8_t *)buffer;
-    size_t sectorsToRead = bufsize / usbmc_sdSectorSize;
-
-    for (int i = 0; i < sectorsToRead; i++)
-    {
-      if (!usbmsc_sd->readRAW(dst, startSector + i))
-      {
-        Log::println("USBMSC", "Failed to read sector %d", startSector + i);
-        return -1;
-      }
+    size_t sectorsToRead = bufsize / usbmscDevice->getSectorSize();
 
-      dst += usbmc_sdSectorSize;
-    }
+    if (!usbmscPipeline->read((uint8_t*)buffer, startSector, sectorsToRead))
+        return -1;
 
-    // Log::println("USBMSC", "Read %d sectors from start sector %d", sectorsToRead, startSector);
     return bufsize;
 }
 
-  // SD card write callback
+// SD card write callback, acknowledged once the data is queued for the pipeline worker
 int32_t onWrite(uint32_t startSector, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
-    size_t sectorsToWrite = bufsize / usbmc_sdSectorSize;
-    bool res = true;
-    for (int i = 0; i < sectorsToWrite; i++)
-    {
-        res = usbmsc_sd->writeRAW((uint8_t *)buffer, startSector + i);
-        if (!res)
-        {
-            Log::println("USBMSC", "Failed to write sector %d", startSector + i);
-            break;
-        }
-
-        buffer += usbmc_sdSectorSize;
-    }
+    size_t sectorsToWrite = bufsize / usbmscDevice->getSectorSize();
+
+    if (!usbmscPipeline->write(buffer, startSector, sectorsToWrite))
+        return -1;
 
-    // Log::println("USBMSC", "Written %d sectors from start sector %d", sectorsToWrite, startSector);
     return bufsize;
 }
-  
+
 bool onStartStop(uint8_t power_condition, bool start, bool load_eject) {
     Log::println("USBMSC", "StartStop: %d %d %d", power_condition, start, load_eject);
+
+    // eject or stop: everything acknowledged has to be on the card before the host lets go
+    if (!start && !usbmscPipeline->flush()) {
+        Log::println("USBMSC", "Flush on stop failed");
+        return false;
+    }
+
 //     if (load_eject)
 //     {
 //   #ifndef SD_CARD_SPEED_TEST
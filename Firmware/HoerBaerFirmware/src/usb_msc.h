@@ -2,11 +2,19 @@
 
 #include <memory>
 #include "sdcard.h"
+#include "blockdevice.h"
+#include "mscpipeline.h"
 
 using namespace std;
 
 class USBStorage {
+    private:
+        shared_ptr<BlockDevice> blockDevice;
+        unique_ptr<MSCPipeline> pipeline;
+        TickType_t lastThroughputLog;
     public:
         USBStorage(shared_ptr<SDCard> sdCard);
         void initialize();
+        void loop();
+        bool flush();
 };
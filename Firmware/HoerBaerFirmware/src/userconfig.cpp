@@ -2,10 +2,9 @@
 #include "config.h"
 #include "userconfig.h"
 #include "userconfig_default.h"
+#include "uidparser.h"
 
 #include <algorithm>
-#include <cctype>
-#include <cstdlib>
 #include <cstring>
 #include <utility>
 
@@ -32,56 +31,6 @@ std::shared_ptr<T> makeSharedPsram(Args&&... args) {
 
     return std::shared_ptr<T>(instance, deleter);
 }
-
-bool parseUidString(const char* uidString, std::array<uint8_t, 10>& uidBuffer, uint8_t& uidSize) {
-    if (uidString == nullptr) {
-        return false;
-    }
-
-    uidBuffer.fill(0);
-    uidSize = 0;
-
-    size_t index = 0;
-    const size_t length = std::strlen(uidString);
-
-    while (index < length) {
-        while (index < length && (uidString[index] == ':' || uidString[index] == '-' || uidString[index] == ' ')) {
-            ++index;
-        }
-
-        if (index >= length) {
-            break;
-        }
-
-        if (uidSize >= uidBuffer.size()) {
-            return false;
-        }
-
-        if (index + 1 >= length) {
-            return false;
-        }
-
-        char high = uidString[index];
-        char low = uidString[index + 1];
-
-        if (!std::isxdigit(static_cast<unsigned char>(high)) ||
-            !std::isxdigit(static_cast<unsigned char>(low))) {
-            return false;
-        }
-
-        char hexByte[3] = {high, low, '\0'};
-        char* endPtr = nullptr;
-        auto value = std::strtoul(hexByte, &endPtr, 16);
-        if (endPtr == nullptr || *endPtr != '\0' || value > 0xFF) {
-            return false;
-        }
-
-        uidBuffer[uidSize++] = static_cast<uint8_t>(value & 0xFF);
-        index += 2;
-    }
-
-    return uidSize > 0;
-}
 } // namespace
 
 UserConfig::UserConfig(std::shared_ptr<SDCard> sdCard)
@@ -271,8 +220,10 @@ void UserConfig::initializeRfid() {
             RfidTagMapping mapping{};
             mapping.uid.fill(0);
             mapping.uidSize = 0;
+            mapping.slot = RFID_MAPPING_UNRESOLVED;
+            mapping.index = RFID_MAPPING_UNRESOLVED;
 
-            if (!parseUidString(uidString, mapping.uid, mapping.uidSize)) {
+            if (!UIDParser::parse(uidString, mapping.uid, mapping.uidSize)) {
                 Log::println("USRCFG", "- Unable to parse UID %s", uidString ? uidString : "<null>");
                 continue;
             }
@@ -80,10 +80,14 @@ typedef struct {
     bool mono;
 } AudioConfig;
 
+#define RFID_MAPPING_UNRESOLVED -1
+
 struct RfidTagMapping {
     std::array<uint8_t, 10> uid;
     uint8_t uidSize;
     PsramString filePath;
+    int slot;   // track coordinates of filePath, resolved when the slot metadata is loaded
+    int index;
 };
 
 using SlotDirectoryList = std::vector<PsramString, PsramAllocator<PsramString>>;
@@ -3,6 +3,7 @@
 #include <AsyncTCP.h>
 #include "log.h"
 #include "webserver.h"
+#include "latencytrace.h"
 
 WebServer::WebServer(std::shared_ptr<AudioPlayer> audioPlayer) 
 {    
@@ -29,6 +30,19 @@ WebServer::WebServer(std::shared_ptr<AudioPlayer> audioPlayer)
         request->send(response);
     });
 
+    this->server->on("/api/latency", HTTP_GET, [&](AsyncWebServerRequest *request) {
+        Log::println("WEBSRV", "GET /api/latency FROM %s - get latency histograms",
+            request->client()->remoteIP().toString().c_str());
+
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+
+        DynamicJsonDocument doc(JSON_BUFFER_SIZE_LATENCY);
+        LatencyTrace::serialize(doc);
+
+        serializeJson(doc, *response);
+        request->send(response);
+    });
+
     // this->server->serveStatic("/alarmclock", spiffs, "/webinterface/index.html");
     // this->server->serveStatic("/wifi", spiffs, "/webinterface/index.html");
     // this->server->serveStatic("/", spiffs, "/webinterface/")
@@ -1,6 +1,7 @@
 #include <WiFi.h>
 #include "wlan.h"
 #include "log.h"
+#include "stateevents.h"
 
 WLAN::WLAN(std::shared_ptr<UserConfig> userConfig) {
   this->userConfig = userConfig;
@@ -16,6 +17,7 @@ void WLAN::connectIfConfigured() {
 
     WiFi.onEvent([&](WiFiEvent_t event, WiFiEventInfo_t info) {
       this->connected = true;
+      StateEvents::publish(STATE_EVENT_NETWORK);
       Log::println("WiFi", "Connected to AccessPoint.");
       Log::logCurrentHeap("After ARDUINO_EVENT_WIFI_STA_CONNECTED");
     }, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_CONNECTED);
@@ -24,6 +26,7 @@ void WLAN::connectIfConfigured() {
       Log::logCurrentHeap("After ARDUINO_EVENT_WIFI_STA_GOT_IP");
       this->connected = true;
       this->ipV4 = WiFi.localIP();
+      StateEvents::publish(STATE_EVENT_NETWORK);
       Log::println("WiFi", "IP Address: %s", WiFi.localIP().toString().c_str());
       configTime(0, 0, "pool.ntp.org");
       auto tz = userConfig->getTimezone();
@@ -34,6 +37,7 @@ void WLAN::connectIfConfigured() {
 
     WiFi.onEvent([&](WiFiEvent_t event, WiFiEventInfo_t info) {
       this->connected = false;
+      StateEvents::publish(STATE_EVENT_NETWORK);
       Log::println("WiFi", "WiFi lost connection. Reason: %d. Trying to Reconnect...", info.wifi_sta_disconnected.reason);
       WiFi.begin(ssid.c_str(), password.c_str());
     }, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_DISCONNECTED);